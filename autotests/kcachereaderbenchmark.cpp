@@ -0,0 +1,92 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kdirtree.h"
+#include "kdirtreecache.h"
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QTest>
+#include <zlib.h>
+
+using namespace KDirStat;
+
+/**
+ * Benchmark of reading a text cache file of a wide tree, where the parent
+ * of almost every directory line is not the directory right before it,
+ * so it has to be looked up by its path.
+ **/
+class KCacheReaderBenchmark : public QObject {
+  Q_OBJECT
+
+private slots:
+  void read_data();
+  void read();
+
+private:
+  QTemporaryDir _tmpDir;
+};
+
+/**
+ * Write a cache file with 'dirs' directories below the toplevel directory,
+ * each of them with 'subDirs' subdirectories with one file each.
+ **/
+static bool writeCache(const QString &fileName, int dirs, int subDirs) {
+  gzFile cache = gzopen(fileName.toLocal8Bit(), "w1");
+
+  if (!cache)
+    return false;
+
+  gzputs(cache, "[kdirstat 4.3 cache file]\n"
+                "D /bench\t4K\t0x0\n");
+
+  for (int d = 0; d < dirs; d++) {
+    gzprintf(cache, "D /bench/dir%d\t4K\t0x0\n", d);
+
+    for (int s = 0; s < subDirs; s++) {
+      gzprintf(cache, "D /bench/dir%d/sub%d\t4K\t0x0\n", d, s);
+      gzputs(cache, "F\tfile\t1K\t0x0\n");
+    }
+  }
+
+  return gzclose(cache) == Z_OK;
+}
+
+void KCacheReaderBenchmark::read_data() {
+  QTest::addColumn<int>("dirs");
+  QTest::addColumn<int>("subDirs");
+
+  QTest::newRow("100k dirs") << 100 << 1000;
+  QTest::newRow("1M dirs") << 1000 << 1000;
+}
+
+void KCacheReaderBenchmark::read() {
+  QFETCH(int, dirs);
+  QFETCH(int, subDirs);
+
+  QVERIFY(_tmpDir.isValid());
+  QString fileName =
+      _tmpDir.path() + "/" + QTest::currentDataTag() + ".cache.gz";
+  QVERIFY(writeCache(fileName, dirs, subDirs));
+
+  KDirTree tree;
+  KCacheReader reader(fileName, &tree);
+  reader.setDetached(true, KExcludeRules());
+
+  QElapsedTimer timer;
+  timer.start();
+  reader.read();
+  KDirInfo *subtree = reader.takeSubtree();
+  QTest::setBenchmarkResult(timer.nsecsElapsed() / 1000000.0,
+                            QTest::WalltimeMilliseconds);
+
+  QVERIFY(subtree);
+  QCOMPARE(subtree->totalSubDirs(), KFileCount(dirs + dirs * subDirs));
+  QCOMPARE(subtree->totalFiles(), KFileCount(dirs * subDirs));
+
+  delete subtree;
+}
+
+QTEST_GUILESS_MAIN(KCacheReaderBenchmark)
+
+#include "kcachereaderbenchmark.moc"
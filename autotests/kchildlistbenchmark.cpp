@@ -0,0 +1,97 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kchildlist.h"
+#include <QTest>
+#include <memory>
+#include <vector>
+
+using namespace KDirStat;
+
+/**
+ * Benchmark of @ref KChildList against the std::vector it replaced, at
+ * both ends of the directory size distribution: millions of directories
+ * with a handful of children each, and a few directories with hundreds of
+ * thousands of children. Each iteration fills all lists, walks them once
+ * and destroys them, just like reading and discarding a tree.
+ **/
+class KChildListBenchmark : public QObject {
+  Q_OBJECT
+
+private slots:
+  void childList_data();
+  void childList();
+  void vector_data();
+  void vector();
+};
+
+static KFileInfo *fakeEntry(size_t i) {
+  return reinterpret_cast<KFileInfo *>((i + 1) * sizeof(void *));
+}
+
+static void shapes() {
+  QTest::addColumn<int>("dirs");
+  QTest::addColumn<int>("children");
+
+  QTest::newRow("1M dirs x 1") << 1000000 << 1;
+  QTest::newRow("1M dirs x 3") << 1000000 << 3;
+  QTest::newRow("500k dirs x 8") << 500000 << 8;
+  QTest::newRow("100k dirs x 40") << 100000 << 40;
+  QTest::newRow("10 dirs x 400k") << 10 << 400000;
+  QTest::newRow("1 dir x 4M") << 1 << 4000000;
+}
+
+static volatile size_t sink;
+
+void KChildListBenchmark::childList_data() { shapes(); }
+
+void KChildListBenchmark::childList() {
+  QFETCH(int, dirs);
+  QFETCH(int, children);
+
+  QBENCHMARK {
+    std::unique_ptr<KChildList[]> lists(new KChildList[dirs]);
+    size_t sum = 0;
+
+    for (int d = 0; d < dirs; d++)
+      for (int c = 0; c < children; c++)
+        lists[d].push_back(fakeEntry(c));
+
+    for (int d = 0; d < dirs; d++)
+      lists[d].forEach([&](KFileInfo *item) { sum += size_t(item); });
+
+    sink = sum;
+  }
+}
+
+void KChildListBenchmark::vector_data() { shapes(); }
+
+void KChildListBenchmark::vector() {
+  QFETCH(int, dirs);
+  QFETCH(int, children);
+
+  QBENCHMARK {
+    std::unique_ptr<std::vector<KFileInfo *>[]> lists(
+        new std::vector<KFileInfo *>[dirs]);
+    size_t sum = 0;
+
+    for (int d = 0; d < dirs; d++) {
+      for (int c = 0; c < children; c++)
+        lists[d].push_back(fakeEntry(c));
+
+      // What KDirInfo::cleanupDotEntries() used to do
+      lists[d].shrink_to_fit();
+    }
+
+    for (int d = 0; d < dirs; d++)
+      for (KFileInfo *item : lists[d])
+        sum += size_t(item);
+
+    sink = sum;
+  }
+}
+
+QTEST_GUILESS_MAIN(KChildListBenchmark)
+
+#include "kchildlistbenchmark.moc"
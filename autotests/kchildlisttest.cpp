@@ -0,0 +1,128 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kchildlist.h"
+#include <QTest>
+#include <vector>
+
+using namespace KDirStat;
+
+/**
+ * Functional test of @ref KChildList across the inline storage, the
+ * doubling first chunk and the fixed-size chunks.
+ **/
+class KChildListTest : public QObject {
+  Q_OBJECT
+
+private slots:
+  void pushBack_data();
+  void pushBack();
+  void swap();
+  void swapRemove_data();
+  void swapRemove();
+};
+
+// The list never dereferences its entries, so fake pointers will do.
+static KFileInfo *fakeEntry(size_t i) {
+  return reinterpret_cast<KFileInfo *>((i + 1) * sizeof(void *));
+}
+
+static void sizes() {
+  QTest::addColumn<int>("count");
+
+  // Both sides of each storage transition
+  QTest::newRow("empty") << 0;
+  QTest::newRow("inline") << 3;
+  QTest::newRow("first chunk") << 4;
+  QTest::newRow("first chunk full") << 1024;
+  QTest::newRow("second chunk") << 1025;
+  QTest::newRow("chunk directory growth") << 4097;
+  QTest::newRow("huge") << 100000;
+}
+
+void KChildListTest::pushBack_data() { sizes(); }
+
+void KChildListTest::pushBack() {
+  QFETCH(int, count);
+
+  KChildList list;
+
+  for (int i = 0; i < count; i++)
+    list.push_back(fakeEntry(i));
+
+  QCOMPARE(list.size(), size_t(count));
+  QCOMPARE(list.empty(), count == 0);
+
+  for (int i = 0; i < count; i++)
+    QCOMPARE(list[i], fakeEntry(i));
+
+  size_t visited = 0;
+  bool inOrder = true;
+
+  list.forEach([&](KFileInfo *item) {
+    inOrder = inOrder && item == fakeEntry(visited);
+    visited++;
+  });
+
+  QCOMPARE(visited, size_t(count));
+  QVERIFY(inOrder);
+
+  list.clear();
+  QVERIFY(list.empty());
+}
+
+void KChildListTest::swap() {
+  KChildList small;
+  KChildList big;
+
+  small.push_back(fakeEntry(0));
+
+  for (int i = 0; i < 2000; i++)
+    big.push_back(fakeEntry(i));
+
+  small.swap(big);
+
+  QCOMPARE(small.size(), size_t(2000));
+  QCOMPARE(big.size(), size_t(1));
+  QCOMPARE(small[1999], fakeEntry(1999));
+  QCOMPARE(big[0], fakeEntry(0));
+}
+
+void KChildListTest::swapRemove_data() { sizes(); }
+
+void KChildListTest::swapRemove() {
+  QFETCH(int, count);
+
+  KChildList list;
+  std::vector<KFileInfo *> expected;
+
+  for (int i = 0; i < count; i++) {
+    list.push_back(fakeEntry(i));
+    expected.push_back(fakeEntry(i));
+  }
+
+  QCOMPARE(list.swapRemove(count), (KFileInfo *)0);
+
+  while (!list.empty()) {
+    size_t i = list.size() / 2;
+    KFileInfo *moved = list.swapRemove(i);
+
+    if (i == expected.size() - 1) {
+      QCOMPARE(moved, (KFileInfo *)0);
+    } else {
+      QCOMPARE(moved, expected.back());
+      expected[i] = expected.back();
+    }
+
+    expected.pop_back();
+    QCOMPARE(list.size(), expected.size());
+
+    if (!expected.empty())
+      QCOMPARE(list[expected.size() - 1], expected.back());
+  }
+}
+
+QTEST_GUILESS_MAIN(KChildListTest)
+
+#include "kchildlisttest.moc"
@@ -0,0 +1,98 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kdirinfo.h"
+#include <QTest>
+#include <sys/stat.h>
+
+using namespace KDirStat;
+
+/**
+ * Test of the summary fields of @ref KDirInfo with counts that don't fit
+ * into 32 bits.
+ **/
+class KDirInfoTest : public QObject {
+  Q_OBJECT
+
+private slots:
+  void hugeCounts();
+  void dirtySubtree();
+};
+
+static const KFileCount FourG = KFileCount(1) << 32;
+
+static KDirInfo *newAggregate(KDirInfo *parent, const QString &name,
+                              KFileCount items) {
+  KDirInfo *dir = new KDirInfo(parent, name, S_IFDIR | 0755, 4096, 0);
+
+  // Everything in there is a file of one 512 byte block
+  dir->setAggregate(items * 512, items, items, 0, items, 0);
+  parent->insertChild(dir);
+
+  return dir;
+}
+
+void KDirInfoTest::hugeCounts() {
+  KDirInfo *root = new KDirInfo(0, "/", S_IFDIR | 0755, 4096, 0);
+  KDirInfo *first = newAggregate(root, "first", FourG + 1);
+  newAggregate(root, "second", 2 * FourG + 2);
+
+  // Get rid of the empty dot entry, recalc() would count it as an item
+  root->finalizeLocal();
+
+  // Summed up as they are added (KDirInfo::childAdded())
+
+  QCOMPARE(root->totalItems(), 3 * FourG + 3 + 2);
+  QCOMPARE(root->totalSubDirs(), KFileCount(2));
+  QCOMPARE(root->totalFiles(), 3 * FourG + 3);
+  QCOMPARE(root->totalSize(), (3 * FourG + 3) * 512 + 4096);
+
+  // Summed up from scratch (KDirInfo::recalc())
+
+  root->markAsDirty();
+  QVERIFY(root->isDirty());
+  QCOMPARE(root->totalItems(), 3 * FourG + 3 + 2);
+  QCOMPARE(root->totalSubDirs(), KFileCount(2));
+  QCOMPARE(root->totalFiles(), 3 * FourG + 3);
+  QCOMPARE(root->totalSize(), (3 * FourG + 3) * 512 + 4096);
+  QVERIFY(!root->isDirty());
+
+  // Subtracted as it is deleted (KDirInfo::deletingChild())
+
+  root->deletingChild(first);
+  delete first;
+
+  QCOMPARE(root->totalItems(), 2 * FourG + 2 + 1);
+  QCOMPARE(root->totalSubDirs(), KFileCount(1));
+  QCOMPARE(root->totalFiles(), 2 * FourG + 2);
+  QCOMPARE(root->totalSize(), (2 * FourG + 2) * 512 + 4096);
+
+  delete root;
+}
+
+void KDirInfoTest::dirtySubtree() {
+  // Like a cache reader: Everything is dirty until it is all there, and
+  // a directory may be built before it is inserted into its parent.
+
+  KDirInfo *root = new KDirInfo(0, "/", S_IFDIR | 0755, 4096, 0);
+  root->markAsDirty();
+
+  KDirInfo *dir = new KDirInfo(root, "dir", S_IFDIR | 0755, 4096, 0);
+  dir->markAsDirty();
+  dir->insertChild(new KFileInfo(dir, "file", S_IFREG | 0644, 1000, 0));
+  root->insertChild(dir);
+
+  // The empty dot entry is gone only now, so it must not be counted
+  root->finalizeAll(0);
+
+  QCOMPARE(dir->totalItems(), KFileCount(1));
+  QCOMPARE(root->totalItems(), KFileCount(2));
+  QCOMPARE(root->totalFiles(), KFileCount(1));
+
+  delete root;
+}
+
+QTEST_GUILESS_MAIN(KDirInfoTest)
+
+#include "kdirinfotest.moc"
@@ -0,0 +1,93 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kdirtree.h"
+#include <KSharedConfig>
+#include <QElapsedTimer>
+#include <QStandardPaths>
+#include <QTest>
+#include <kconfiggroup.h>
+#include <sys/stat.h>
+
+using namespace KDirStat;
+
+/**
+ * Benchmark of how long @ref KDirTree::deleteSubtree() blocks the calling
+ * (GUI) thread, with and without the background reclaimer.
+ **/
+class KDirTreeBenchmark : public QObject {
+  Q_OBJECT
+
+private slots:
+  void initTestCase();
+  void deleteSubtree_data();
+  void deleteSubtree();
+};
+
+void KDirTreeBenchmark::initTestCase() {
+  QStandardPaths::setTestModeEnabled(true);
+}
+
+static KDirInfo *buildSubtree(KDirInfo *parent, int dirs, int filesPerDir) {
+  KDirInfo *top = new KDirInfo(parent, "top", S_IFDIR | 0755, 4096, 0);
+  parent->insertChild(top);
+
+  for (int d = 0; d < dirs; d++) {
+    KDirInfo *dir =
+        new KDirInfo(top, QString::number(d), S_IFDIR | 0755, 4096, 0);
+    top->insertChild(dir);
+
+    for (int f = 0; f < filesPerDir; f++) {
+      KFileInfo *file = new KFileInfo(dir, QString::number(f),
+                                      S_IFREG | 0644, 1000, 0);
+      dir->insertChild(file);
+    }
+
+    dir->finalizeLocal();
+  }
+
+  top->finalizeLocal();
+
+  return top;
+}
+
+void KDirTreeBenchmark::deleteSubtree_data() {
+  QTest::addColumn<int>("dirs");
+  QTest::addColumn<int>("filesPerDir");
+  QTest::addColumn<bool>("background");
+
+  QTest::newRow("100k items, GUI thread") << 1000 << 100 << false;
+  QTest::newRow("100k items, reclaimer") << 1000 << 100 << true;
+  QTest::newRow("1M items, GUI thread") << 10000 << 100 << false;
+  QTest::newRow("1M items, reclaimer") << 10000 << 100 << true;
+  QTest::newRow("5M items, GUI thread") << 50000 << 100 << false;
+  QTest::newRow("5M items, reclaimer") << 50000 << 100 << true;
+}
+
+void KDirTreeBenchmark::deleteSubtree() {
+  QFETCH(int, dirs);
+  QFETCH(int, filesPerDir);
+  QFETCH(bool, background);
+
+  KSharedConfig::openConfig()
+      ->group("Directory Reading")
+      .writeEntry("ReclaimInBackground", background);
+
+  KDirTree tree;
+  KDirInfo *root = new KDirInfo(0, "/", S_IFDIR | 0755, 4096, 0);
+  tree.setRoot(root);
+  KDirInfo *subtree = buildSubtree(root, dirs, filesPerDir);
+
+  QElapsedTimer timer;
+  timer.start();
+  tree.deleteSubtree(subtree);
+  QTest::setBenchmarkResult(timer.nsecsElapsed() / 1000000.0,
+                            QTest::WalltimeMilliseconds);
+
+  QCOMPARE(root->numChildren(), size_t(0));
+}
+
+QTEST_GUILESS_MAIN(KDirTreeBenchmark)
+
+#include "kdirtreebenchmark.moc"
@@ -0,0 +1,284 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kdirtree.h"
+#include "kdirtreecache.h"
+#include "kexcluderules.h"
+#include "kgzipmembers.h"
+#include <QTemporaryDir>
+#include <QTest>
+#include <sys/stat.h>
+
+using namespace KDirStat;
+
+/**
+ * Test of writing a tree to a cache file and reading it back.
+ **/
+class KDirTreeCacheTest : public QObject {
+  Q_OBJECT
+
+private slots:
+  void hugeCounts_data();
+  void hugeCounts();
+  void excludeRules();
+  void splice_data();
+  void splice();
+  void streamReplace();
+};
+
+static const KFileCount FourG = KFileCount(1) << 32;
+
+/**
+ * Read cache file 'fileName' into a new subtree of 'tree' and return it.
+ **/
+static KDirInfo *readCache(const QString &fileName, KDirTree *tree,
+                           const KExcludeRules &excludeRules = KExcludeRules()) {
+  KCacheReader reader(fileName, tree);
+  reader.setDetached(true, excludeRules);
+  reader.read();
+
+  return reader.takeSubtree();
+}
+
+void KDirTreeCacheTest::hugeCounts_data() {
+  QTest::addColumn<QString>("fileName");
+
+  QTest::newRow("text") << "cache.gz";
+  QTest::newRow("binary") << "cache.bin";
+}
+
+void KDirTreeCacheTest::hugeCounts() {
+  QFETCH(QString, fileName);
+
+  QTemporaryDir tmpDir;
+  QVERIFY(tmpDir.isValid());
+  fileName = tmpDir.path() + "/" + fileName;
+
+  // A merged cache with more items below one directory than 32 bits can
+  // count. Only its totals are left.
+
+  KDirTree tree;
+  KDirInfo *root = new KDirInfo(0, "/huge", S_IFDIR | 0755, 4096, 0);
+  tree.setRoot(root);
+
+  KDirInfo *merged = new KDirInfo(root, "merged", S_IFDIR | 0755, 4096, 0);
+  merged->setAggregate((3 * FourG) * 512, 3 * FourG, 3 * FourG + 7, 7,
+                       3 * FourG, 0);
+  root->insertChild(merged);
+  root->finalizeLocal();
+
+  QVERIFY(KCacheWriter(fileName, &tree).ok());
+
+  KDirTree readTree;
+  KDirInfo *subtree = readCache(fileName, &readTree);
+  QVERIFY(subtree);
+  QCOMPARE(subtree->totalItems(), 3 * FourG + 7 + 1);
+  QCOMPARE(subtree->totalSubDirs(), KFileCount(7 + 1));
+  QCOMPARE(subtree->totalFiles(), 3 * FourG);
+  QCOMPARE(subtree->totalSize(), (3 * FourG) * 512 + 4096);
+
+  delete subtree;
+}
+
+void KDirTreeCacheTest::excludeRules() {
+  QTemporaryDir tmpDir;
+  QVERIFY(tmpDir.isValid());
+  QString fileName = tmpDir.path() + "/cache.gz";
+
+  KDirTree tree;
+  KDirInfo *root = new KDirInfo(0, "/src", S_IFDIR | 0755, 4096, 0);
+  tree.setRoot(root);
+
+  const char *names[] = {"lib", "build", "doc"};
+
+  for (const char *name : names) {
+    KDirInfo *dir = new KDirInfo(root, name, S_IFDIR | 0755, 4096, 0);
+    root->insertChild(dir);
+    dir->insertChild(new KFileInfo(dir, "file", S_IFREG | 0644, 1000, 0));
+    dir->finalizeLocal();
+  }
+
+  root->finalizeLocal();
+  QVERIFY(KCacheWriter(fileName, &tree).ok());
+
+  // The reader uses its own copy of the rules, not the global ones
+
+  KExcludeRules excludeRules;
+  excludeRules.add(new KExcludeRule(QRegExp(".*/build")));
+
+  KDirTree readTree;
+  KDirInfo *subtree = readCache(fileName, &readTree, excludeRules);
+  QVERIFY(subtree);
+  QCOMPARE(subtree->numChildren(), size_t(3));
+
+  for (size_t i = 0; i < subtree->numChildren(); i++) {
+    KFileInfo *dir = subtree->child(i);
+    QCOMPARE(dir->isExcluded(), dir->name() == "build");
+    QCOMPARE(dir->totalItems(), dir->isExcluded() ? KFileCount(0) : 1);
+  }
+
+  delete subtree;
+}
+
+/**
+ * How a cache file is read in KDirStat: all at once in a pool thread, by
+ * one of many such threads, or bit by bit right into the tree.
+ **/
+enum ReadMode { ParallelMembers, SerialMembers, Lines, LinesIntoTree };
+Q_DECLARE_METATYPE(ReadMode)
+
+void KDirTreeCacheTest::splice_data() {
+  QTest::addColumn<ReadMode>("mode");
+
+  QTest::newRow("parallel members") << ParallelMembers;
+  QTest::newRow("serial members") << SerialMembers;
+  QTest::newRow("lines") << Lines;
+  QTest::newRow("lines into tree") << LinesIntoTree;
+}
+
+void KDirTreeCacheTest::splice() {
+  QFETCH(ReadMode, mode);
+
+  QTemporaryDir tmpDir;
+  QVERIFY(tmpDir.isValid());
+  QString fileName = tmpDir.path() + "/cache.gz";
+
+  KDirTree tree;
+  KDirInfo *root = new KDirInfo(0, "/src", S_IFDIR | 0755, 4096, 0);
+  tree.setRoot(root);
+
+  KDirInfo *lib = new KDirInfo(root, "lib", S_IFDIR | 0755, 4096, 0);
+  root->insertChild(lib);
+  lib->insertChild(new KFileInfo(lib, "a", S_IFREG | 0644, 1000, 0));
+  KFileInfo *file = new KFileInfo(lib, "b", S_IFREG | 0644, 1000, 0);
+  lib->insertChild(file);
+  lib->finalizeLocal();
+
+  KDirInfo *doc = new KDirInfo(root, "doc", S_IFDIR | 0755, 4096, 0);
+  root->insertChild(doc);
+  doc->insertChild(new KFileInfo(doc, "c", S_IFREG | 0644, 1000, 0));
+  KDirInfo *sub = new KDirInfo(doc, "sub", S_IFDIR | 0755, 4096, 0);
+  doc->insertChild(sub);
+  sub->insertChild(new KFileInfo(sub, "d", S_IFREG | 0644, 1000, 0));
+  sub->finalizeLocal();
+  doc->finalizeLocal();
+  root->finalizeLocal();
+
+  QVERIFY(tree.writeCache(fileName));
+
+  // Deleting a file replaces the lines of its directory, deleting a
+  // directory those of its subtree.
+
+  tree.deleteSubtree(file);
+  tree.deleteSubtree(sub);
+  QVERIFY(tree.writeCache(fileName));
+
+  KGzipMemberReader members;
+  QVERIFY(members.open(fileName));
+  QStringList replaced;
+
+  for (int i = 0; i < members.members().size(); i++) {
+    if (!members.members()[i].replaces.isEmpty())
+      replaced << QString::fromUtf8(members.members()[i].replaces);
+  }
+
+  QCOMPARE(replaced, QStringList() << "/src/doc/sub"
+                                   << "/src/lib");
+
+  KDirTree readTree;
+  KFileInfo *subtree = 0;
+
+  if (mode == LinesIntoTree) {
+    KCacheReader reader(fileName, &readTree);
+
+    while (reader.read(1000))
+      ;
+
+    subtree = readTree.root();
+  } else {
+    KCacheReader reader(fileName, &readTree);
+    reader.setDetached(true, KExcludeRules());
+    reader.setParallel(mode == ParallelMembers);
+
+    if (mode == Lines) {
+      while (reader.read(1000))
+        ;
+    } else
+      reader.read();
+
+    subtree = reader.takeSubtree();
+  }
+
+  QVERIFY(subtree);
+  QCOMPARE(subtree->numChildren(), size_t(2));
+
+  for (size_t i = 0; i < subtree->numChildren(); i++) {
+    KFileInfo *dir = subtree->child(i);
+
+    // Only "a" and "c" are left
+    QCOMPARE(dir->totalItems(), KFileCount(1));
+    QCOMPARE(dir->totalSubDirs(), KFileCount(0));
+  }
+
+  if (mode != LinesIntoTree)
+    delete subtree;
+}
+
+void KDirTreeCacheTest::streamReplace() {
+  QTemporaryDir tmpDir;
+  QVERIFY(tmpDir.isValid());
+  QString fileName = tmpDir.path() + "/cache.gz";
+
+  KDirTree tree;
+  KDirInfo *root = new KDirInfo(0, "/src", S_IFDIR | 0755, 4096, 0);
+  tree.setRoot(root);
+
+  KDirInfo *oldDir = new KDirInfo(root, "lib", S_IFDIR | 0755, 4096, 0);
+  root->insertChild(oldDir);
+  oldDir->insertChild(new KFileInfo(oldDir, "old", S_IFREG | 0644, 1000, 0));
+  KDirInfo *oldSub = new KDirInfo(oldDir, "sub", S_IFDIR | 0755, 4096, 0);
+  oldDir->insertChild(oldSub);
+  oldSub->finalizeLocal();
+  oldDir->finalizeLocal();
+  root->finalizeLocal();
+
+  KCacheStreamWriter writer(root->url());
+  QVERIFY(writer.open(fileName));
+  QVERIFY(!writer.replaceSubtree(oldDir->url())); // No toplevel yet
+
+  writer.addDir(oldSub);
+  writer.addDir(root);
+  writer.addDir(oldDir);
+  QVERIFY(!writer.replaceSubtree(root->url()));
+
+  // "lib" is refreshed while the tree is still being read
+
+  QVERIFY(writer.replaceSubtree(oldDir->url()));
+  root->deletingChild(oldDir);
+  delete oldDir;
+
+  KDirInfo *newDir = new KDirInfo(root, "lib", S_IFDIR | 0755, 4096, 0);
+  root->insertChild(newDir);
+  newDir->insertChild(new KFileInfo(newDir, "new", S_IFREG | 0644, 2000, 0));
+  newDir->finalizeLocal();
+  writer.addDir(newDir);
+  QVERIFY(writer.close());
+
+  KDirTree readTree;
+  KDirInfo *subtree = readCache(fileName, &readTree);
+  QVERIFY(subtree);
+  QCOMPARE(subtree->numChildren(), size_t(1));
+
+  KFileInfo *lib = subtree->child(0);
+  QVERIFY(lib->isDirInfo());
+  QCOMPARE(lib->name(), QString("lib"));
+  QCOMPARE(lib->totalItems(), KFileCount(1));
+  QCOMPARE(lib->totalSize(), KFileSize(2000 + 4096));
+
+  delete subtree;
+}
+
+QTEST_GUILESS_MAIN(KDirTreeCacheTest)
+
+#include "kdirtreecachetest.moc"
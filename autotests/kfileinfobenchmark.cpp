@@ -0,0 +1,108 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kdirinfo.h"
+#include <QTest>
+#include <sys/stat.h>
+#include <vector>
+
+using namespace KDirStat;
+
+/**
+ * Benchmark of @ref KFileInfo::treeLevel(), which the percentage bar
+ * delegate calls for each row it paints, against counting the levels up
+ * to the root as it used to.
+ **/
+class KFileInfoBenchmark : public QObject {
+  Q_OBJECT
+
+private slots:
+  void treeLevel_data();
+  void treeLevel();
+  void countedTreeLevel_data();
+  void countedTreeLevel();
+  void cleanupTestCase();
+
+private:
+  void buildTree(int depth, int filesPerDir);
+
+  KDirInfo *_root = nullptr;
+  std::vector<KFileInfo *> _items;
+};
+
+void KFileInfoBenchmark::buildTree(int depth, int filesPerDir) {
+  delete _root;
+  _items.clear();
+
+  _root = new KDirInfo(0, "/", S_IFDIR | 0755, 4096, 0);
+  KDirInfo *dir = _root;
+
+  for (int level = 0; level < depth; level++) {
+    for (int i = 0; i < filesPerDir; i++) {
+      KFileInfo *file = new KFileInfo(dir, QString::number(i),
+                                      S_IFREG | 0644, 1000, 0);
+      dir->insertChild(file);
+      _items.push_back(file);
+    }
+
+    KDirInfo *subDir = new KDirInfo(dir, "sub", S_IFDIR | 0755, 4096, 0);
+    dir->insertChild(subDir);
+    _items.push_back(subDir);
+    dir = subDir;
+  }
+}
+
+static void shapes() {
+  QTest::addColumn<int>("depth");
+  QTest::addColumn<int>("filesPerDir");
+
+  QTest::newRow("depth 10") << 10 << 100000;
+  QTest::newRow("depth 100") << 100 << 10000;
+  QTest::newRow("depth 1000") << 1000 << 1000;
+}
+
+static volatile long sink;
+
+void KFileInfoBenchmark::treeLevel_data() { shapes(); }
+
+void KFileInfoBenchmark::treeLevel() {
+  QFETCH(int, depth);
+  QFETCH(int, filesPerDir);
+  buildTree(depth, filesPerDir);
+
+  QBENCHMARK {
+    long sum = 0;
+
+    for (KFileInfo *item : _items)
+      sum += item->treeLevel();
+
+    sink = sum;
+  }
+}
+
+void KFileInfoBenchmark::countedTreeLevel_data() { shapes(); }
+
+void KFileInfoBenchmark::countedTreeLevel() {
+  QFETCH(int, depth);
+  QFETCH(int, filesPerDir);
+  buildTree(depth, filesPerDir);
+
+  QBENCHMARK {
+    long sum = 0;
+
+    for (KFileInfo *item : _items) {
+      for (KFileInfo *parent = item->parent(); parent;
+           parent = parent->parent())
+        sum++;
+    }
+
+    sink = sum;
+  }
+}
+
+void KFileInfoBenchmark::cleanupTestCase() { delete _root; }
+
+QTEST_GUILESS_MAIN(KFileInfoBenchmark)
+
+#include "kfileinfobenchmark.moc"
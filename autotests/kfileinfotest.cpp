@@ -0,0 +1,83 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kdirinfo.h"
+#include <QTest>
+#include <sys/stat.h>
+
+using namespace KDirStat;
+
+/**
+ * Test of the tree levels stored in @ref KFileInfo.
+ **/
+class KFileInfoTest : public QObject {
+  Q_OBJECT
+
+private slots:
+  void levels();
+  void graftedLevels();
+};
+
+static KDirInfo *newDir(KDirInfo *parent, const QString &name) {
+  KDirInfo *dir = new KDirInfo(parent, name, S_IFDIR | 0755, 4096, 0);
+
+  if (parent)
+    parent->insertChild(dir);
+
+  return dir;
+}
+
+static KFileInfo *newFile(KDirInfo *parent, const QString &name) {
+  KFileInfo *file = new KFileInfo(parent, name, S_IFREG | 0644, 1000, 0);
+  parent->insertChild(file);
+
+  return file;
+}
+
+void KFileInfoTest::levels() {
+  KDirInfo *root = newDir(0, "/");
+  KDirInfo *dir = newDir(root, "usr");
+  KDirInfo *subDir = newDir(dir, "lib");
+  KFileInfo *file = newFile(subDir, "libc.so");
+
+  QCOMPARE(root->treeLevel(), 0);
+  QCOMPARE(dir->treeLevel(), 1);
+  QCOMPARE(subDir->treeLevel(), 2);
+
+  // Files live in the dot entry, one level further down
+  QCOMPARE(subDir->dotEntry()->treeLevel(), 3);
+  QCOMPARE(file->treeLevel(), 4);
+
+  delete root;
+}
+
+void KFileInfoTest::graftedLevels() {
+  KDirInfo *root = newDir(0, "/");
+  KDirInfo *home = newDir(root, "home");
+
+  // Build a subtree on its own first, then move it into the tree
+  KDirInfo *graft = newDir(0, "user");
+  KDirInfo *deep = graft;
+
+  for (int i = 0; i < 100; i++)
+    deep = newDir(deep, QString::number(i));
+
+  KFileInfo *file = newFile(deep, "file");
+
+  QCOMPARE(deep->treeLevel(), 100);
+  QCOMPARE(file->treeLevel(), 102);
+
+  home->insertChild(graft);
+
+  QCOMPARE(graft->treeLevel(), 2);
+  QCOMPARE(deep->treeLevel(), 102);
+  QCOMPARE(deep->dotEntry()->treeLevel(), 103);
+  QCOMPARE(file->treeLevel(), 104);
+
+  delete root;
+}
+
+QTEST_GUILESS_MAIN(KFileInfoTest)
+
+#include "kfileinfotest.moc"
@@ -0,0 +1,131 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "knodearena.h"
+#include <QTemporaryDir>
+#include <QTest>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace KDirStat;
+
+/**
+ * Test of @ref KNodeArena. There is only the one global instance, so each
+ * test uses a size of its own to start with empty free lists.
+ **/
+class KNodeArenaTest : public QObject {
+  Q_OBJECT
+
+private slots:
+  void initTestCase();
+  void reuse();
+  void releasedByOtherThread();
+  void concurrent();
+
+private:
+  QTemporaryDir _dir;
+};
+
+void KNodeArenaTest::initTestCase() {
+  QVERIFY(_dir.isValid());
+  QVERIFY(KNodeArena::instance()->open(_dir.path()));
+  QVERIFY(KNodeArena::instance()->isOpen());
+}
+
+void KNodeArenaTest::reuse() {
+  KNodeArena *arena = KNodeArena::instance();
+  void *first = arena->allocate(40);
+  void *second = arena->allocate(40);
+
+  QVERIFY(arena->contains(first));
+  QVERIFY(arena->contains(second));
+  QVERIFY(first != second);
+
+  size_t used = arena->used();
+  QVERIFY(arena->release(first, 40));
+  QVERIFY(arena->release(second, 40));
+
+  // Same size class after alignment, so these come from the free list
+  void *third = arena->allocate(48);
+  void *fourth = arena->allocate(33);
+
+  QCOMPARE(third, second);
+  QCOMPARE(fourth, first);
+  QCOMPARE(arena->used(), used);
+
+  int onHeap = 0;
+  QVERIFY(!arena->release(&onHeap, sizeof(onHeap)));
+}
+
+void KNodeArenaTest::releasedByOtherThread() {
+  // Like reading a tree in one thread and deleting it in another one
+
+  KNodeArena *arena = KNodeArena::instance();
+  std::vector<void *> items;
+
+  for (int i = 0; i < 10000; i++)
+    items.push_back(arena->allocate(80));
+
+  std::thread deleter([&] {
+    for (void *item : items)
+      arena->release(item, 80);
+  });
+  deleter.join();
+
+  // All of them are available to this thread again now, partly handed
+  // over while deleting, the rest when the thread ended.
+
+  size_t used = arena->used();
+  std::set<void *> reused;
+
+  for (int i = 0; i < 10000; i++)
+    reused.insert(arena->allocate(80));
+
+  QCOMPARE(arena->used(), used);
+  QVERIFY(reused == std::set<void *>(items.begin(), items.end()));
+}
+
+void KNodeArenaTest::concurrent() {
+  KNodeArena *arena = KNodeArena::instance();
+  const int threadCount = 4;
+  const int itemCount = 100000;
+  std::vector<std::vector<long *>> items(threadCount);
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < threadCount; t++) {
+    threads.push_back(std::thread([&, t] {
+      for (int i = 0; i < itemCount; i++) {
+        long *item = (long *)arena->allocate(64);
+        *item = t * itemCount + i;
+        items[t].push_back(item);
+
+        // Keep some free list traffic going as well
+        if (i % 3 == 2) {
+          arena->release(items[t].back(), 64);
+          items[t].pop_back();
+        }
+      }
+    }));
+  }
+
+  for (std::thread &thread : threads)
+    thread.join();
+
+  std::set<long *> all;
+
+  for (int t = 0; t < threadCount; t++) {
+    for (long *item : items[t]) {
+      QVERIFY(arena->contains(item));
+      QVERIFY(*item / itemCount == t);
+      all.insert(item);
+    }
+  }
+
+  QCOMPARE(all.size(), size_t(threadCount * (itemCount - itemCount / 3)));
+}
+
+QTEST_GUILESS_MAIN(KNodeArenaTest)
+
+#include "knodearenatest.moc"
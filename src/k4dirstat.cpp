@@ -113,6 +113,10 @@ k4dirstat::k4dirstat()
   connect(_treeView->tree(), SIGNAL(selectionChanged(KDirTree*)), this,
           SLOT(selectionChanged(KDirTree*)));
 
+  connect(_treeView->tree(),
+          SIGNAL(changesReported(const QList<KSnapshotChange> &)), this,
+          SLOT(reportChanges(const QList<KSnapshotChange> &)));
+
   connect(_treeView, SIGNAL(contextMenu(const QPoint &)),
           this, SLOT(contextMenu(const QPoint &)));
 
@@ -641,6 +645,27 @@ void k4dirstat::statusMsg(const QString &text) {
   statusBar()->showMessage(text);
 }
 
+void k4dirstat::reportChanges(const QList<KSnapshotChange> &changes) {
+  if (changes.isEmpty()) {
+    statusMsg(i18n("The cleanup did not change anything."));
+    return;
+  }
+
+  KFileSize freed = 0;
+
+  for (int i = 0; i < changes.size(); i++)
+    freed += changes[i].sizeBefore - changes[i].sizeAfter;
+
+  if (freed >= 0)
+    statusMsg(i18np("The cleanup changed 1 item and freed %2.",
+                    "The cleanup changed %1 items and freed %2.",
+                    changes.size(), formatSize(freed)));
+  else
+    statusMsg(i18np("The cleanup changed 1 item and used %2 more.",
+                    "The cleanup changed %1 items and used %2 more.",
+                    changes.size(), formatSize(-freed)));
+}
+
 void k4dirstat::contextMenu(const QPoint &pos) {
   if (_treeViewContextMenu)
     _treeViewContextMenu->popup(pos);
@@ -32,6 +32,7 @@ class KDirTreeView;
 class KDirTreeViewItem;
 class KDirTree;
 class KFileInfo;
+struct KSnapshotChange;
 class KSettingsDialog;
 class KTreemapView;
 class KTreemapTile;
@@ -176,6 +177,11 @@ public slots:
    **/
   void statusMsg(const QString &text);
 
+  /**
+   * Sums up in the status bar what a cleanup action changed in the tree.
+   **/
+  void reportChanges(const QList<KSnapshotChange> &changes);
+
   /**
    * Opens a context menu for tree view items.
    **/
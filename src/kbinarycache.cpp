@@ -0,0 +1,391 @@
+/*
+ *   Summary:	KDirStat binary cache file format
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kbinarycache.h"
+#include "kdirinfo.h"
+#include <QDebug>
+#include <QFile>
+#include <QHash>
+#include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#define BINARY_CACHE_MAGIC "[kdirstat " BINARY_CACHE_VERSION " cache file]\n"
+#define BINARY_CACHE_BYTE_ORDER 0x01020304
+
+using namespace KDirStat;
+
+KBinaryCache::KBinaryCache()
+    : _data(0), _size(0), _header(0), _nodes(0), _strings(0), _index(0) {}
+
+KBinaryCache::~KBinaryCache() { close(); }
+
+bool KBinaryCache::isBinaryHeader(const char *firstLine) {
+  return firstLine && strncmp(firstLine, "[kdirstat 5.", 12) == 0;
+}
+
+/**
+ * Returns 'true' if the minor version in 'magic' is not newer than the
+ * one this reader knows: Newer files may use flags it doesn't know about.
+ **/
+static bool isKnownVersion(const char *magic) {
+  const char *minor = magic + 12;
+  return *minor >= '0' && *minor <= BINARY_CACHE_VERSION[2] &&
+         minor[1] == ' ';
+}
+
+bool KBinaryCache::open(const QString &fileName) {
+  close();
+
+  int fd = ::open(QFile::encodeName(fileName).constData(), O_RDONLY);
+
+  if (fd < 0) {
+    qCritical() << "Can't open " << fileName << ": " << strerror(errno)
+                << endl;
+    return false;
+  }
+
+  struct stat statInfo;
+
+  if (fstat(fd, &statInfo) != 0 ||
+      statInfo.st_size < (off_t)sizeof(KBinaryCacheHeader)) {
+    qCritical() << fileName << ": Not a binary cache file" << endl;
+    ::close(fd);
+    return false;
+  }
+
+  size_t size = statInfo.st_size;
+  void *mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd); // The mapping stays valid without it
+
+  if (mapping == MAP_FAILED) {
+    qCritical() << "Can't map " << fileName << ": " << strerror(errno)
+                << endl;
+    return false;
+  }
+
+  _fileName = fileName;
+  _data = (char *)mapping;
+  _size = size;
+
+  // Check everything a reader relies on once, so none of the accessors
+  // has to do it over and over again.
+
+  const KBinaryCacheHeader *header = (const KBinaryCacheHeader *)_data;
+  bool ok = isBinaryHeader(header->magic) && isKnownVersion(header->magic) &&
+            header->byteOrder == BINARY_CACHE_BYTE_ORDER &&
+            header->nodeSize == sizeof(KBinaryCacheNode) &&
+            header->fileSize == size && header->nodeCount > 0 &&
+            header->nodeCount <= UINT32_MAX &&
+            header->nodesOffset % 8 == 0 && header->indexOffset % 8 == 0 &&
+            header->nodesOffset <= size &&
+            header->nodeCount <=
+                (size - header->nodesOffset) / sizeof(KBinaryCacheNode) &&
+            header->stringsOffset <= size && header->stringsSize > 0 &&
+            header->stringsSize <= size - header->stringsOffset &&
+            header->indexOffset <= size &&
+            header->indexCount <= (size - header->indexOffset) /
+                                      sizeof(KBinaryCacheIndexEntry);
+
+  // With a 0 byte at the very end of the string table, every string in it
+  // is properly terminated.
+
+  if (ok && _data[header->stringsOffset + header->stringsSize - 1] != 0)
+    ok = false;
+
+  if (!ok) {
+    qCritical() << fileName << ": Invalid or incompatible binary cache file"
+                << endl;
+    close();
+    return false;
+  }
+
+  _header = header;
+  _nodes = (const KBinaryCacheNode *)(_data + header->nodesOffset);
+  _strings = _data + header->stringsOffset;
+  _index = (const KBinaryCacheIndexEntry *)(_data + header->indexOffset);
+
+  return true;
+}
+
+void KBinaryCache::close() {
+  if (_data)
+    munmap(_data, _size);
+
+  _fileName.clear();
+  _data = 0;
+  _size = 0;
+  _header = 0;
+  _nodes = 0;
+  _strings = 0;
+  _index = 0;
+}
+
+bool KBinaryCache::isValid(uint32_t i) const {
+  const KBinaryCacheNode &n = _nodes[i];
+
+  if (n.childCount == 0)
+    return true;
+
+  // Children always come after their parent; anything else would make it
+  // possible to build a cycle.
+
+  return n.isDir() && n.firstChild > i &&
+         (uint64_t)n.firstChild + n.childCount <= _header->nodeCount;
+}
+
+int64_t KBinaryCache::findDir(const QByteArray &path) const {
+  int64_t low = 0;
+  int64_t high = (int64_t)_header->indexCount - 1;
+
+  while (low <= high) {
+    int64_t mid = (low + high) / 2;
+    int cmp = strcmp(string(_index[mid].path), path.constData());
+
+    if (cmp < 0)
+      low = mid + 1;
+    else if (cmp > 0)
+      high = mid - 1;
+    else
+      return _index[mid].node < _header->nodeCount ? _index[mid].node : -1;
+  }
+
+  return -1;
+}
+
+/**
+ * String table under construction. Names are stored only once: In a
+ * typical tree, the same few names ("Makefile", "index.html", ...) make up a
+ * good part of all names. The full path of each directory is stored, too,
+ * so this easily gets larger than the 2 GB a QByteArray can hold.
+ **/
+struct KStringTable {
+  std::vector<char> data;
+  QHash<QByteArray, uint64_t> offsets;
+
+  uint64_t add(const QByteArray &str, bool unique = false) {
+    if (!unique) {
+      QHash<QByteArray, uint64_t>::const_iterator it = offsets.constFind(str);
+
+      if (it != offsets.constEnd())
+        return it.value();
+    }
+
+    uint64_t offset = data.size();
+    const char *start = str.constData();
+    data.insert(data.end(), start, start + str.size() + 1); // with the 0 byte
+
+    if (!unique)
+      offsets.insert(str, offset);
+
+    return offset;
+  }
+};
+
+static void fillNode(KBinaryCacheNode &node, KFileInfo *item) {
+  memset(&node, 0, sizeof(node));
+  node.size = item->size();
+  node.blocks = item->isSparseFile() ? item->blocks() : -1;
+  node.mtime = item->mtime();
+  node.totalSize = item->totalSize();
+  node.totalBlocks = item->totalBlocks();
+  node.totalItems = item->totalItems();
+  node.totalSubDirs = item->totalSubDirs();
+  node.totalFiles = item->totalFiles();
+  node.latestMtime = item->latestMtime();
+  node.mode = item->mode();
+  node.links = item->links();
+
+  // Its children are gone, but the totals still say what was there.
+
+  if (item->isAggregate())
+    node.flags |= KBinaryCacheNode::Aggregate;
+}
+
+/**
+ * All children of 'dir' in the order they are written: first those of the
+ * dot entry, then the others.
+ **/
+static void collectChildren(KDirInfo *dir, std::vector<KFileInfo *> &children) {
+  children.clear();
+
+  if (dir->dotEntry())
+    dir->dotEntry()->forEachChild(
+        [&](KFileInfo *child) { children.push_back(child); });
+
+  dir->forEachChild([&](KFileInfo *child) { children.push_back(child); });
+}
+
+static size_t childCount(KFileInfo *item) {
+  if (!item->isDirInfo())
+    return 0;
+
+  KDirInfo *dir = static_cast<KDirInfo *>(item);
+  return dir->numChildren() +
+         (dir->dotEntry() ? dir->dotEntry()->numChildren() : 0);
+}
+
+bool KBinaryCacheWriter::write(const QString &fileName, KFileInfo *root) {
+  if (!root)
+    return false;
+
+  // Write to a new file and replace the old one only when done: Somebody
+  // might have the old one mapped right now, and truncating it would make
+  // them crash.
+
+  QByteArray finalName = QFile::encodeName(fileName);
+  QByteArray newName = finalName + ".new";
+  FILE *file = fopen(newName.constData(), "wb");
+
+  if (!file) {
+    qCritical() << "Can't open " << newName << ": " << strerror(errno)
+                << endl;
+    return false;
+  }
+
+  KBinaryCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, BINARY_CACHE_MAGIC, sizeof(header.magic) - 1);
+  header.byteOrder = BINARY_CACHE_BYTE_ORDER;
+  header.nodeSize = sizeof(KBinaryCacheNode);
+  header.nodesOffset = sizeof(header);
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  // Breadth-first traversal: When a directory's node is written, it is
+  // already known where its children will go: right after the children of
+  // all directories written before it.
+
+  struct PendingDir {
+    KDirInfo *dir;
+    uint32_t node;
+    QByteArray path;
+  };
+
+  KStringTable strings;
+  std::vector<KBinaryCacheIndexEntry> index;
+  std::deque<PendingDir> pending;
+  std::vector<KFileInfo *> children;
+  uint64_t nodeCount = 0;
+  uint64_t nextChild = 1;
+
+  auto writeNode = [&](KFileInfo *item, const QByteArray &name,
+                       const QByteArray &path, uint32_t parent) {
+    KBinaryCacheNode node;
+    fillNode(node, item);
+    node.name = strings.add(name);
+    node.parent = parent;
+
+    if (item->isDirInfo()) {
+      size_t count = childCount(item);
+      node.firstChild = count > 0 ? nextChild : 0;
+      node.childCount = count;
+      nextChild += count;
+
+      if (nextChild > UINT32_MAX) {
+        // Node numbers would not fit into a KBinaryCacheNode.
+        if (ok)
+          qCritical() << "Too many items for a binary cache file" << endl;
+
+        ok = false;
+      }
+
+      KBinaryCacheIndexEntry entry;
+      entry.path = strings.add(path, true);
+      entry.node = nodeCount;
+      entry.reserved = 0;
+      index.push_back(entry);
+
+      if (count > 0) {
+        PendingDir dir = {static_cast<KDirInfo *>(item), (uint32_t)nodeCount,
+                          path};
+        pending.push_back(dir);
+      }
+    }
+
+    if (ok)
+      ok = fwrite(&node, sizeof(node), 1, file) == 1;
+
+    nodeCount++;
+  };
+
+  QByteArray rootPath = root->url().toUtf8();
+  writeNode(root, rootPath, rootPath, 0);
+
+  while (ok && !pending.empty()) {
+    PendingDir dir = pending.front();
+    pending.pop_front();
+    collectChildren(dir.dir, children);
+
+    QByteArray prefix = dir.path;
+
+    if (!prefix.endsWith('/'))
+      prefix += '/';
+
+    for (size_t i = 0; i < children.size(); i++) {
+      QByteArray name = children[i]->name().toUtf8();
+      writeNode(children[i], name,
+                children[i]->isDirInfo() ? prefix + name : QByteArray(),
+                dir.node);
+    }
+  }
+
+  // String table, then the index sorted by path
+
+  header.nodeCount = nodeCount;
+  header.stringsOffset =
+      header.nodesOffset + nodeCount * sizeof(KBinaryCacheNode);
+  header.stringsSize = strings.data.size();
+
+  if (ok)
+    ok = fwrite(strings.data.data(), strings.data.size(), 1, file) == 1;
+
+  static const char padding[8] = {0};
+  size_t paddingSize = (8 - header.stringsSize % 8) % 8;
+
+  if (ok && paddingSize > 0)
+    ok = fwrite(padding, paddingSize, 1, file) == 1;
+
+  const char *data = strings.data.data();
+  std::sort(index.begin(), index.end(),
+            [data](const KBinaryCacheIndexEntry &a,
+                   const KBinaryCacheIndexEntry &b) {
+              return strcmp(data + a.path, data + b.path) < 0;
+            });
+
+  header.indexOffset = header.stringsOffset + header.stringsSize + paddingSize;
+  header.indexCount = index.size();
+
+  if (ok && !index.empty())
+    ok = fwrite(&index[0], sizeof(KBinaryCacheIndexEntry), index.size(),
+                file) == index.size();
+
+  header.fileSize =
+      header.indexOffset + index.size() * sizeof(KBinaryCacheIndexEntry);
+
+  if (ok)
+    ok = fseek(file, 0, SEEK_SET) == 0 &&
+         fwrite(&header, sizeof(header), 1, file) == 1;
+
+  if (fclose(file) != 0)
+    ok = false;
+
+  if (ok && rename(newName.constData(), finalName.constData()) != 0)
+    ok = false;
+
+  if (!ok) {
+    qCritical() << "Error writing " << fileName << ": " << strerror(errno)
+                << endl;
+    unlink(newName.constData());
+  }
+
+  return ok;
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+/*
+ *   Summary:	KDirStat binary cache file format
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kfileinfo.h"
+#include <QByteArray>
+#include <QString>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BINARY_CACHE_VERSION "5.1"
+#define DEFAULT_BINARY_CACHE_NAME ".kdirstat.cache"
+
+namespace KDirStat {
+/**
+ * Header at the start of a binary cache file. The first line is the same
+ * as in a text cache file except for the version, so a reader can tell
+ * them apart by the first line alone.
+ *
+ * Everything in the file is in the byte order of the machine that wrote
+ * it; a reader on a machine with a different byte order rejects the file.
+ **/
+struct KBinaryCacheHeader {
+  char magic[32];          // "[kdirstat 5.1 cache file]\n", 0-padded
+  uint32_t byteOrder;      // 0x01020304
+  uint32_t nodeSize;       // sizeof(KBinaryCacheNode)
+  uint64_t nodeCount;
+  uint64_t nodesOffset;    // start of the node table
+  uint64_t stringsOffset;  // start of the string table
+  uint64_t stringsSize;
+  uint64_t indexOffset;    // start of the directory index
+  uint64_t indexCount;
+  uint64_t fileSize;       // for a cheap sanity check
+};
+
+/**
+ * One item in the node table. All items have the same size, so item
+ * no. 'i' can be accessed without reading anything before it.
+ *
+ * The table is in breadth-first order starting with the toplevel
+ * directory: All children of a directory are next to each other, the
+ * files of its dot entry first. Dot entries themselves are not stored.
+ **/
+struct KBinaryCacheNode {
+  uint64_t name;        // offset in the string table; toplevel: full path
+  int64_t size;
+  int64_t blocks;       // -1 unless this is a sparse file
+  int64_t mtime;
+  int64_t totalSize;    // totals as the tree reported them when writing
+  int64_t totalBlocks;
+  int64_t totalItems;
+  int64_t totalSubDirs;
+  int64_t totalFiles;
+  int64_t latestMtime;
+  uint32_t mode;        // st_mode
+  uint32_t links;
+  uint32_t parent;      // node no. of the parent; toplevel: 0
+  uint32_t firstChild;  // directories: node no. of the first child
+  uint32_t childCount;  // directories: number of children
+  uint32_t flags;       // see below
+
+  bool isDir() const { return S_ISDIR(mode); }
+
+  // Flags (since version 5.1; always 0 in version 5.0 files)
+
+  // A directory that was an aggregate (see KFileInfo::isAggregate()) when
+  // it was written: It has no children, only its totals.
+  static const uint32_t Aggregate = 0x1;
+};
+
+/**
+ * One entry in the directory index: The full path of each directory, sorted
+ * by path (byte-wise), so the node of a directory can be found by binary
+ * search without materializing anything.
+ **/
+struct KBinaryCacheIndexEntry {
+  uint64_t path; // offset in the string table
+  uint32_t node;
+  uint32_t reserved;
+};
+
+/**
+ * Read-only access to a memory-mapped binary cache file.
+ *
+ * Opening a cache only maps it and checks the header and table bounds,
+ * so it takes the same time no matter how large the file is. Nodes are
+ * read directly from the mapping; nothing is parsed or converted.
+ *
+ * @short Memory-mapped binary cache file
+ **/
+class KBinaryCache {
+public:
+  /**
+   * Constructor. Call @ref open() before anything else.
+   **/
+  KBinaryCache();
+
+  /**
+   * Destructor. Unmaps the file.
+   **/
+  ~KBinaryCache();
+
+  /**
+   * Map cache file 'fileName'. Returns 'true' if it is a valid binary
+   * cache file.
+   **/
+  bool open(const QString &fileName);
+
+  /**
+   * Unmap the file.
+   **/
+  void close();
+
+  /**
+   * Returns 'true' if a file is mapped.
+   **/
+  bool isOpen() const { return _data != 0; }
+
+  /**
+   * Returns the name of the mapped file.
+   **/
+  const QString &fileName() const { return _fileName; }
+
+  /**
+   * Returns the number of nodes.
+   **/
+  uint32_t nodeCount() const { return _header ? _header->nodeCount : 0; }
+
+  /**
+   * Returns node no. 'i'. 'i' has to be less than @ref nodeCount().
+   **/
+  const KBinaryCacheNode &node(uint32_t i) const { return _nodes[i]; }
+
+  /**
+   * Returns 'true' if the child range of node no. 'i' is within the node
+   * table. Check this before following a node's children.
+   **/
+  bool isValid(uint32_t i) const;
+
+  /**
+   * Returns the name of node no. 'i' as it is in the file (UTF-8).
+   **/
+  const char *rawName(uint32_t i) const { return string(_nodes[i].name); }
+
+  /**
+   * Returns the name of node no. 'i'.
+   **/
+  QString name(uint32_t i) const { return QString::fromUtf8(rawName(i)); }
+
+  /**
+   * Returns the full path of the toplevel directory.
+   **/
+  QString rootPath() const { return nodeCount() > 0 ? name(0) : QString(); }
+
+  /**
+   * Returns the node no. of the directory with full path 'path' or -1 if
+   * there is none. This is a binary search in the directory index.
+   **/
+  int64_t findDir(const QByteArray &path) const;
+
+  /**
+   * Returns 'true' if 'firstLine' is the first line of a binary cache
+   * file.
+   **/
+  static bool isBinaryHeader(const char *firstLine);
+
+private:
+  KBinaryCache(const KBinaryCache &) = delete;
+  KBinaryCache &operator=(const KBinaryCache &) = delete;
+
+  const char *string(uint64_t offset) const {
+    return offset < _header->stringsSize ? _strings + offset : "";
+  }
+
+  QString _fileName;
+  char *_data;
+  size_t _size;
+  const KBinaryCacheHeader *_header;
+  const KBinaryCacheNode *_nodes;
+  const char *_strings;
+  const KBinaryCacheIndexEntry *_index;
+};
+
+/**
+ * Writer for binary cache files.
+ *
+ * Node numbers are 32 bit, so a binary cache file holds at most
+ * UINT32_MAX items (about 4.3 billion). Larger trees can only be written
+ * to text cache files.
+ *
+ * @short Binary cache file writer
+ **/
+class KBinaryCacheWriter {
+public:
+  /**
+   * Write the subtree below and including 'root' to 'fileName'.
+   * Returns 'true' if OK, 'false' upon error, also if the subtree has too
+   * many items.
+   **/
+  static bool write(const QString &fileName, KFileInfo *root);
+};
+
+} // namespace KDirStat
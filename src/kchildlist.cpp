@@ -0,0 +1,99 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kchildlist.h"
+#include <string.h>
+
+using namespace KDirStat;
+
+void KChildList::grow() {
+  if (isInline()) {
+    // Leaving the inline storage: Save its content first since the chunk
+    // directory pointer shares the same memory.
+
+    KFileInfo **chunk = new KFileInfo *[FirstHeapCapacity];
+    memcpy(chunk, _inline, sizeof(_inline));
+    _chunks = new KFileInfo **[1];
+    _chunks[0] = chunk;
+    _capacity = FirstHeapCapacity;
+  } else if (_capacity < ChunkSize) {
+    // Still only one chunk: Grow it by doubling. This relocates at most
+    // ChunkSize entries, and only while the directory is still small.
+
+    uint32_t newCapacity = _capacity * 2;
+    KFileInfo **chunk = new KFileInfo *[newCapacity];
+    memcpy(chunk, _chunks[0], _size * sizeof(KFileInfo *));
+    delete[] _chunks[0];
+    _chunks[0] = chunk;
+    _capacity = newCapacity;
+  } else {
+    // Append a new chunk. Only the chunk directory is ever reallocated;
+    // it grows by doubling whenever the number of chunks reaches a power
+    // of two.
+
+    uint32_t numChunks = _capacity >> ChunkShift;
+
+    if ((numChunks & (numChunks - 1)) == 0) {
+      KFileInfo ***chunks = new KFileInfo **[numChunks * 2];
+      memcpy(chunks, _chunks, numChunks * sizeof(KFileInfo **));
+      delete[] _chunks;
+      _chunks = chunks;
+    }
+
+    _chunks[numChunks] = new KFileInfo *[ChunkSize];
+    _capacity += ChunkSize;
+  }
+}
+
+KFileInfo *KChildList::swapRemove(size_t i) {
+  if (i >= _size)
+    return 0;
+
+  KFileInfo *moved = 0;
+  size_t last = _size - 1;
+
+  if (i != last) {
+    moved = *slot(last);
+    *slot(i) = moved;
+  }
+
+  _size--;
+
+  if (_size == 0)
+    clear();
+
+  return moved;
+}
+
+void KChildList::clear() {
+  if (!isInline()) {
+    uint32_t numChunks =
+        _capacity <= ChunkSize ? 1 : (_capacity >> ChunkShift);
+
+    for (uint32_t i = 0; i < numChunks; i++)
+      delete[] _chunks[i];
+
+    delete[] _chunks;
+  }
+
+  _size = 0;
+  _capacity = InlineCapacity;
+  _inline[0] = _inline[1] = _inline[2] = nullptr;
+}
+
+void KChildList::swap(KChildList &other) {
+  KFileInfo *inlineTmp[InlineCapacity];
+
+  memcpy(inlineTmp, _inline, sizeof(_inline));
+  memcpy(_inline, other._inline, sizeof(_inline));
+  memcpy(other._inline, inlineTmp, sizeof(_inline));
+
+  uint32_t tmp = _size;
+  _size = other._size;
+  other._size = tmp;
+
+  tmp = _capacity;
+  _capacity = other._capacity;
+  other._capacity = tmp;
+}
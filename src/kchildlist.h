@@ -0,0 +1,152 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace KDirStat {
+// Forward declarations
+class KFileInfo;
+
+/**
+ * Children list of a @ref KDirInfo.
+ *
+ * Most directories have only very few children, and a few have millions.
+ * A std::vector is bad at both ends: It always costs a separate heap
+ * block, and it relocates (copies) all of its content over and over again
+ * while it grows.
+ *
+ * This list stores up to InlineCapacity entries right within the object.
+ * Beyond that, it switches to heap chunks: The first chunk grows by
+ * doubling up to ChunkSize entries; after that, additional fixed-size
+ * chunks are appended. Entries in a full chunk are never moved again, so
+ * growing a huge directory is no more expensive than allocating a new
+ * chunk every ChunkSize insertions, and there is no need to shrink or
+ * copy anything when reading a directory is finished.
+ *
+ * The order of entries is preserved by everything except @ref swapRemove().
+ *
+ * @short Compact, non-relocating list of child pointers
+ **/
+class KChildList {
+public:
+  /**
+   * Constructor. Creates an empty list that doesn't use any heap memory.
+   **/
+  KChildList() : _size(0), _capacity(InlineCapacity) {
+    _inline[0] = _inline[1] = _inline[2] = nullptr;
+  }
+
+  /**
+   * Destructor. This only frees the list's storage, not the children.
+   **/
+  ~KChildList() { clear(); }
+
+  /**
+   * Returns the number of entries.
+   **/
+  size_t size() const { return _size; }
+
+  /**
+   * Returns true if there are no entries.
+   **/
+  bool empty() const { return _size == 0; }
+
+  /**
+   * Returns entry no. 'i'. There is no range check.
+   **/
+  KFileInfo *operator[](size_t i) const { return *slot(i); }
+
+  /**
+   * Call 'func' for each entry in order. This is a tight loop over each
+   * chunk rather than a lookup per entry.
+   **/
+  template <class Func> void forEach(Func func) const {
+    if (isInline()) {
+      for (uint32_t i = 0; i < _size; i++)
+        func(_inline[i]);
+
+      return;
+    }
+
+    size_t remaining = _size;
+
+    for (uint32_t c = 0; remaining > 0; c++) {
+      size_t count = remaining < ChunkSize ? remaining : ChunkSize;
+      KFileInfo *const *chunk = _chunks[c];
+
+      for (size_t i = 0; i < count; i++)
+        func(chunk[i]);
+
+      remaining -= count;
+    }
+  }
+
+  /**
+   * Append an entry to the end of the list.
+   **/
+  void push_back(KFileInfo *item) {
+    if (_size == _capacity)
+      grow();
+
+    *slot(_size) = item;
+    _size++;
+  }
+
+  /**
+   * Remove entry no. 'i' in constant time by moving the last entry to
+   * position 'i'. Returns the entry that was moved or 0 if 'i' was the
+   * last entry.
+   **/
+  KFileInfo *swapRemove(size_t i);
+
+  /**
+   * Remove all entries and release all heap storage.
+   **/
+  void clear();
+
+  /**
+   * Exchange the content of this list with 'other' in constant time.
+   **/
+  void swap(KChildList &other);
+
+private:
+  // Disable copying: Children are owned by exactly one list.
+  KChildList(const KChildList &) = delete;
+  KChildList &operator=(const KChildList &) = delete;
+
+  static const uint32_t InlineCapacity = 3;
+  static const uint32_t FirstHeapCapacity = 8;
+  static const uint32_t ChunkShift = 10;
+  static const uint32_t ChunkSize = 1 << ChunkShift;
+  static const uint32_t ChunkMask = ChunkSize - 1;
+
+  bool isInline() const { return _capacity == InlineCapacity; }
+
+  KFileInfo **slot(size_t i) {
+    return isInline() ? &_inline[i] : &_chunks[i >> ChunkShift][i & ChunkMask];
+  }
+
+  KFileInfo *const *slot(size_t i) const {
+    return isInline() ? &_inline[i] : &_chunks[i >> ChunkShift][i & ChunkMask];
+  }
+
+  /**
+   * Make room for at least one more entry.
+   **/
+  void grow();
+
+  uint32_t _size;
+  uint32_t _capacity;
+
+  union {
+    KFileInfo *_inline[InlineCapacity]; // as long as _capacity is small
+    KFileInfo ***_chunks;               // chunk directory after that
+  };
+
+}; // class KChildList
+
+} // namespace KDirStat
@@ -15,6 +15,7 @@
 #include <kmessagebox.h>
 
 #include "kcleanup.h"
+#include "ktreewalk.h"
 #include <KLocalizedString>
 
 #define VERBOSE_RUN_COMMAND 1
@@ -130,6 +131,13 @@ void KCleanup::execute(KDirTree * tree) {
   if (_askForConfirmation && !confirmation(tree))
     return;
 
+  // Report what this cleanup changed in the tree, see
+  // KDirTree::changesReported(). Without a refresh, the tree doesn't know.
+  bool reportChanges = _refreshPolicy != noRefresh;
+
+  if (reportChanges)
+    tree->beginChangeReport();
+
   std::vector<KFileInfo *> selection = tree->selection();
   for(auto it = selection.begin(); it != selection.end(); ++it) {
     KFileInfo * item = *it;
@@ -165,31 +173,57 @@ void KCleanup::execute(KDirTree * tree) {
       break;
     }
   }
+
+  if (reportChanges)
+    tree->endChangeReport();
 }
 
-void KCleanup::executeRecursive(KFileInfo *item, KDirTree* tree) {
-  if (worksFor(item, tree)) {
-    if (_recurse) {
-      // Recurse into all subdirectories.
-      for(size_t i = 0; i < item->numChildren(); i++) {
-        KFileInfo *subdir = item->child(i);
-        if (subdir->isDir()) {
-          /**
-           * Recursively execute in this subdirectory, but only if it
-           * really is a directory: File children might have been
-           * reparented to the directory (normally, they reside in
-           * the dot entry) if there are no real subdirectories on
-           * this directory level.
-           **/
-          executeRecursive(subdir, tree);
-        }
-      }
-    }
+/**
+ * Post-order traversal that performs a cleanup in every subdirectory it
+ * works for before it is performed in the parent directory.
+ **/
+struct KCleanup::ExecuteVisitor : public KTreeVisitor {
+  KCleanup *cleanup;
+  KDirTree *tree;
+  KFileInfo *top;
+
+  ExecuteVisitor(KCleanup *cleanup, KDirTree *tree, KFileInfo *top)
+      : cleanup(cleanup), tree(tree), top(top) {}
+
+  bool enterDir(KDirInfo *dir) {
+    // Dot entries are only worked on if the user selected one.
+    if (dir != top && !dir->isDir())
+      return false;
+
+    return cleanup->worksFor(dir, tree);
+  }
 
+  void leaveDir(KDirInfo *dir) {
     // Perform cleanup for this directory.
 
-    runCommand(item, _command);
+    cleanup->runCommand(dir, cleanup->_command);
   }
+
+  void visitFile(KFileInfo *file) {
+    // Plain files below 'top' are not worked on: They might have been
+    // reparented to the directory (normally, they reside in the dot
+    // entry) if there are no real subdirectories on this directory level.
+
+    if (file == top && cleanup->worksFor(file, tree))
+      cleanup->runCommand(file, cleanup->_command);
+  }
+};
+
+void KCleanup::executeRecursive(KFileInfo *item, KDirTree* tree) {
+  if (!_recurse) {
+    if (worksFor(item, tree))
+      runCommand(item, _command);
+
+    return;
+  }
+
+  ExecuteVisitor visitor(this, tree, item);
+  walkTree(item, visitor);
 }
 
 const QString KCleanup::itemDir(const KFileInfo *item) const {
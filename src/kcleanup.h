@@ -202,8 +202,10 @@ public:
   void saveConfig() const;
 
 protected:
+  struct ExecuteVisitor;
+
   /**
-   * Recursively perform the cleanup.
+   * Perform the cleanup - in all subdirectories, too, if so configured.
    **/
   void executeRecursive(KFileInfo *item, KDirTree*);
 
@@ -6,6 +6,7 @@
 
 #include "kdirinfo.h"
 #include "kdirtree.h"
+#include "ktreewalk.h"
 #include <QDebug>
 
 using namespace KDirStat;
@@ -46,6 +47,8 @@ KDirInfo::KDirInfo(KDirInfo *parent,
 }
 
 void KDirInfo::init() {
+  _childIndex = 0;
+  _isDirInfo = true;
   _isDotEntry = false;
   _pendingReadJobs = 0;
   _dotEntry = 0;
@@ -57,23 +60,50 @@ void KDirInfo::init() {
   _latestMtime = _mtime;
   _isMountPoint = false;
   _isExcluded = false;
+  _isAggregate = false;
+  _isPinned = false;
   _summaryDirty = false;
+  _mtimeDirty = false;
   _beingDestroyed = false;
   _readState = KDirQueued;
 }
 
 KDirInfo::~KDirInfo() {
   _beingDestroyed = true;
-  // Recursively delete all children.
-  for(size_t i = 0; i < numChildren(); i++)
-    delete child(i);
+  deleteChildren();
+  delete _childIndex;
+}
 
-  // Delete the dot entry.
-  if (_dotEntry) {
-    delete _dotEntry;
+void KDirInfo::deleteChildren() {
+  // Delete the subtree iteratively rather than recursively: The children
+  // of each directory are taken away before it is deleted, so its own
+  // destructor has nothing left to do.
+
+  std::vector<KFileInfo *> pending;
+  takeChildren(pending);
+
+  while (!pending.empty()) {
+    KFileInfo *item = pending.back();
+    pending.pop_back();
+
+    if (item->isDirInfo())
+      static_cast<KDirInfo *>(item)->takeChildren(pending);
+
+    delete item;
   }
 }
 
+void KDirInfo::takeChildren(std::vector<KFileInfo *> &pending) {
+  for (size_t i = 0; i < numChildren(); i++)
+    pending.push_back(children_[i]);
+
+  if (_dotEntry)
+    pending.push_back(_dotEntry);
+
+  children_.clear();
+  _dotEntry = 0;
+}
+
 void KDirInfo::recalcOneChild(KFileInfo * child) {
   _totalSize += child->totalSize();
   _totalBlocks += child->totalBlocks();
@@ -93,9 +123,39 @@ void KDirInfo::recalcOneChild(KFileInfo * child) {
     _latestMtime = childLatestMtime;
 }
 
+/**
+ * Post-order traversal over all dirty directories of a subtree: By the time
+ * a directory is recalculated, all its children are up to date, so nothing
+ * needs to recurse.
+ **/
+struct KDirInfo::RecalcVisitor : public KTreeVisitor {
+  bool enterDir(KDirInfo *dir) {
+    return dir->_summaryDirty || dir->_mtimeDirty;
+  }
+
+  void leaveDir(KDirInfo *dir) {
+    if (dir->_summaryDirty)
+      dir->recalcLocal();
+    else
+      dir->recalcLatestMtimeLocal();
+  }
+};
+
 void KDirInfo::recalc() {
+  RecalcVisitor visitor;
+  walkTree(this, visitor);
+}
+
+void KDirInfo::recalcLocal() {
   // qDebug() << Q_FUNC_INFO << this << endl;
 
+  if (_isAggregate) {
+    // The children these values were summed up from are gone.
+    _summaryDirty = false;
+    _mtimeDirty = false;
+    return;
+  }
+
   _totalSize = _size;
   _totalBlocks = _blocks;
   _totalItems = 0;
@@ -108,52 +168,87 @@ void KDirInfo::recalc() {
   if(dotEntry())
     recalcOneChild(dotEntry());
   _summaryDirty = false;
+  _mtimeDirty = false;
 }
 
-void KDirInfo::setMountPoint(bool isMountPoint) {
-  _isMountPoint = isMountPoint;
-}
+void KDirInfo::recalcLatestMtimeLocal() {
+  if (_isAggregate) {
+    _mtimeDirty = false;
+    return;
+  }
 
-KFileSize KDirInfo::totalSize() {
-  if (_summaryDirty)
-    recalc();
+  _latestMtime = _mtime;
 
-  return _totalSize;
-}
+  for (size_t i = 0; i < numChildren(); i++) {
+    time_t childLatestMtime = child(i)->latestMtime();
 
-KFileSize KDirInfo::totalBlocks() {
-  if (_summaryDirty)
-    recalc();
+    if (childLatestMtime > _latestMtime)
+      _latestMtime = childLatestMtime;
+  }
+
+  if (_dotEntry && _dotEntry->latestMtime() > _latestMtime)
+    _latestMtime = _dotEntry->latestMtime();
 
-  return _totalBlocks;
+  _mtimeDirty = false;
 }
 
-int KDirInfo::totalItems() {
-  if (_summaryDirty)
-    recalc();
+void KDirInfo::collapse(std::vector<KFileInfo *> &detached) {
+  if (_isDotEntry || _isAggregate)
+    return;
 
-  return _totalItems;
-}
+  // Make sure the summary is up to date while the children are still there
 
-int KDirInfo::totalSubDirs() {
-  if (_summaryDirty)
+  if (_summaryDirty || _mtimeDirty)
     recalc();
 
-  return _totalSubDirs;
+  for (size_t i = 0; i < numChildren(); i++)
+    detached.push_back(children_[i]);
+
+  if (_dotEntry)
+    detached.push_back(_dotEntry);
+
+  children_.clear();
+  _dotEntry = 0;
+  dropChildIndex();
+  _isAggregate = true;
 }
 
-int KDirInfo::totalFiles() {
-  if (_summaryDirty)
-    recalc();
+void KDirInfo::setAggregate(KFileSize totalSize, KFileSize totalBlocks,
+                            KFileCount totalItems, KFileCount totalSubDirs,
+                            KFileCount totalFiles, time_t latestMtime) {
+  if (_isDotEntry || _isAggregate || numChildren() > 0 ||
+      (_dotEntry && _dotEntry->numChildren() > 0))
+    return;
+
+  // Aggregates have no dot entry (see collapse()).
+
+  delete _dotEntry;
+  _dotEntry = 0;
 
-  return _totalFiles;
+  _totalSize = totalSize;
+  _totalBlocks = totalBlocks;
+  _totalItems = totalItems;
+  _totalSubDirs = totalSubDirs;
+  _totalFiles = totalFiles;
+  _latestMtime = latestMtime;
+  _summaryDirty = false;
+  _mtimeDirty = false;
+  _isAggregate = true;
 }
 
-time_t KDirInfo::latestMtime() {
-  if (_summaryDirty)
-    recalc();
+void KDirInfo::markAsDirty() {
+  for (KDirInfo *dir = this; dir && !dir->_summaryDirty;
+       dir = dir->parent())
+    dir->_summaryDirty = true;
+}
 
-  return _latestMtime;
+void KDirInfo::setPinned() {
+  for (KDirInfo *dir = this; dir && !dir->_isPinned; dir = dir->parent())
+    dir->_isPinned = true;
+}
+
+void KDirInfo::setMountPoint(bool isMountPoint) {
+  _isMountPoint = isMountPoint;
 }
 
 bool KDirInfo::isFinished() { return !isBusy(); }
@@ -196,9 +291,13 @@ void KDirInfo::insertChild(KFileInfo *newChild) {
      * none of our business; the corresponding "view" object for this tree
      * will take care of such niceties.
      **/
+    newChild->setSlot(children_.size());
     children_.push_back(newChild);
     newChild->setParent(this); // make sure the parent pointer is correct
 
+    if (_childIndex)
+      _childIndex->insert(qHash(newChild->name()), newChild);
+
     childAdded(newChild); // update summaries
   } else {
     /*
@@ -209,54 +308,130 @@ void KDirInfo::insertChild(KFileInfo *newChild) {
   }
 }
 
-void KDirInfo::childAdded(KFileInfo *newChild) {
-  if (!_summaryDirty) {
-    _totalSize += newChild->totalSize();
-    _totalBlocks += newChild->blocks();
-    _totalItems++;
+KFileInfo *KDirInfo::findChild(const QStringRef &name) {
+  if (numChildren() >= ChildIndexThreshold) {
+    if (!_childIndex)
+      buildChildIndex();
 
-    if (newChild->isDir())
-      _totalSubDirs++;
+    uint hash = qHash(name);
+    QMultiHash<uint, KFileInfo *>::const_iterator it =
+        _childIndex->constFind(hash);
 
-    if (newChild->isFile())
-      _totalFiles++;
+    while (it != _childIndex->constEnd() && it.key() == hash) {
+      if (it.value()->name() == name)
+        return it.value();
 
-    if (newChild->mtime() > _latestMtime)
-      _latestMtime = newChild->mtime();
+      ++it;
+    }
   } else {
-    // NOP
+    for (size_t i = 0; i < numChildren(); i++) {
+      if (children_[i]->name() == name)
+        return children_[i];
+    }
+  }
+
+  // Non-directory children are normally stored in the dot entry.
+
+  if (_dotEntry)
+    return _dotEntry->findChild(name);
+
+  return 0;
+}
+
+void KDirInfo::buildChildIndex() {
+  delete _childIndex;
+  _childIndex = new QMultiHash<uint, KFileInfo *>();
+  _childIndex->reserve(numChildren());
+
+  for (size_t i = 0; i < numChildren(); i++)
+    _childIndex->insert(qHash(children_[i]->name()), children_[i]);
+}
+
+void KDirInfo::dropChildIndex() {
+  delete _childIndex;
+  _childIndex = 0;
+}
+
+void KDirInfo::childAdded(KFileInfo *newChild) {
+  // Update this directory and all its parents. This is a loop rather than
+  // a recursion so it works for arbitrarily deep trees.
+  //
+  // Usually the new child is a single fresh item, but it may as well be a
+  // complete subtree that was built elsewhere (see
+  // KDirTree::publishSubtree()), so add all of its totals.
+  //
+  // Asking for those would sum up a dirty subtree right away, before it is
+  // finalized, and nothing would ever correct that. If this directory is
+  // dirty, its recalculation takes care of the new child anyway.
+
+  if (_summaryDirty)
+    return;
 
+  KFileSize size = newChild->totalSize();
+  KFileSize blocks = newChild->totalBlocks();
+  KFileCount items = newChild->totalItems() + 1;
+  KFileCount subDirs = newChild->totalSubDirs() + (newChild->isDir() ? 1 : 0);
+  KFileCount files = newChild->totalFiles() + (newChild->isFile() ? 1 : 0);
+  time_t latestMtime = newChild->latestMtime();
+
+  for (KDirInfo *dir = this; dir; dir = dir->_parent) {
     /*
      * Don't bother updating the summary fields if the summary is dirty
      * (i.e. outdated) anyway: As soon as anybody wants to know some exact
      * value a complete recalculation of the entire subtree will be
      * triggered. On the other hand, if nobody wants to know (which is very
      * likely) we can save this effort.
+     *
+     * All parents of a dirty directory are dirty as well (see
+     * markAsDirty()), so there is nothing left to do further up.
      */
-  }
+    if (dir->_summaryDirty)
+      break;
 
-  if (_parent)
-    _parent->childAdded(newChild);
+    dir->_totalSize += size;
+    dir->_totalBlocks += blocks;
+    dir->_totalItems += items;
+    dir->_totalSubDirs += subDirs;
+    dir->_totalFiles += files;
+
+    if (latestMtime > dir->_latestMtime)
+      dir->_latestMtime = latestMtime;
+  }
 }
 
 void KDirInfo::deletingChild(KFileInfo *deletedChild) {
   /**
-   * When children are deleted, things go downhill: Marking the summary
-   * fields as dirty (i.e. outdated) is the only thing that can be done here.
+   * Subtract the deleted child's totals from the summary fields of this
+   * directory and all its parents: They are still valid for the child at
+   * this point, so this is cheap and keeps the summaries exact.
    *
-   * The accumulated sizes could be updated (by subtracting this deleted
-   * child's values from them), but the latest mtime definitely has to be
-   * recalculated: The child now being deleted might just be the one with the
-   * latest mtime, and figuring out the second-latest cannot easily be
-   * done. So we merely mark the summary as dirty and wait until a recalc()
-   * will be triggered from outside - which might as well never happen when
-   * nobody wants to know some summary field anyway.
+   * Only the latest mtime can't be handled this way: The child now being
+   * deleted might just be the one with the latest mtime, and figuring out
+   * the second-latest would require looking at all the other children. In
+   * that case (and only then) the latest mtime is marked as dirty and
+   * recalculated from the direct children when somebody asks for it.
    **/
 
-  _summaryDirty = true;
-
-  if (_parent)
-    _parent->deletingChild(deletedChild);
+  KFileSize size = deletedChild->totalSize();
+  KFileSize blocks = deletedChild->totalBlocks();
+  KFileCount items = deletedChild->totalItems() + 1;
+  KFileCount subDirs = deletedChild->totalSubDirs() + (deletedChild->isDir() ? 1 : 0);
+  KFileCount files = deletedChild->totalFiles() + (deletedChild->isFile() ? 1 : 0);
+  time_t latestMtime = deletedChild->latestMtime();
+
+  for (KDirInfo *dir = this; dir; dir = dir->_parent) {
+    if (dir->_summaryDirty) // and so are all its parents
+      break;
+
+    dir->_totalSize -= size;
+    dir->_totalBlocks -= blocks;
+    dir->_totalItems -= items;
+    dir->_totalSubDirs -= subDirs;
+    dir->_totalFiles -= files;
+
+    if (latestMtime >= dir->_latestMtime)
+      dir->_mtimeDirty = true;
+  }
 
   if (!_beingDestroyed && deletedChild->parent() == this) {
     /**
@@ -264,68 +439,75 @@ void KDirInfo::deletingChild(KFileInfo *deletedChild) {
      * happen recursively in the destructor of this object: No use
      * bothering about the validity of the children's list if this will all
      * be history anyway in a moment.
+     *
+     * The children list is unordered, so the last child simply takes over
+     * the deleted child's slot.
      **/
-    if (deletedChild->parent() != this) {
-      qCritical() << deletedChild << " is not a child of " << this
-                  << " - cannot unlink from children list!" << endl;
-      return;
-    }
-    auto it = std::find(children_.begin(), children_.end(), deletedChild);
-    if(it == children_.end()) {
+    size_t slot = deletedChild->slot();
+
+    if (slot >= numChildren() || children_[slot] != deletedChild) {
       qCritical() << "Couldn't unlink " << deletedChild << " from " << this
                   << " children list" << endl;
     } else {
-      children_.erase(it);
+      KFileInfo *moved = children_.swapRemove(slot);
+
+      if (moved)
+        moved->setSlot(slot);
+
+      if (_childIndex)
+        _childIndex->remove(qHash(deletedChild->name()), deletedChild);
     }
   }
 }
 
 void KDirInfo::readJobAdded() {
-  _pendingReadJobs++;
-
-  if (_parent)
-    _parent->readJobAdded();
+  for (KDirInfo *dir = this; dir; dir = dir->_parent)
+    dir->_pendingReadJobs++;
 }
 
 void KDirInfo::readJobFinished() {
-  _pendingReadJobs--;
-
-  if (_parent)
-    _parent->readJobFinished();
+  for (KDirInfo *dir = this; dir; dir = dir->_parent)
+    dir->_pendingReadJobs--;
 }
 
 void KDirInfo::readJobAborted() {
-  _readState = KDirAborted;
-
-  if (_parent)
-    _parent->readJobAborted();
+  for (KDirInfo *dir = this; dir; dir = dir->_parent)
+    dir->_readState = KDirAborted;
 }
 
 void KDirInfo::finalizeLocal() { cleanupDotEntries(); }
 
-void KDirInfo::finalizeAll(KDirTree* tree) {
-  if (_isDotEntry)
-    return;
+/**
+ * Post-order traversal over all (real) directories of a subtree for
+ * finalizeAll().
+ **/
+struct KFinalizeVisitor : public KTreeVisitor {
+  KDirTree *tree;
 
-  for(size_t i = 0; i < numChildren(); i++) {
-    if(child(i)->isDirInfo()) {
-      KDirInfo *dir = static_cast<KDirInfo *>(child(i));
-      if(!dir->isDotEntry())
-        dir->finalizeAll(tree);
-    }
+  KFinalizeVisitor(KDirTree *tree) : tree(tree) {}
+
+  bool enterDir(KDirInfo *dir) { return !dir->isDotEntry(); }
+
+  void leaveDir(KDirInfo *dir) {
+    if (tree)
+      tree->sendFinalizeLocal(dir); // Must be sent _before_ finalizeLocal()!
+
+    dir->finalizeLocal();
   }
+};
 
-  // Optimization: As long as this directory is not finalized yet, it does
+void KDirInfo::finalizeAll(KDirTree* tree) {
+  // Optimization: As long as a directory is not finalized yet, it does
   // (very likely) have a dot entry and thus all direct children are
   // subdirectories, not plain files, so we don't need to bother checking
   // plain file children as well - so do finalizeLocal() only after all
-  // children are processed. If this step were the first, for directories
-  // that don't have any subdirectories finalizeLocal() would immediately
-  // get all their plain file children reparented to themselves, so they
-  // would need to be processed in the loop, too.
+  // children are processed (i.e. in post-order). If this step were the
+  // first, for directories that don't have any subdirectories
+  // finalizeLocal() would immediately get all their plain file children
+  // reparented to themselves, so they would need to be processed, too.
 
-  tree->sendFinalizeLocal(this); // Must be sent _before_ finalizeLocal()!
-  finalizeLocal();
+  KFinalizeVisitor visitor(tree);
+  walkTree(this, visitor);
 }
 
 KDirReadState KDirInfo::readState() const {
@@ -336,17 +518,16 @@ KDirReadState KDirInfo::readState() const {
 }
 
 void KDirInfo::cleanupDotEntries() {
-  if (!_dotEntry || _isDotEntry) {
-    children_.shrink_to_fit();
+  if (!_dotEntry || _isDotEntry)
     return;
-  }
 
   // Reparent dot entry children if there are no subdirectories on this level
 
   if (numChildren() == 0) {
     // qDebug() << "Reparenting children of solo dot entry " << this << endl;
-    children_ = _dotEntry->children_;
-    _dotEntry->children_.clear();
+    children_.swap(_dotEntry->children_);
+    dropChildIndex();
+    _dotEntry->dropChildIndex();
     for(size_t i = 0; i < numChildren(); i++)
       children_[i]->setParent(this);
   }
@@ -359,7 +540,4 @@ void KDirInfo::cleanupDotEntries() {
     delete _dotEntry;
     _dotEntry = 0;
   }
-  if(_dotEntry)
-    _dotEntry->cleanupDotEntries(); // just to shrink_to_fit
-  children_.shrink_to_fit();
 }
@@ -4,8 +4,11 @@
  *   Author:	Stefan Hundhammer <sh@suse.de>
  */
 
+#include "kchildlist.h"
 #include "kfileinfo.h"
+#include <QMultiHash>
 #include <kfileitem.h>
+#include <vector>
 
 #ifndef NOT_USED
 #define NOT_USED(PARAM) ((void)(PARAM))
@@ -25,9 +28,12 @@ class KDirTree;
  * respective methods to integrate seamlessly with the abstraction of a
  * file / directory tree; this class fills those stubs with life.
  *
+ * Nothing is derived from this class, so calls through a KDirInfo pointer
+ * don't need to go through the virtual table.
+ *
  * @short directory item within a @ref KDirTree.
  **/
-class KDirInfo : public KFileInfo {
+class KDirInfo final : public KFileInfo {
 public:
   /**
    * Default constructor.
@@ -67,21 +73,36 @@ public:
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
-  KFileSize totalSize() override;
+  KFileSize totalSize() override {
+    if (_summaryDirty)
+      recalc();
+
+    return _totalSize;
+  }
 
   /**
    * Returns the total size in blocks of this subtree.
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
-  KFileSize totalBlocks() override;
+  KFileSize totalBlocks() override {
+    if (_summaryDirty)
+      recalc();
+
+    return _totalBlocks;
+  }
 
   /**
    * Returns the total number of children in this subtree, excluding this item.
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
-  int totalItems() override;
+  KFileCount totalItems() override {
+    if (_summaryDirty)
+      recalc();
+
+    return _totalItems;
+  }
 
   /**
    * Returns the total number of subdirectories in this subtree,
@@ -89,7 +110,12 @@ public:
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
-  int totalSubDirs() override;
+  KFileCount totalSubDirs() override {
+    if (_summaryDirty)
+      recalc();
+
+    return _totalSubDirs;
+  }
 
   /**
    * Returns the total number of plain file children in this subtree,
@@ -97,14 +123,24 @@ public:
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
-  int totalFiles() override;
+  KFileCount totalFiles() override {
+    if (_summaryDirty)
+      recalc();
+
+    return _totalFiles;
+  }
 
   /**
    * Returns the latest modification time of this subtree.
    *
    * Reimplemented - inherited from @ref KFileInfo.
    **/
-  time_t latestMtime() override;
+  time_t latestMtime() override {
+    if (_summaryDirty || _mtimeDirty)
+      recalc();
+
+    return _latestMtime;
+  }
 
   /**
    * Returns 'true' if this had been excluded while reading.
@@ -116,6 +152,47 @@ public:
    **/
   void setExcluded(bool excl = true) override { _isExcluded = excl; }
 
+  /**
+   * Returns 'true' if this directory's subtree was collapsed into its
+   * totals by @ref collapse().
+   *
+   * Reimplemented - inherited from @ref KFileInfo.
+   **/
+  bool isAggregate() const override { return _isAggregate; }
+
+  /**
+   * Unlink all children (including the dot entry) and keep only the
+   * summary fields, turning this directory into an aggregate. This is only
+   * safe for finished subtrees: There must not be any pending read jobs
+   * below this directory.
+   *
+   * The unlinked children are added to 'detached'; the caller has to
+   * delete them, possibly in the background, and to notify everybody else
+   * (see @ref KDirTree::collapseSubtree()).
+   **/
+  void collapse(std::vector<KFileInfo *> &detached);
+
+  /**
+   * Turn this directory, which must not have any children yet, into an
+   * aggregate with the given totals, e.g. those a cache file recorded for
+   * a subtree that is not read (yet).
+   **/
+  void setAggregate(KFileSize totalSize, KFileSize totalBlocks,
+                    KFileCount totalItems, KFileCount totalSubDirs,
+                    KFileCount totalFiles, time_t latestMtime);
+
+  /**
+   * Returns 'true' if this directory must not be collapsed, e.g. because
+   * the user explicitly asked to see its content.
+   **/
+  bool isPinned() const { return _isPinned; }
+
+  /**
+   * Mark this directory and all its parents as pinned so none of them
+   * will be collapsed.
+   **/
+  void setPinned();
+
   /**
    * Returns whether or not this is a mount point.
    *
@@ -160,6 +237,14 @@ public:
   size_t numChildren() const override { return children_.size(); }
   KFileInfo * child(size_t i) override { return children_[i]; }
 
+  /**
+   * Call 'func' for each direct child (not including the dot entry) in a
+   * tight loop.
+   **/
+  template <class Func> void forEachChild(Func func) const {
+    children_.forEach(func);
+  }
+
   /**
    * Insert a child into the children list.
    *
@@ -168,6 +253,17 @@ public:
    **/
   void insertChild(KFileInfo *newChild) override;
 
+  /**
+   * Find a direct child (or a child of the dot entry) named 'name'.
+   *
+   * Directories with at least ChildIndexThreshold children build a
+   * name hash index upon the first lookup and keep it up to date from
+   * then on; smaller ones are simply searched linearly.
+   *
+   * Reimplemented - inherited from @ref KFileInfo.
+   **/
+  KFileInfo *findChild(const QStringRef &name) override;
+
   /**
    * Get the "Dot Entry" for this node if there is one (or 0 otherwise):
    * This is a pseudo entry that directory nodes use to store
@@ -233,7 +329,8 @@ public:
 
   /**
    * Recursively finalize all directories from here on -
-   * call finalizeLocal() recursively.
+   * call finalizeLocal() recursively. 'tree' is notified about each
+   * directory; pass 0 for a subtree that is not part of any tree yet.
    **/
   void finalizeAll(KDirTree *);
 
@@ -257,25 +354,38 @@ public:
   void setReadState(KDirReadState newReadState);
 
   /**
-   * Returns true if this is a @ref KDirInfo object.
-   *
-   * Don't confuse this with @ref isDir() which tells whether or not this
-   * is a disk directory! Both should return the same, but you'll never
-   * know - better be safe than sorry!
-   *
-   * Reimplemented - inherited from @ref KFileInfo.
+   * Recalculate the summary fields from the direct children, assuming
+   * they are all up to date. Doing this bottom-up for a whole tree is up
+   * to the caller (see @ref KDirTree::recalcAll()).
    **/
-  bool isDirInfo() const override { return true; }
+  void recalcLocal();
+
+  /**
+   * Mark the summary fields of this directory and all its parents as
+   * outdated. They are recalculated when somebody asks for them (or by
+   * @ref KDirTree::recalcAll()); until then, adding children below this
+   * directory doesn't update any summary fields, which makes inserting
+   * lots of items a lot cheaper.
+   **/
+  void markAsDirty();
 
-protected:
   /**
-   * Recursively recalculate the summary fields when they are dirty.
+   * Returns 'true' if any summary field of this directory is outdated. If
+   * so, the summary fields of all its parents are outdated as well.
+   **/
+  bool isDirty() const { return _summaryDirty || _mtimeDirty; }
+
+  /**
+   * Recalculate the summary fields of all dirty directories in this
+   * subtree.
    *
    * This is a _very_ expensive operation since the entire subtree may
-   * recursively be traversed.
+   * have to be traversed.
    **/
   void recalc();
 
+protected:
+
   /**
    * Clean up unneeded / undesired dot entries:
    * Delete dot entries that don't have any children,
@@ -291,6 +401,8 @@ protected:
   bool _isDotEntry : 1;   // Flag: is this entry a "dot entry"?
   bool _isMountPoint : 1; // Flag: is this a mount point?
   bool _isExcluded : 1;   // Flag: was this directory excluded?
+  bool _isAggregate : 1;  // Flag: were the children discarded?
+  bool _isPinned : 1;     // Flag: must this subtree stay in memory?
   int _pendingReadJobs;   // number of open directories in this subtree
   KDirInfo *_dotEntry;   // pseudo entry to hold non-dir children
 
@@ -298,20 +410,54 @@ protected:
 
   KFileSize _totalSize;
   KFileSize _totalBlocks;
-  int _totalItems;
-  int _totalSubDirs;
-  int _totalFiles;
+  KFileCount _totalItems;
+  KFileCount _totalSubDirs;
+  KFileCount _totalFiles;
   time_t _latestMtime;
 
   bool _summaryDirty : 1; // dirty flag for the cached values
+  bool _mtimeDirty : 1;   // dirty flag for _latestMtime only
   bool _beingDestroyed : 1;
   KDirReadState _readState;
 
 private:
+  struct RecalcVisitor;
+
   void recalcOneChild(KFileInfo*);
   void init();
-  //TODO: could we store KFileInfo instead of KFileInfo* ?
-  std::vector<KFileInfo*> children_;
+
+  /**
+   * Recalculate only the latest mtime from the direct children, assuming
+   * they are all up to date.
+   **/
+  void recalcLatestMtimeLocal();
+
+  /**
+   * Delete all children and the dot entry without recursion.
+   **/
+  void deleteChildren();
+
+  /**
+   * Move all children and the dot entry to 'pending', leaving this
+   * directory empty.
+   **/
+  void takeChildren(std::vector<KFileInfo *> &pending);
+
+  /**
+   * Build the name index over all current children.
+   **/
+  void buildChildIndex();
+
+  /**
+   * Throw away the name index (if there is one). It will be rebuilt
+   * upon the next lookup if this directory is still large enough.
+   **/
+  void dropChildIndex();
+
+  static const size_t ChildIndexThreshold = 32;
+
+  KChildList children_;
+  QMultiHash<uint, KFileInfo *> *_childIndex; // name hash -> child, or 0
 
 }; // class KDirInfo
 
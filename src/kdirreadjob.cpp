@@ -4,6 +4,7 @@
  *              Joshua Hodosh <kdirstat@grumpypenguin.org>
  */
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -12,12 +13,18 @@
 #include <stdio.h>
 #include <sys/errno.h>
 
-#include "k4dirstat.h"
 #include "kdirreadjob.h"
 #include "kdirtree.h"
 #include "kdirtreecache.h"
 #include "kexcluderules.h"
 #include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QMutex>
+#include <QThread>
+
+// How often to check on a job that waits for another thread (in ms)
+#define BACKGROUND_POLL_INTERVAL 100
 
 using namespace KDirStat;
 
@@ -67,8 +74,9 @@ void KDirReadJob::deletingChild(KFileInfo *deletedChild) {
   _tree->deletingChildNotify(deletedChild);
 }
 
-KLocalDirReadJob::KLocalDirReadJob(KDirTree *tree, KDirInfo *dir)
-    : KDirReadJob(tree, dir), _diskDir(0) {}
+KLocalDirReadJob::KLocalDirReadJob(KDirTree *tree, KDirInfo *dir,
+                                   bool useCacheFiles)
+    : KDirReadJob(tree, dir), _diskDir(0), _useCacheFiles(useCacheFiles) {}
 
 KLocalDirReadJob::~KLocalDirReadJob() {}
 
@@ -78,6 +86,20 @@ void KLocalDirReadJob::startReading() {
   QString dirName = _dir->url();
 
   if ((_diskDir = opendir(dirName.toLocal8Bit()))) {
+    QString cacheFile = _useCacheFiles ? findCacheFile() : QString();
+
+    if (!cacheFile.isEmpty()) {
+      // Don't read anything here: The cache file is read in the background
+      // and takes the place of this directory, or if it turns out to be
+      // about something else, a new job reads this directory after all.
+
+      closedir(_diskDir);
+      _tree->addBackgroundJob(
+          KCacheReadJob::forUnreadDir(_tree, _dir, cacheFile));
+      finished();
+      return;
+    }
+
     _tree->sendProgressInfo(dirName);
     _dir->setReadState(KDirReading);
 
@@ -123,53 +145,9 @@ void KLocalDirReadJob::startReading() {
             }
           } else // non-directory child
           {
-            if (entryName == DEFAULT_CACHE_NAME) // .kdirstat.cache.gz found?
-            {
-              //
-              // Read content of this subdirectory from cache file
-              //
-
-              KCacheReadJob *cacheReadJob =
-                  new KCacheReadJob(_tree, _dir->parent(), fullName);
-              Q_CHECK_PTR(cacheReadJob);
-              QString firstDirInCache = cacheReadJob->reader()->firstDir();
-
-              if (firstDirInCache ==
-                  dirName) // Does this cache file match this directory?
-              {
-                qDebug() << "Using cache file " << fullName << " for "
-                         << dirName << endl;
-
-                cacheReadJob->reader()
-                    ->rewind(); // Read offset was moved by firstDir()
-                _tree->addJob(cacheReadJob); // Job queue will assume ownership
-                                             // of cacheReadJob
-
-                //
-                // Clean up partially read directory content
-                //
-
-                KDirTree *tree = _tree; // Copy data members to local variables:
-                KDirInfo *dir =
-                    _dir; // This object will be deleted soon by killAll()
-
-                _queue->killAll(dir); // Will delete this job as well!
-                // All data members of this object are invalid from here on!
-
-                tree->deleteSubtree(dir);
-
-                return;
-              } else {
-                qDebug() << "NOT using cache file " << fullName << " with dir "
-                         << firstDirInCache << " for " << dirName << endl;
-
-                delete cacheReadJob;
-              }
-            } else {
-              KFileInfo *child = new KFileInfo(entryName, &statInfo, _dir);
-              _dir->insertChild(child);
-              childAdded(child);
-            }
+            KFileInfo *child = new KFileInfo(entryName, &statInfo, _dir);
+            _dir->insertChild(child);
+            childAdded(child);
           }
         } else // lstat() error
         {
@@ -205,6 +183,23 @@ void KLocalDirReadJob::startReading() {
   // Don't add anything after finished() since this deletes this job!
 }
 
+QString KLocalDirReadJob::findCacheFile() {
+  static const char *const names[] = {DEFAULT_BINARY_CACHE_NAME,
+                                      DEFAULT_CACHE_NAME};
+  struct stat statInfo;
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (fstatat(dirfd(_diskDir), names[i], &statInfo, AT_SYMLINK_NOFOLLOW) ==
+            0 &&
+        S_ISREG(statInfo.st_mode) &&
+        _tree->isNestedCacheFresh(_dir, statInfo.st_mtime)) {
+      return _dir->url() + "/" + names[i];
+    }
+  }
+
+  return QString();
+}
+
 KFileInfo *KLocalDirReadJob::stat(const QUrl &url, KDirInfo *parent) {
   struct stat statInfo;
 
@@ -341,9 +336,117 @@ QString KioDirReadJob::owner(QUrl url) {
   return QString();
 }
 
+/**
+ * Worker thread of a KCacheReadJob: Reads the complete cache file into a
+ * detached subtree and prepares it for publishing.
+ **/
+class KDirStat::KCacheReadThread : public QThread {
+public:
+  KCacheReadThread(KCacheReader *reader)
+      : _reader(reader), _asRoot(false), _tree(0), _canceled(false),
+        _subtree(0) {}
+
+  /**
+   * Open cache file 'fileName' in the thread, too, and read it only if it
+   * is about directory 'dirPath'. 'asRoot' is passed on to
+   * KCacheReader::setDetached() along with a copy of the global exclude
+   * rules, which is made right here in the GUI thread.
+   **/
+  KCacheReadThread(const QString &fileName, const QString &dirPath,
+                   bool asRoot, KDirTree *tree)
+      : _reader(0), _fileName(fileName), _dirPath(dirPath), _asRoot(asRoot),
+        _tree(tree), _excludeRules(*KExcludeRules::excludeRules()),
+        _canceled(false), _subtree(0) {}
+
+  /**
+   * Returns the subtree that was read. Only call this after wait().
+   **/
+  KDirInfo *subtree() const { return _subtree; }
+
+  /**
+   * Returns the reader, including one that was opened in the thread. Only
+   * call this after wait().
+   **/
+  KCacheReader *reader() const { return _reader; }
+
+  /**
+   * Stop reading as soon as possible.
+   **/
+  void cancel() {
+    QMutexLocker locker(&_mutex);
+    _canceled = true;
+
+    if (_reader)
+      _reader->cancel();
+  }
+
+protected:
+  void run() override {
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!_reader && !open())
+      return;
+
+    _reader->read(0);
+
+    if (_reader->ok())
+      _subtree = _reader->takeSubtree();
+
+    qDebug() << "Reading " << _reader->totalBytes() << " bytes of cache took "
+             << timer.elapsed() << " ms" << endl;
+  }
+
+  /**
+   * Open the cache file and check that it is about the directory it is
+   * meant for. This reads no more than the header and the first directory.
+   **/
+  bool open() {
+    KCacheReader *reader = new KCacheReader(_fileName, _tree);
+    Q_CHECK_PTR(reader);
+
+    {
+      QMutexLocker locker(&_mutex);
+      _reader = reader;
+
+      if (_canceled)
+        return false;
+    }
+
+    if (!reader->ok())
+      return false;
+
+    // There may be many of these threads, so each one reads on its own.
+
+    reader->setDetached(_asRoot, _excludeRules);
+    reader->setParallel(false);
+    QString firstDir = reader->firstDir();
+
+    if (firstDir != _dirPath) {
+      qDebug() << "NOT using cache file " << _fileName << " with dir "
+               << firstDir << " for " << _dirPath << endl;
+      return false;
+    }
+
+    reader->rewind(); // Read offset was moved by firstDir()
+    return true;
+  }
+
+private:
+  KCacheReader *_reader;
+  QString _fileName;
+  QString _dirPath;
+  bool _asRoot;
+  KDirTree *_tree;
+  KExcludeRules _excludeRules;
+  QMutex _mutex; // for _reader and _canceled while open() is running
+  bool _canceled;
+  KDirInfo *_subtree;
+};
+
 KCacheReadJob::KCacheReadJob(KDirTree *tree, KDirInfo *parent,
                              KCacheReader *reader)
-    : KObjDirReadJob(tree, parent), _reader(reader) {
+    : KObjDirReadJob(tree, parent), _reader(reader), _thread(0) {
   if (_reader)
     _reader->rewind();
 
@@ -352,18 +455,27 @@ KCacheReadJob::KCacheReadJob(KDirTree *tree, KDirInfo *parent,
 
 KCacheReadJob::KCacheReadJob(KDirTree *tree, KDirInfo *parent,
                              const QString &cacheFileName)
-    : KObjDirReadJob(tree, parent) {
+    : KObjDirReadJob(tree, parent), _thread(0) {
   _reader = new KCacheReader(cacheFileName, tree, parent);
   Q_CHECK_PTR(_reader);
 
   init();
 }
 
+KCacheReadJob *KCacheReadJob::forUnreadDir(KDirTree *tree, KDirInfo *dir,
+                                           const QString &cacheFileName) {
+  KCacheReadJob *job = new KCacheReadJob(tree, dir, (KCacheReader *)0);
+  Q_CHECK_PTR(job);
+  job->_unreadDirCache = cacheFileName;
+
+  return job;
+}
+
 void KCacheReadJob::init() {
   if (_reader) {
     if (_reader->ok()) {
-      connect(_reader, SIGNAL(childAdded(KFileInfo *)), this,
-              SLOT(slotChildAdded(KFileInfo *)));
+      // Without a parent, the cache replaces the complete tree.
+      _reader->setDetached(_dir == 0, *KExcludeRules::excludeRules());
     } else {
       delete _reader;
       _reader = 0;
@@ -372,6 +484,20 @@ void KCacheReadJob::init() {
 }
 
 KCacheReadJob::~KCacheReadJob() {
+  if (_thread) {
+    if (_queue && _unreadDirCache.isEmpty())
+      _queue->setWaiting(false);
+
+    _thread->cancel();
+    _thread->wait();
+
+    if (!_reader)
+      _reader = _thread->reader(); // opened in the thread
+
+    delete _thread->subtree(); // Never published
+    delete _thread;
+  }
+
   if (_reader)
     delete _reader;
 }
@@ -382,24 +508,137 @@ void KCacheReadJob::read() {
    * finished() is called.
    */
 
+  if (!_unreadDirCache.isEmpty()) {
+    // A background job: Just check on the thread now and then.
+
+    if (!_thread) {
+      _thread = new KCacheReadThread(_unreadDirCache, _dir->url(),
+                                     _dir->parent() == 0, _tree);
+      _thread->start();
+    } else if (_thread->isFinished()) {
+      publish();
+      finished();
+    }
+
+    return;
+  }
+
   if (!_reader) {
     finished();
     return;
   }
 
-  // qDebug() << "Reading 1000 cache lines" << endl;
-  _reader->read(1000);
+  if (!_thread) {
+    _thread = new KCacheReadThread(_reader);
+    _thread->start();
+    _queue->setWaiting(true);
+    return;
+  }
+
+  if (!_thread->isFinished()) {
+    qint64 total = qMax(_reader->totalBytes(), (qint64)1);
+    int percent = qMin(_reader->bytesRead() * 100 / total, (qint64)100);
+
+    _tree->sendProgressInfo(
+        QString("%1 (%2%)").arg(_reader->fileName()).arg(percent));
+    return;
+  }
+
+  _queue->setWaiting(false);
+  publish();
   _tree->sendProgressInfo("");
 
-  if (_reader->eof() || !_reader->ok()) {
-    // qDebug() << "Cache reading finished - ok: " << _reader->ok() << endl;
-    finished();
+  // qDebug() << "Cache reading finished - ok: " << _reader->ok() << endl;
+  finished();
+}
+
+void KCacheReadJob::publish() {
+  _thread->wait();
+  KDirInfo *subtree = _thread->subtree();
+
+  if (!_reader)
+    _reader = _thread->reader(); // opened in the thread
+
+  delete _thread;
+  _thread = 0;
+
+  if (!_unreadDirCache.isEmpty()) {
+    replaceDir(subtree);
+    return;
+  }
+
+  if (!subtree)
+    return;
+
+  KDirInfo *parent = 0;
+
+  if (_dir) {
+    // Most likely, the subtree belongs right here, but the cache file
+    // might as well be about any other directory of the tree.
+
+    QString parentPath = QFileInfo(_reader->toplevelPath()).dir().path();
+
+    if (_dir->url() == parentPath)
+      parent = _dir;
+    else
+      parent = dynamic_cast<KDirInfo *>(_tree->locate(parentPath));
+
+    if (!parent) {
+      qCritical() << "Could not locate parent " << parentPath << endl;
+      delete subtree;
+      return;
+    }
   }
+
+  _tree->publishSubtree(parent, subtree);
+
+  // The cache file has all of the tree now, so changes can be added to it.
+
+  if (!parent)
+    _tree->setCacheFile(_reader->fileName(), _reader->shardLevels());
+
+  // The directories that were left unread are read from the same file
+  // or from their shard files once they are expanded.
+
+  _tree->addLazyShards(_reader->takeLazyShards());
+  KBinaryCache *lazyCache = _reader->takeLazyCache();
+
+  if (lazyCache)
+    _tree->setLazyCache(lazyCache);
 }
 
-KDirReadJobQueue::KDirReadJobQueue() : QObject() {
+void KCacheReadJob::replaceDir(KDirInfo *subtree) {
+  KDirInfo *dir = _dir;
+
+  if (!subtree) {
+    // Not about this directory or broken: Read it from disk after all.
+    // That job keeps it busy from now on.
+
+    _tree->addJob(new KLocalDirReadJob(_tree, dir, false));
+    return;
+  }
+
+  qDebug() << "Using cache file " << _unreadDirCache << " for " << dir
+           << endl;
+
+  // The directory is gone in a moment, so it must not hear from this job
+  // any more.
+
+  dir->readJobFinished();
+  setDir(0);
+
+  KDirInfo *parent = dir->parent();
+  _tree->deleteSubtree(dir);
+  _tree->publishSubtree(parent, subtree);
+
+  if (_reader)
+    _tree->addLazyShards(_reader->takeLazyShards());
+}
+
+KDirReadJobQueue::KDirReadJobQueue() : QObject(), _waiting(false) {
 
   connect(&_timer, SIGNAL(timeout()), this, SLOT(timeSlicedRead()));
+  _backgroundPoll.start();
 }
 
 KDirReadJobQueue::~KDirReadJobQueue() { clear(); }
@@ -413,7 +652,22 @@ void KDirReadJobQueue::enqueue(KDirReadJob *job) {
       // qDebug() << "First job queued" << endl;
       emit startingReading();
       _timer.start(0);
+    } else
+      updateInterval();
+  }
+}
+
+void KDirReadJobQueue::enqueueBackground(KDirReadJob *job) {
+  if (job) {
+    _background.append(job);
+    job->setQueue(this);
+
+    if (!_timer.isActive()) {
+      emit startingReading();
+      _timer.start(0);
     }
+
+    updateInterval();
   }
 }
 
@@ -434,9 +688,18 @@ void KDirReadJobQueue::clear() {
     delete job;
     i.remove();
   }
+
+  while (!_background.isEmpty())
+    delete _background.takeFirst();
+
+  _waiting = false;
 }
 
 void KDirReadJobQueue::abort() {
+  _queue += _background;
+  _background.clear();
+  _waiting = false;
+
   while (!_queue.isEmpty()) {
     KDirReadJob *job = _queue.first();
 
@@ -452,35 +715,74 @@ void KDirReadJobQueue::killAll(KDirInfo *subtree) {
   if (!subtree)
     return;
 
-  QMutableListIterator<KDirReadJob *> i(_queue);
-  while (i.hasNext()) {
-    KDirReadJob *job = i.next();
-    if (job->dir() && job->dir()->isInSubtree(subtree)) {
-      i.remove();
-      delete job;
-    } else {
+  QList<KDirReadJob *> *lists[] = {&_queue, &_background};
+
+  for (int l = 0; l < 2; l++) {
+    QMutableListIterator<KDirReadJob *> i(*lists[l]);
+    while (i.hasNext()) {
+      KDirReadJob *job = i.next();
+      if (job->dir() && job->dir()->isInSubtree(subtree)) {
+        i.remove();
+        delete job;
+      }
     }
   }
 }
 
 void KDirReadJobQueue::timeSlicedRead() {
+  // Background jobs only need to be checked on now and then, but they
+  // should not wait for the timer if there is nothing else to do.
+
+  if (!_background.isEmpty() &&
+      (_queue.isEmpty() || _waiting ||
+       _backgroundPoll.elapsed() >= BACKGROUND_POLL_INTERVAL)) {
+    _backgroundPoll.restart();
+
+    // Calling one of them may finish others or add new ones.
+
+    QList<KDirReadJob *> jobs =
+        _background.mid(0, QThread::idealThreadCount());
+
+    for (int i = 0; i < jobs.size(); i++) {
+      if (_background.contains(jobs[i]))
+        jobs[i]->read();
+    }
+  }
+
   if (!_queue.isEmpty())
     _queue.first()->read();
 }
 
+void KDirReadJobQueue::setWaiting(bool waiting) {
+  _waiting = waiting;
+  updateInterval();
+}
+
+void KDirReadJobQueue::updateInterval() {
+  bool waiting = _queue.isEmpty() || _waiting;
+  _timer.setInterval(waiting ? BACKGROUND_POLL_INTERVAL : 0);
+}
+
 void KDirReadJobQueue::jobFinishedNotify(KDirReadJob *job) {
   // Get rid of the old (finished) job.
 
-  _queue.removeFirst();
+  KDirInfo *dir = job->dir();
+
+  if (!_background.removeOne(job)) {
+    _queue.removeOne(job);
+    _waiting = false;
+  }
+
   delete job;
+  emit jobFinished(dir);
 
   // Look for a new job.
 
-  if (_queue.isEmpty()) // No new job available - we're done.
+  if (isEmpty()) // No new job available - we're done.
   {
     _timer.stop();
     // qDebug() << "No more jobs - finishing" << endl;
     emit finished();
-  }
+  } else
+    updateInterval();
 }
-
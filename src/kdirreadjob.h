@@ -6,6 +6,7 @@
  *              Joshua Hodosh <kdirstat@grumpypenguin.org>
  */
 
+#include <QElapsedTimer>
 #include <dirent.h>
 #include <kio/jobclasses.h>
 #include <qlist.h>
@@ -25,6 +26,7 @@ class KFileInfo;
 class KDirInfo;
 class KDirTree;
 class KCacheReader;
+class KCacheReadThread;
 class KDirReadJobQueue;
 
 /**
@@ -172,8 +174,13 @@ class KLocalDirReadJob : public KDirReadJob {
 public:
   /**
    * Constructor.
+   *
+   * If 'useCacheFiles' is 'true' and 'dir' has a cache file of its own
+   * that is recent enough (see @ref KDirTree::isNestedCacheFresh()), 'dir'
+   * is not read at all: A @ref KCacheReadJob replaces it with the content
+   * of the cache file in the background.
    **/
-  KLocalDirReadJob(KDirTree *tree, KDirInfo *dir);
+  KLocalDirReadJob(KDirTree *tree, KDirInfo *dir, bool useCacheFiles = true);
 
   /**
    * Destructor.
@@ -197,7 +204,15 @@ protected:
    **/
   void startReading() override;
 
+  /**
+   * Returns the full path of the cache file in _dir that can be used
+   * instead of reading _dir or an empty string if there is none. This only
+   * costs an fstatat() call per cache file name.
+   **/
+  QString findCacheFile();
+
   DIR *_diskDir;
+  bool _useCacheFiles;
 
 }; // KLocalDirReadJob
 
@@ -267,6 +282,16 @@ protected:
 
 }; // KioDirReadJob
 
+/**
+ * Read job that reads a cache file.
+ *
+ * The cache file is read in a thread of its own into a new subtree that
+ * nobody else can see yet (see @ref KCacheReader::setDetached()). Only
+ * when that is complete, the subtree is inserted into the tree in one
+ * step, so the GUI thread never has to handle the items one by one.
+ *
+ * @short Background cache reader
+ **/
 class KCacheReadJob : public KObjDirReadJob {
   Q_OBJECT
 
@@ -291,6 +316,17 @@ public:
    **/
   KCacheReadJob(KDirTree *tree, KDirInfo *parent, const QString &cacheFileName);
 
+  /**
+   * Create a job for cache file 'cacheFileName' that was found in directory
+   * 'dir' before 'dir' was read. Everything, even opening the file, happens
+   * in the background. If the cache file is about 'dir', its content
+   * replaces 'dir'; otherwise, 'dir' is read from disk after all.
+   *
+   * Add this job with @ref KDirTree::addBackgroundJob().
+   **/
+  static KCacheReadJob *forUnreadDir(KDirTree *tree, KDirInfo *dir,
+                                     const QString &cacheFileName);
+
   /**
    * Destructor.
    **/
@@ -314,7 +350,20 @@ protected:
    **/
   void init();
 
+  /**
+   * Insert the subtree that was read into the tree.
+   **/
+  void publish();
+
+  /**
+   * Replace _dir, which was never read, with 'subtree' or, if there is no
+   * subtree, read _dir from disk. See @ref forUnreadDir().
+   **/
+  void replaceDir(KDirInfo *subtree);
+
   KCacheReader *_reader;
+  KCacheReadThread *_thread;
+  QString _unreadDirCache; // see forUnreadDir()
 
 }; // class KCacheReadJob
 
@@ -343,6 +392,14 @@ public:
    **/
   void enqueue(KDirReadJob *job);
 
+  /**
+   * Add a job that does its work in another thread and only needs to be
+   * called now and then to check on it. It does not wait for the jobs in
+   * the queue, nor do they wait for it: Up to one such job per CPU core
+   * runs at the same time as the head of the queue.
+   **/
+  void enqueueBackground(KDirReadJob *job);
+
   /**
    * Remove the head of the queue and return it.
    **/
@@ -359,12 +416,13 @@ public:
   int count() const { return _queue.count(); }
 
   /**
-   * Check if the queue is empty.
+   * Check if the queue is empty, background jobs included.
    **/
-  bool isEmpty() const { return _queue.isEmpty(); }
+  bool isEmpty() const { return _queue.isEmpty() && _background.isEmpty(); }
 
   /**
-   * Clear the queue: Remove all pending jobs from the queue and destroy them.
+   * Clear the queue: Remove all pending jobs from the queue and destroy
+   * them, background jobs included.
    **/
   void clear();
 
@@ -385,6 +443,13 @@ public:
    **/
   void jobFinishedNotify(KDirReadJob *job);
 
+  /**
+   * Notification that the job at the head of the queue only waits for
+   * work that is done in another thread, so it does not need to be called
+   * all that often until further notice ('waiting' is 'false').
+   **/
+  void setWaiting(bool waiting);
+
 signals:
 
   /**
@@ -393,9 +458,15 @@ signals:
    **/
   void startingReading();
 
+  /**
+   * Emitted when a read job is finished and deleted. 'dir' is the
+   * directory that job was reading (which may be 0).
+   **/
+  void jobFinished(KDirInfo *dir);
+
   /**
    * Emitted when reading is finished, i.e. when the last read job of the
-   * queue is finished.
+   * queue (background jobs included) is finished.
    **/
   void finished();
 
@@ -413,8 +484,17 @@ protected slots:
   void timeSlicedRead();
 
 protected:
+  /**
+   * Set the timer interval: Don't keep calling jobs that only wait for
+   * other threads.
+   **/
+  void updateInterval();
+
   QList<KDirReadJob *> _queue;
+  QList<KDirReadJob *> _background; // see enqueueBackground()
+  QElapsedTimer _backgroundPoll;    // since background jobs were last called
   QTimer _timer;
+  bool _waiting;
 };
 
 } // namespace KDirStat
@@ -554,6 +554,19 @@ KGeneralSettingsPage::KGeneralSettingsPage(QWidget *parent, k4dirstat *mainWin)
   gboxLayout->addWidget(_crossFileSystems);
   gboxLayout->addWidget(_enableLocalDirReader);
 
+  QHBoxLayout *budgetLayout = new QHBoxLayout();
+  gboxLayout->addLayout(budgetLayout);
+  QLabel *budgetLabel = new QLabel(i18n("&Memory Budget:"));
+  _memoryBudget = new QSpinBox();
+  _memoryBudget->setRange(0, 1024 * 1024);
+  _memoryBudget->setSingleStep(256);
+  _memoryBudget->setSuffix(i18n(" MB"));
+  _memoryBudget->setSpecialValueText(i18n("Unlimited"));
+  budgetLabel->setBuddy(_memoryBudget);
+  budgetLayout->addWidget(budgetLabel);
+  budgetLayout->addWidget(_memoryBudget);
+  budgetLayout->addStretch();
+
   connect(_enableLocalDirReader, SIGNAL(stateChanged(int)), this,
           SLOT(checkEnabledState()));
 
@@ -623,6 +636,7 @@ void KGeneralSettingsPage::apply() {
 
   config.writeEntry("CrossFileSystems", _crossFileSystems->isChecked());
   config.writeEntry("EnableLocalDirReader", _enableLocalDirReader->isChecked());
+  config.writeEntry("MemoryBudget", _memoryBudget->value());
 
   config = KSharedConfig::openConfig()->group("Exclude");
   // config.setGroup( "Exclude" );
@@ -644,6 +658,7 @@ void KGeneralSettingsPage::apply() {
 void KGeneralSettingsPage::revertToDefaults() {
   _crossFileSystems->setChecked(false);
   _enableLocalDirReader->setChecked(true);
+  _memoryBudget->setValue(0);
   _excludeRulesListView->clear();
   _editExcludeRuleButton->setEnabled(false);
   _deleteExcludeRuleButton->setEnabled(false);
@@ -655,6 +670,7 @@ void KGeneralSettingsPage::setup() {
   _crossFileSystems->setChecked(config.readEntry("CrossFileSystems", false));
   _enableLocalDirReader->setChecked(
       config.readEntry("EnableLocalDirReader", true));
+  _memoryBudget->setValue(config.readEntry("MemoryBudget", 0));
   _excludeRulesListView->clear();
 
   foreach (KExcludeRule *excludeRule, KExcludeRules::excludeRules()->rules()) {
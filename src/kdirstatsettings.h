@@ -547,6 +547,7 @@ protected:
 
   QCheckBox *_crossFileSystems;
   QCheckBox *_enableLocalDirReader;
+  QSpinBox *_memoryBudget;
 
   QListWidget *_excludeRulesListView;
   QPushButton *_addExcludeRuleButton;
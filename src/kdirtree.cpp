@@ -7,29 +7,65 @@
 #include "kdirreadjob.h"
 #include "kdirtree.h"
 #include "kdirtreecache.h"
+#include "knodearena.h"
+#include "ktreewalk.h"
 #include <KSharedConfig>
 #include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QThreadPool>
+#include <algorithm>
 #include <kconfig.h>
 #include <kconfiggroup.h>
+#include <time.h>
 using namespace KDirStat;
 
+// Rough estimate of the memory used per item in addition to the object
+// itself and its name: the name's string header, the slot in the parent's
+// children list and malloc() overhead.
+#define ITEM_MEMORY_OVERHEAD 64
+
+// Once the memory budget is exceeded, collapse subtrees until the memory
+// used is down to this percentage of the budget, so this doesn't start all
+// over again with the next directory read.
+#define MEMORY_BUDGET_LOW_WATER 90
+
+// Log discarding a subtree if it blocks the GUI thread for at least this
+// many milliseconds.
+#define DISCARD_STALL_LOG_MS 10
+
+// Seconds a directory may be newer than a cache file in it: Writing the
+// cache file changes the directory, too, a moment later.
+#define NESTED_CACHE_MTIME_SLACK 2
+
 KDirTree::KDirTree() : QObject() {
   _root = 0;
   _isFileProtocol = false;
   _isBusy = false;
   _readMethod = KDirReadUnknown;
+  _memoryUsed = 0;
+  _cacheStream = 0;
+  _lazyCache = 0;
+  _cacheFileSize = 0;
+  _cacheFileShardLevels = 0;
+  _changeReportPending = false;
 
   readConfig();
 
   connect(&_jobQueue, SIGNAL(finished()), this, SLOT(slotFinished()));
+  connect(&_jobQueue, SIGNAL(jobFinished(KDirInfo *)), this,
+          SLOT(slotJobFinished(KDirInfo *)));
 }
 
 KDirTree::~KDirTree() {
   _jobQueue.clear();
+  closeCacheStream(false);
+  dropLazyCache();
   selectItems();
 
   if (_root)
-    delete _root;
+    discard(_root);
 }
 
 void KDirTree::readConfig() {
@@ -37,13 +73,86 @@ void KDirTree::readConfig() {
 
   _crossFileSystems = config.readEntry("CrossFileSystems", false);
   _enableLocalDirReader = config.readEntry("EnableLocalDirReader", true);
+
+  // Memory budget in MB; 0 means unlimited.
+  _memoryBudget = (quint64)config.readEntry("MemoryBudget", 0) * 1024 * 1024;
+
+  // Subtrees with less than this percentage of the total size are collapsed
+  // as a whole when the memory budget is exceeded.
+  _aggregateThreshold = config.readEntry("AggregateThreshold", 1);
+
+  // Threads for recalcAll(); 0 means one per CPU core.
+  _recalcThreads = config.readEntry("RecalcThreads", 0);
+
+  // Directory for a memory-mapped node file for huge trees; empty means
+  // keep everything on the heap. This only takes effect once.
+  QString nodeFileDir = config.readEntry("NodeFileDir", QString());
+
+  if (!nodeFileDir.isEmpty())
+    KNodeArena::instance()->open(nodeFileDir);
+
+  // Cache file to write while reading a complete tree; empty means none.
+  // It is complete the moment reading is done, without a second pass over
+  // the tree, even if a memory budget collapses most of the tree meanwhile.
+  _streamCacheFile = config.readEntry("StreamCacheFile", QString());
+
+  // Directory levels to read when opening a binary cache file; deeper
+  // directories are only read from the file once they are expanded. 0
+  // means read everything.
+  _lazyCacheLevels = config.readEntry("LazyCacheLevels", 0);
+
+  // Write text cache files in shards: one file for each directory this many
+  // levels below the toplevel directory plus a manifest for everything
+  // else. 0 means everything goes to one file.
+  _cacheShardLevels = config.readEntry("CacheShardLevels", 0);
+
+  // Cache files found in directories while reading are used instead of
+  // reading those directories unless they are older than this many hours;
+  // 0 means any age, -1 means never use them.
+  _nestedCacheMaxAge = config.readEntry("NestedCacheMaxAge", 0);
+
+  // Also ignore such a cache file if its directory was changed after it was
+  // written. This only catches changes right in that directory, not deeper
+  // down.
+  _nestedCacheCheckDirMtime = config.readEntry("NestedCacheCheckDirMtime",
+                                               false);
+
+  // Delete discarded subtrees in a background thread. Switch this off to
+  // compare the stall times logged by discard().
+  _reclaimInBackground = config.readEntry("ReclaimInBackground", true);
+}
+
+bool KDirTree::isNestedCacheFresh(KDirInfo *dir, time_t mtime) const {
+  if (_nestedCacheMaxAge < 0)
+    return false;
+
+  if (_nestedCacheMaxAge > 0 &&
+      time(0) - mtime > (time_t)_nestedCacheMaxAge * 3600)
+    return false;
+
+  if (_nestedCacheCheckDirMtime &&
+      dir->mtime() > mtime + NESTED_CACHE_MTIME_SLACK)
+    return false;
+
+  return true;
 }
 
 void KDirTree::setRoot(KFileInfo *newRoot) {
+  _snapshot = KTreeSnapshot();
+  _snapshotPending.clear();
+  _changeBase = KTreeSnapshot();
+  _changeReportPending = false;
+  dropLazyCache();
+  _lazyShards.clear();
+  _cacheFile.clear();
+  _cacheFileChanges.clear();
+
   if (_root) {
     selectItems();
     emit deletingChild(_root);
-    delete _root;
+    discard(_root);
+    _memoryUsed = 0;
+    _collapseCandidates.clear();
     emit childDeleted();
   }
 
@@ -52,6 +161,15 @@ void KDirTree::setRoot(KFileInfo *newRoot) {
 
 void KDirTree::clear(bool sendSignals) {
   _jobQueue.clear();
+  closeCacheStream(false);
+  dropLazyCache();
+  _lazyShards.clear();
+  _cacheFile.clear();
+  _cacheFileChanges.clear();
+  _snapshot = KTreeSnapshot();
+  _snapshotPending.clear();
+  _changeBase = KTreeSnapshot();
+  _changeReportPending = false;
 
   if (_root) {
     selectItems();
@@ -59,8 +177,10 @@ void KDirTree::clear(bool sendSignals) {
     if (sendSignals)
       emit deletingChild(_root);
 
-    delete _root;
+    discard(_root);
     _root = 0;
+    _memoryUsed = 0;
+    _collapseCandidates.clear();
 
     if (sendSignals)
       emit childDeleted();
@@ -86,6 +206,7 @@ void KDirTree::startReading(const QUrl &url) {
   emit startingReading();
 
   setRoot(0);
+  closeCacheStream(false);
   readConfig();
   _isFileProtocol = url.isLocalFile();
 
@@ -105,6 +226,13 @@ void KDirTree::startReading(const QUrl &url) {
     if (_root->isDir()) {
       KDirInfo *dir = (KDirInfo *)_root;
 
+      if (!_streamCacheFile.isEmpty()) {
+        _cacheStream = new KCacheStreamWriter(dir->url());
+
+        if (!_cacheStream->open(_streamCacheFile))
+          closeCacheStream(false);
+      }
+
       if (_readMethod == KDirReadLocal)
         addJob(new KLocalDirReadJob(this, dir));
       else
@@ -146,6 +274,28 @@ void KDirTree::refresh(KFileInfo *subtree) {
                                    QUrl::AssumeLocalFile);
     KDirInfo *parent = subtree->parent();
 
+    // The cache file being written has the old subtree already. What is
+    // read now replaces it, unless it is not a directory: The line of a
+    // file is one of its parent directory's.
+
+    if (_cacheStream &&
+        !(subtree->isDirInfo() && _cacheStream->replaceSubtree(subtree->url())))
+      closeCacheStream(false);
+
+    // A lazily read cache file no longer knows what is in there.
+    if (_lazyCache)
+      _lazyCacheStale.append(subtree->url());
+
+    dropLazyShards(subtree->url());
+
+    // Neither does the cache file the tree was read from or written to.
+    cacheFileChanged(subtree);
+
+    // The snapshot is updated once the new content is read.
+
+    if (!_snapshot.isNull())
+      _snapshotPending.append(subtree->url());
+
     // Select nothing if the current selection is to be deleted
     selectionInSubTree(subtree);
 
@@ -155,7 +305,17 @@ void KDirTree::refresh(KFileInfo *subtree) {
 
     // Get rid of the old subtree.
 
-    emit deletingChild(subtree);
+    deletingChildNotify(subtree);
+
+    // Whatever collapse candidate this is in will be one again as soon as
+    // the new subtree is read, with the new subtree's memory.
+
+    if (_memoryBudget) {
+      CandidateIterator it = enclosingCandidate(parent);
+
+      if (it != _collapseCandidates.end())
+        _collapseCandidates.erase(it);
+    }
 
     // qDebug() << "Deleting subtree " << subtree << endl;
 
@@ -169,7 +329,7 @@ void KDirTree::refresh(KFileInfo *subtree) {
      * I just found that out the hard way by several hours of debugging. ;-}
      **/
     parent->deletingChild(subtree);
-    delete subtree;
+    discard(subtree);
     emit childDeleted();
 
     _isBusy = true;
@@ -199,6 +359,9 @@ void KDirTree::refresh(KFileInfo *subtree) {
         else
           addJob(new KioDirReadJob(this, dir));
       } else {
+        // Its line would have to go to the parent directory's.
+        closeCacheStream(false);
+
         _isBusy = false;
         emit finished();
       }
@@ -211,17 +374,32 @@ void KDirTree::abortReading() {
     return;
 
   _jobQueue.abort();
+  closeCacheStream(false);
+
+  // What was not read again can't be compared.
+  _changeBase = KTreeSnapshot();
+  _changeReportPending = false;
 
   _isBusy = false;
   emit aborted();
 }
 
 void KDirTree::slotFinished() {
+  if (_cacheStream)
+    closeCacheStream(true);
+
   _isBusy = false;
+  updateSnapshot();
   emit finished();
+
+  if (_changeReportPending)
+    reportChanges();
 }
 
 void KDirTree::childAddedNotify(KFileInfo *newChild) {
+  if (_memoryBudget)
+    _memoryUsed += itemMemory(newChild);
+
   emit childAdded(newChild);
 
   if (newChild->dotEntry())
@@ -229,6 +407,16 @@ void KDirTree::childAddedNotify(KFileInfo *newChild) {
 }
 
 void KDirTree::deletingChildNotify(KFileInfo *deletedChild) {
+  if (_memoryBudget) {
+    quint64 memory = takeSubtreeMemory(deletedChild);
+    _memoryUsed -= qMin(_memoryUsed, memory);
+
+    CandidateIterator it = enclosingCandidate(deletedChild->parent());
+
+    if (it != _collapseCandidates.end())
+      it.value() -= qMin(it.value(), memory);
+  }
+
   emit deletingChild(deletedChild);
 
   // Only now check for selection and root: Give connected objects
@@ -243,8 +431,16 @@ void KDirTree::childDeletedNotify() { emit childDeleted(); }
 
 void KDirTree::deleteSubtree(KFileInfo *subtree) {
   // qDebug() << "Deleting subtree " << subtree << endl;
+
+  if (!_snapshot.isNull()) {
+    _snapshot = _snapshot.withSubtree(KTreeSnapshot::pathOf(subtree, _root),
+                                      0);
+  }
   KDirInfo *parent = subtree->parent();
 
+  cacheFileChanged(subtree);
+  dropLazyShards(subtree->url());
+
   if (parent) {
     // Give the parent of the child to be deleted a chance to unlink the
     // child from its children list and take care of internal summary
@@ -268,7 +464,7 @@ void KDirTree::deleteSubtree(KFileInfo *subtree) {
           deletingChildNotify(parent);
           parent->parent()->setDotEntry(0);
 
-          delete parent;
+          discard(parent);
         }
       } else // no parent - this should never happen (?)
       {
@@ -285,7 +481,7 @@ void KDirTree::deleteSubtree(KFileInfo *subtree) {
     }
   }
 
-  delete subtree;
+  discard(subtree);
 
   if (subtree == _root) {
     selectItems();
@@ -295,13 +491,616 @@ void KDirTree::deleteSubtree(KFileInfo *subtree) {
   emit childDeleted();
 }
 
+KFileInfo *KDirTree::expandAggregate(KFileInfo *aggregate) {
+  if (!aggregate || !aggregate->isAggregate() || !aggregate->parent())
+    return 0;
+
+  KDirInfo *parent = aggregate->parent();
+  QString name = aggregate->name();
+  QString url = aggregate->url();
+  KDirInfo *dir = readLazyCache(url);
+
+  if (dir && dir->isAggregate()) {
+    // It was an aggregate when the cache file was written: The file has
+    // nothing but the totals either.
+
+    delete dir;
+    dir = 0;
+  }
+
+  if (dir) {
+    // Replace the aggregate with what the cache file knows about it.
+
+    replaceAggregate(aggregate, dir);
+    dir->setPinned();
+
+    return dir;
+  }
+
+  refresh(aggregate);
+  KFileInfo *subtree = parent->findChild(QStringRef(&name));
+
+  if (subtree && subtree->isDirInfo())
+    static_cast<KDirInfo *>(subtree)->setPinned();
+
+  return subtree;
+}
+
+void KDirTree::replaceAggregate(KFileInfo *aggregate, KDirInfo *subtree) {
+  KDirInfo *parent = aggregate->parent();
+
+  if (!_snapshot.isNull())
+    _snapshotPending.append(aggregate->url());
+
+  if (_cacheStream && !_cacheStream->replaceSubtree(aggregate->url()))
+    closeCacheStream(false);
+
+  selectionInSubTree(aggregate);
+  deletingChildNotify(aggregate);
+  parent->deletingChild(aggregate);
+  discard(aggregate);
+  emit childDeleted();
+
+  publishSubtree(parent, subtree);
+  updateSnapshot();
+}
+
+/**
+ * Traversal that collects the aggregates of a subtree whose content might
+ * still be in a lazily read cache file.
+ **/
+struct KLazyAggregateVisitor : public KTreeVisitor {
+  KDirTree *tree;
+  bool keepShards;
+  std::vector<KDirInfo *> aggregates;
+
+  KLazyAggregateVisitor(KDirTree *tree, bool keepShards)
+      : tree(tree), keepShards(keepShards) {}
+
+  bool enterDir(KDirInfo *dir) {
+    if (!dir->isAggregate())
+      return true;
+
+    if (!keepShards || tree->lazyShardFile(dir->url()).isEmpty())
+      aggregates.push_back(dir);
+
+    return false;
+  }
+};
+
+void KDirTree::readLazySubtrees(bool keepShards) {
+  if (!_lazyCache && _lazyShards.isEmpty())
+    return;
+
+  KLazyAggregateVisitor visitor(this, keepShards);
+  walkTree(_root, visitor);
+
+  while (!visitor.aggregates.empty()) {
+    KDirInfo *aggregate = visitor.aggregates.back();
+    visitor.aggregates.pop_back();
+
+    KDirInfo *dir = readLazyCache(aggregate->url());
+
+    if (dir && dir->isAggregate()) {
+      // Nothing but the totals in the cache file either
+      delete dir;
+      dir = 0;
+    }
+
+    if (!dir) // e.g. collapsed while reading from disk
+      continue;
+
+    replaceAggregate(aggregate, dir);
+
+    // The cache file may have left the next levels unread as well.
+    walkTree(dir, visitor);
+  }
+}
+
+void KDirTree::collapseSubtree(KDirInfo *dir) {
+  if (!dir || dir->isDotEntry() || dir->isAggregate() || !dir->hasChildren())
+    return;
+
+  // qDebug() << "Collapsing " << dir << endl;
+
+  for (size_t i = 0; i < _selection.size(); i++) {
+    if (_selection[i] != dir && _selection[i]->isInSubtree(dir)) {
+      selectItems();
+      break;
+    }
+  }
+
+  emit collapsingSubtree(dir);
+
+  if (_memoryBudget) {
+    // A collapse candidate's memory is known already; anything else needs
+    // to be walked.
+
+    CandidateIterator it = _collapseCandidates.find(dir);
+    quint64 memory;
+
+    if (it != _collapseCandidates.end()) {
+      memory = it.value();
+      _collapseCandidates.erase(it);
+    } else {
+      memory = takeSubtreeMemory(dir);
+    }
+
+    memory -= qMin(memory, itemMemory(dir));
+    _memoryUsed -= qMin(_memoryUsed, memory);
+    it = enclosingCandidate(dir->parent());
+
+    if (it != _collapseCandidates.end())
+      it.value() -= qMin(it.value(), memory);
+  }
+
+  std::vector<KFileInfo *> detached;
+  dir->collapse(detached);
+
+  for (size_t i = 0; i < detached.size(); i++)
+    discard(detached[i]);
+
+  emit childDeleted();
+}
+
+void KDirTree::publishSubtree(KDirInfo *parent, KFileInfo *subtree) {
+  if (!subtree)
+    return;
+
+  // Everything below 'subtree' was built without anybody else seeing it,
+  // so this one insertion makes all of it visible at once.
+
+  if (parent)
+    parent->insertChild(subtree);
+  else
+    setRoot(subtree);
+
+  if (_cacheStream && subtree->isDirInfo() && subtree->isFinished())
+    _cacheStream->addSubtree(static_cast<KDirInfo *>(subtree));
+
+  if (_memoryBudget) {
+    quint64 memory = subtreeMemory(subtree);
+    _memoryUsed += memory;
+
+    CandidateIterator it = enclosingCandidate(parent);
+
+    if (it != _collapseCandidates.end())
+      it.value() += memory;
+  }
+
+  emit childAdded(subtree);
+
+  if (subtree->dotEntry())
+    emit childAdded(subtree->dotEntry());
+}
+
+void KDirTree::slotJobFinished(KDirInfo *dir) {
+  if (!dir || !_memoryBudget)
+    return;
+
+  if (dir->isDotEntry())
+    dir = dir->parent();
+
+  // Finishing 'dir' may have finished some of its parents as well. The
+  // topmost of them replaces all collapse candidates in its subtree; their
+  // memory is merged rather than walked again.
+
+  KDirInfo *finished = 0;
+
+  for (KDirInfo *d = dir; d && d != _root; d = d->parent()) {
+    if (d->isPinned() || d->isBusy())
+      break;
+
+    finished = d;
+  }
+
+  if (finished && finished->hasChildren())
+    _collapseCandidates.insert(finished, takeSubtreeMemory(finished));
+
+  if (_memoryUsed > _memoryBudget)
+    collapseToBudget();
+}
+
+void KDirTree::collapseToBudget() {
+  // Collapse the largest candidates first: That gets back the most memory
+  // for the least detail. Only if that is not enough, collapse even those
+  // that are too large a part of the tree to be left out lightly.
+
+  KFileSize threshold =
+      _root ? _root->totalSize() / 100 * _aggregateThreshold : 0;
+  std::vector<std::pair<quint64, KDirInfo *>> candidates;
+  std::vector<std::pair<quint64, KDirInfo *>> important;
+
+  for (QHash<KDirInfo *, quint64>::const_iterator it =
+           _collapseCandidates.constBegin();
+       it != _collapseCandidates.constEnd(); ++it) {
+    KDirInfo *dir = it.key();
+
+    // Something in there may have been refreshed or expanded meanwhile.
+    if (dir->isBusy() || dir->isPinned())
+      continue;
+
+    if (dir->totalSize() <= threshold)
+      candidates.push_back(std::make_pair(it.value(), dir));
+    else
+      important.push_back(std::make_pair(it.value(), dir));
+  }
+
+  std::sort(candidates.rbegin(), candidates.rend());
+  std::sort(important.rbegin(), important.rend());
+  candidates.insert(candidates.end(), important.begin(), important.end());
+
+  quint64 lowWater = _memoryBudget / 100 * MEMORY_BUDGET_LOW_WATER;
+
+  for (size_t i = 0; i < candidates.size() && _memoryUsed > lowWater; i++)
+    collapseSubtree(candidates[i].second);
+}
+
+/**
+ * One fork of recalcAll(): a subtree that doesn't share any directory
+ * with any other task.
+ **/
+class KRecalcTask : public QRunnable {
+public:
+  KRecalcTask(KDirInfo *dir) : _dir(dir) {}
+
+  void run() override { _dir->recalc(); }
+
+private:
+  KDirInfo *_dir;
+};
+
+void KDirTree::recalcAll() {
+  if (_root && _root->isDirInfo())
+    recalcSubtree(static_cast<KDirInfo *>(_root));
+}
+
+void KDirTree::recalcSubtree(KDirInfo *root) {
+  if (!root || !root->isDirty())
+    return;
+
+  // Other threads are reader threads, usually one of many in a pool
+  // already; more threads on top of them would only get in the way.
+
+  int threads = 1;
+
+  if (QThread::currentThread() == thread())
+    threads = _recalcThreads > 0 ? _recalcThreads
+                                 : QThread::idealThreadCount();
+
+  // Split the dirty part of the tree level by level until there are
+  // enough independent subtrees to keep all threads busy even if they
+  // differ a lot in size. The levels above that are few enough to be done
+  // here afterwards. Everything that is not dirty is left alone.
+
+  size_t wanted = threads > 1 ? (size_t)threads * 16 : 1;
+  std::vector<std::vector<KDirInfo *>> levels(1);
+  levels.back().push_back(root);
+
+  while (levels.back().size() < wanted) {
+    std::vector<KDirInfo *> next;
+
+    for (size_t i = 0; i < levels.back().size(); i++) {
+      KDirInfo *dir = levels.back()[i];
+
+      dir->forEachChild([&next](KFileInfo *child) {
+        if (child->isDirInfo() && static_cast<KDirInfo *>(child)->isDirty())
+          next.push_back(static_cast<KDirInfo *>(child));
+      });
+
+      if (dir->dotEntry() && dir->dotEntry()->isDirty())
+        next.push_back(dir->dotEntry());
+    }
+
+    if (next.empty())
+      break;
+
+    levels.push_back(std::vector<KDirInfo *>());
+    levels.back().swap(next);
+  }
+
+  // Fork: Each subtree of the lowest level in parallel
+
+  std::vector<KDirInfo *> &forks = levels.back();
+
+  if (threads > 1 && forks.size() > 1) {
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+
+    for (size_t i = 0; i < forks.size(); i++)
+      pool.start(new KRecalcTask(forks[i]));
+
+    pool.waitForDone();
+  } else {
+    for (size_t i = 0; i < forks.size(); i++)
+      KRecalcTask(forks[i]).run();
+  }
+
+  // Join: The levels above, bottom-up. Their dirty children are all done
+  // by now, so this only recalculates each of them from its children.
+
+  for (size_t level = levels.size() - 1; level-- > 0;) {
+    for (size_t i = 0; i < levels[level].size(); i++)
+      levels[level][i]->recalc();
+  }
+}
+
+KTreeSnapshot KDirTree::snapshot() {
+  if (_snapshot.isNull() && _root && !_isBusy)
+    _snapshot = KTreeSnapshot::build(_root);
+
+  return _snapshot;
+}
+
+void KDirTree::updateSnapshot() {
+  // Replace each refreshed subtree in the snapshot. Only the paths from
+  // there to the root are copied; everything else is still shared with
+  // older snapshots.
+
+  while (!_snapshotPending.isEmpty()) {
+    QString url = _snapshotPending.takeFirst();
+    KFileInfo *subtree = locate(url);
+    QStringList path;
+
+    if (subtree) {
+      path = KTreeSnapshot::pathOf(subtree, _root);
+    } else {
+      // Gone: Figure out the path from the URL.
+
+      QString rootUrl = _root ? _root->url() : QString();
+
+      if (!url.startsWith(rootUrl))
+        continue;
+
+      path = url.mid(rootUrl.length()).split('/', QString::SkipEmptyParts);
+    }
+
+    _snapshot = _snapshot.withSubtree(path, subtree);
+  }
+}
+
+void KDirTree::beginChangeReport() {
+  _changeBase = snapshot();
+  _changeReportPending = false;
+}
+
+void KDirTree::endChangeReport() {
+  if (_changeBase.isNull())
+    return;
+
+  if (_isBusy) {
+    // Wait for the refreshed subtrees; see slotFinished().
+    _changeReportPending = true;
+    return;
+  }
+
+  reportChanges();
+}
+
+void KDirTree::reportChanges() {
+  QList<KSnapshotChange> changes;
+  KTreeSnapshot::diff(_changeBase, snapshot(), changes);
+
+  _changeBase = KTreeSnapshot();
+  _changeReportPending = false;
+
+  emit changesReported(changes);
+}
+
+void KDirTree::discard(KFileInfo *subtree) {
+  // Nothing here may look at the subtree: Even asking for its totals
+  // might recalculate all of it right before it is thrown away.
+
+  QElapsedTimer timer;
+  timer.start();
+
+  if (_reclaimInBackground)
+    _reclaimer.discard(subtree);
+  else
+    delete subtree;
+
+  int stall = int(timer.elapsed()); // qDebug() prints a qint64 as a size
+
+  if (stall >= DISCARD_STALL_LOG_MS)
+    qDebug() << "Discarding a subtree blocked the GUI for " << stall << " ms"
+             << endl;
+}
+
+quint64 KDirTree::itemMemory(KFileInfo *item) {
+  if (item->isDotEntry())
+    return 0;
+
+  quint64 size = item->isDirInfo() ? sizeof(KDirInfo) : sizeof(KFileInfo);
+
+  return size + item->name().size() * sizeof(QChar) + ITEM_MEMORY_OVERHEAD;
+}
+
+/**
+ * Traversal that sums up the memory used by all items of a subtree. If
+ * there are collapse candidates, those below the top are not walked: Their
+ * memory is taken from there, and they are removed.
+ **/
+struct KMemoryVisitor : public KTreeVisitor {
+  quint64 size;
+  KFileInfo *top;
+  QHash<KDirInfo *, quint64> *candidates;
+
+  KMemoryVisitor(KFileInfo *top, QHash<KDirInfo *, quint64> *candidates = 0)
+      : size(0), top(top), candidates(candidates) {}
+
+  bool enterDir(KDirInfo *dir) {
+    if (candidates && dir != top) {
+      QHash<KDirInfo *, quint64>::iterator it = candidates->find(dir);
+
+      if (it != candidates->end()) {
+        size += it.value();
+        candidates->erase(it);
+        return false;
+      }
+    }
+
+    size += KDirTree::itemMemory(dir);
+    return true;
+  }
+
+  void visitFile(KFileInfo *file) { size += KDirTree::itemMemory(file); }
+};
+
+quint64 KDirTree::subtreeMemory(KFileInfo *subtree) {
+  KMemoryVisitor visitor(subtree);
+  walkTree(subtree, visitor);
+
+  return visitor.size;
+}
+
+quint64 KDirTree::takeSubtreeMemory(KFileInfo *subtree) {
+  // The top is always walked: If it was a candidate, its memory may be
+  // outdated, e.g. because something in it was refreshed.
+
+  if (subtree->isDirInfo())
+    _collapseCandidates.remove(static_cast<KDirInfo *>(subtree));
+
+  KMemoryVisitor visitor(subtree, &_collapseCandidates);
+  walkTree(subtree, visitor);
+
+  return visitor.size;
+}
+
+KDirTree::CandidateIterator KDirTree::enclosingCandidate(KDirInfo *dir) {
+  for (; dir; dir = dir->parent()) {
+    CandidateIterator it = _collapseCandidates.find(dir);
+
+    if (it != _collapseCandidates.end())
+      return it;
+  }
+
+  return _collapseCandidates.end();
+}
+
 void KDirTree::addJob(KDirReadJob *job) { _jobQueue.enqueue(job); }
 
+void KDirTree::addBackgroundJob(KDirReadJob *job) {
+  _jobQueue.enqueueBackground(job);
+}
+
 void KDirTree::sendProgressInfo(const QString &infoLine) {
   emit progressInfo(infoLine);
 }
 
-void KDirTree::sendFinalizeLocal(KDirInfo *dir) { emit finalizeLocal(dir); }
+void KDirTree::sendFinalizeLocal(KDirInfo *dir) {
+  if (_cacheStream && dir)
+    _cacheStream->addDir(dir);
+
+  emit finalizeLocal(dir);
+}
+
+void KDirTree::closeCacheStream(bool complete) {
+  if (!_cacheStream)
+    return;
+
+  if (complete) {
+    QElapsedTimer timer;
+    timer.start();
+
+    if (_cacheStream->close()) {
+      qDebug() << "Finishing cache file " << _streamCacheFile << " took "
+               << timer.elapsed() << " ms" << endl;
+      setCacheFile(_streamCacheFile);
+    }
+  }
+
+  delete _cacheStream; // Discards the file unless it was closed
+  _cacheStream = 0;
+}
+
+void KDirTree::setLazyCache(KBinaryCache *cache) {
+  dropLazyCache();
+  _lazyCache = cache;
+}
+
+void KDirTree::dropLazyCache() {
+  delete _lazyCache;
+  _lazyCache = 0;
+  _lazyCacheStale.clear();
+}
+
+void KDirTree::addLazyShards(const QHash<QString, QString> &lazyShards) {
+  for (QHash<QString, QString>::const_iterator it = lazyShards.begin();
+       it != lazyShards.end(); ++it)
+    _lazyShards.insert(it.key(), it.value());
+}
+
+void KDirTree::cacheFileChanged(KFileInfo *item) {
+  if (_cacheFile.isEmpty())
+    return;
+
+  // A dot entry has the URL of its directory as well.
+
+  if (!item->isDirInfo() && item->parent())
+    item = item->parent();
+
+  _cacheFileChanges.append(item->url());
+}
+
+void KDirTree::dropLazyShards(const QString &url) {
+  if (_lazyShards.isEmpty())
+    return;
+
+  QString prefix = url.endsWith('/') ? url : url + '/';
+  QMutableHashIterator<QString, QString> it(_lazyShards);
+
+  while (it.hasNext()) {
+    it.next();
+
+    if (it.key() == url || it.key().startsWith(prefix))
+      it.remove();
+  }
+}
+
+KDirInfo *KDirTree::readLazyCache(const QString &url) {
+  QString shard = _lazyShards.take(url);
+
+  if (!shard.isEmpty()) {
+    QElapsedTimer timer;
+    timer.start();
+
+    KDirInfo *dir = KCacheReader::readShard(shard, url, this,
+                                            *KExcludeRules::excludeRules());
+
+    if (dir)
+      qDebug() << "Reading " << url << " from " << shard << " took "
+               << timer.elapsed() << " ms" << endl;
+
+    return dir;
+  }
+
+  if (!_lazyCache)
+    return 0;
+
+  for (int i = 0; i < _lazyCacheStale.size(); i++) {
+    const QString &stale = _lazyCacheStale[i];
+
+    if (url == stale ||
+        url.startsWith(stale.endsWith('/') ? stale : stale + '/'))
+      return 0;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+
+  KCacheReader reader(_lazyCache, url, this);
+  reader.setLazyLevels(_lazyCacheLevels);
+  reader.setDetached(false, *KExcludeRules::excludeRules());
+  reader.read(0);
+
+  KDirInfo *dir = reader.ok() ? reader.takeSubtree() : 0;
+
+  if (dir)
+    qDebug() << "Reading " << url << " from " << _lazyCache->fileName()
+             << " took " << timer.elapsed() << " ms" << endl;
+
+  return dir;
+}
 
 void KDirTree::sendStartingReading() { emit startingReading(); }
 
@@ -317,13 +1116,57 @@ void KDirTree::selectItems(const std::vector<KFileInfo *> & newSelection) {
 }
 
 bool KDirTree::writeCache(const QString &cacheFileName) {
-  KCacheWriter writer(cacheFileName, this);
+  // Only what changed since needs to go to the file, unless somebody
+  // else wrote it meanwhile.
+
+  QFileInfo fileInfo(cacheFileName);
+  bool changesKnown = cacheFileName == _cacheFile &&
+                      fileInfo.lastModified() == _cacheFileTime &&
+                      fileInfo.size() == _cacheFileSize &&
+                      _cacheFileShardLevels == _cacheShardLevels;
+
+  // Shards that were left unread are still in the right place if the
+  // file is written in shards of the same depth again.
+
+  if (!changesKnown || !_cacheFileChanges.isEmpty())
+    readLazySubtrees(KCacheWriter::isTextCacheName(cacheFileName) &&
+                     _cacheShardLevels > 0 &&
+                     _cacheShardLevels == _cacheFileShardLevels);
+
+  KCacheWriter writer(cacheFileName, this, _cacheFileChanges, changesKnown,
+                      _cacheShardLevels);
+
+  // Anything that is still being read has to be written again next time.
+
+  if (writer.ok() && !_isBusy)
+    setCacheFile(cacheFileName, writer.shardLevels());
+  else {
+    _cacheFile.clear();
+    _cacheFileChanges.clear();
+  }
+
   return writer.ok();
 }
 
+void KDirTree::setCacheFile(const QString &cacheFileName, int shardLevels) {
+  QFileInfo fileInfo(cacheFileName);
+
+  _cacheFile = cacheFileName;
+  _cacheFileShardLevels = shardLevels;
+  _cacheFileTime = fileInfo.lastModified();
+  _cacheFileSize = fileInfo.size();
+  _cacheFileChanges.clear();
+}
+
 void KDirTree::readCache(const QString &cacheFileName) {
   _isBusy = true;
   emit startingReading();
-  addJob(new KCacheReadJob(this, 0, cacheFileName));
+
+  KCacheReadJob *job = new KCacheReadJob(this, 0, cacheFileName);
+
+  if (job->reader())
+    job->reader()->setLazyLevels(_lazyCacheLevels);
+
+  addJob(job);
 }
 
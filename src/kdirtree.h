@@ -8,6 +8,10 @@
 
 #include "kdirinfo.h"
 #include "kdirreadjob.h"
+#include "kreclaimer.h"
+#include "ktreesnapshot.h"
+#include <QDateTime>
+#include <QHash>
 #include <dirent.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -24,6 +28,8 @@
 namespace KDirStat {
 // Forward declarations
 class KDirReadJob;
+class KBinaryCache;
+class KCacheStreamWriter;
 
 /**
  * Directory read methods.
@@ -106,6 +112,18 @@ public slots:
    **/
   void deleteSubtree(KFileInfo *subtree);
 
+  /**
+   * Read the content of an aggregate (see @ref KFileInfo::isAggregate())
+   * again. The aggregate is replaced by a new subtree which is pinned so
+   * it will not be collapsed again. Returns the new subtree root or 0 if
+   * that failed.
+   *
+   * If the aggregate was left unread when reading a cache file (see
+   * "LazyCacheLevels"), its content is taken from that file right away;
+   * otherwise, it is read from disk.
+   **/
+  KFileInfo *expandAggregate(KFileInfo *aggregate);
+
 public:
   /**
    * Returns the root item of this tree.
@@ -132,16 +150,13 @@ public:
    * Locate a child somewhere in the tree whose URL (i.e. complete path)
    * matches the URL passed. Returns 0 if there is no such child.
    *
-   * Notice: This is a very expensive operation since the entire tree is
-   * searched recursively.
-   *
    * 'findDotEntries' specifies if locating "dot entries" (".../<Files>")
    * is desired.
    *
    * This is just a convenience method that maps to
    *    KDirTree::root()->locate( url, findDotEntries )
    **/
-  KFileInfo *locate(QString url, bool findDotEntries = false) {
+  KFileInfo *locate(const QString &url, bool findDotEntries = false) {
     return _root ? _root->locate(url, findDotEntries) : 0;
   }
 
@@ -159,6 +174,19 @@ public:
    **/
   void addJob(KDirReadJob *job);
 
+  /**
+   * Add a read job that does its work in another thread, see @ref
+   * KDirReadJobQueue::enqueueBackground().
+   **/
+  void addBackgroundJob(KDirReadJob *job);
+
+  /**
+   * Returns 'true' if a cache file with modification time 'mtime' that was
+   * found in directory 'dir' may be used instead of reading 'dir'. See the
+   * "NestedCacheMaxAge" and "NestedCacheCheckDirMtime" settings.
+   **/
+  bool isNestedCacheFresh(KDirInfo *dir, time_t mtime) const;
+
   /**
    * Obtain the directory read method for this tree:
    *    KDirReadLocal		use opendir() and lstat()
@@ -246,6 +274,119 @@ public:
    **/
   void sendAborted();
 
+  /**
+   * Collapse a finished subtree into an aggregate (see @ref
+   * KDirInfo::collapse()), notifying all views about the deleted
+   * children.
+   **/
+  void collapseSubtree(KDirInfo *dir);
+
+  /**
+   * Insert a complete subtree that was built elsewhere, e.g. by a
+   * background reader, below 'parent' and notify all views. The summary
+   * fields of 'parent' and all its ancestors are updated with the
+   * subtree's totals.
+   *
+   * This is how other threads contribute to the tree: They build a
+   * subtree privately, i.e. nobody else may know about any of its items,
+   * and it must already be finalized. Only the thread that owns this tree
+   * (the GUI thread) publishes it with this single insertion. Nothing else
+   * of the tree may be touched by other threads, not even for reading.
+   *
+   * If 'parent' is 0, 'subtree' replaces the complete tree.
+   *
+   * While a cache file is written during reading, a subtree that is
+   * already finished goes to the cache file as a whole; any other
+   * directory is written once it is finalized.
+   **/
+  void publishSubtree(KDirInfo *parent, KFileInfo *subtree);
+
+  /**
+   * Keep binary cache file 'cache' to read the directories that were left
+   * unread in it (see @ref KCacheReader::setLazyLevels()) once they are
+   * expanded. The tree takes over ownership. The cache is dropped as soon
+   * as the tree gets a new root.
+   **/
+  void setLazyCache(KBinaryCache *cache);
+
+  /**
+   * Read the directories that were left unread when reading a cache file
+   * in shards (see @ref KCacheReader::takeLazyShards()) from their shard
+   * files once they are expanded. They are forgotten as soon as the tree
+   * gets a new root.
+   **/
+  void addLazyShards(const QHash<QString, QString> &lazyShards);
+
+  /**
+   * Returns the shard file of directory 'url' if it was left unread (see
+   * @ref addLazyShards()) or an empty string.
+   **/
+  QString lazyShardFile(const QString &url) const {
+    return _lazyShards.value(url);
+  }
+
+  /**
+   * Returns the approximate amount of memory used by the items of this
+   * tree in bytes. This is only kept track of while a memory budget is
+   * set.
+   **/
+  quint64 memoryUsed() const { return _memoryUsed; }
+
+  /**
+   * Returns the approximate amount of memory used by 'item' itself.
+   **/
+  static quint64 itemMemory(KFileInfo *item);
+
+  /**
+   * Returns the approximate amount of memory used by 'subtree'
+   * including all its children.
+   **/
+  static quint64 subtreeMemory(KFileInfo *subtree);
+
+  /**
+   * Recalculate the summary fields of all dirty directories of the tree
+   * (see @ref KDirInfo::markAsDirty()) in one bottom-up pass. Independent
+   * subtrees are recalculated in parallel; the number of threads is
+   * configurable ("RecalcThreads"). Directories that are up to date are
+   * not even looked at.
+   *
+   * This blocks until everything is done. Nobody else may access the
+   * tree meanwhile.
+   **/
+  void recalcAll();
+
+  /**
+   * Like @ref recalcAll(), but only for 'subtree'. This may also be called
+   * from another thread for a subtree that is not part of this tree (yet);
+   * then it doesn't start any threads of its own.
+   **/
+  void recalcSubtree(KDirInfo *subtree);
+
+  /**
+   * Returns a snapshot of the current state of the tree. Once there is
+   * one, this is constant time: The tree keeps it up to date when
+   * subtrees are deleted or refreshed, copying only the paths to the
+   * changes (see @ref KTreeSnapshot). Compare two snapshots with
+   * @ref KTreeSnapshot::diff() to see what a cleanup action changed.
+   *
+   * Returns an empty snapshot while the tree is still being read.
+   **/
+  KTreeSnapshot snapshot();
+
+  /**
+   * Remember the current state of the tree to report what changes from
+   * now on, e.g. by a cleanup action. See @ref endChangeReport().
+   **/
+  void beginChangeReport();
+
+  /**
+   * Report what changed since @ref beginChangeReport() with the
+   * @ref changesReported() signal. If subtrees are being read again, this
+   * waits until they are done. Nothing is reported if the tree was still
+   * being read at @ref beginChangeReport() or if it is cleared meanwhile.
+   **/
+  void endChangeReport();
+
   /**
    * Returns 'true' if this tree uses the 'file:/' protocol (regardless
    * of local or network transparent directory reader).
@@ -260,10 +401,31 @@ public:
   /**
    * Write the complete tree to a cache file.
    *
+   * If the tree was read from or written to the same text cache file
+   * before and the file was not changed meanwhile, only the subtrees that
+   * were refreshed or deleted since are added to it (see @ref
+   * KCacheWriter::spliceCache()). If there are none, the file is left as
+   * it is.
+   *
+   * With "CacheShardLevels" set, a text cache file is written in shards
+   * (see @ref KCacheWriter::writeShards()); then only the shards of those
+   * subtrees are written again.
+   *
+   * Subtrees that were left unread when reading a cache file are read
+   * from there first, so the new file has all of the tree.
+   *
    * Returns true if OK, false upon error.
    **/
   bool writeCache(const QString &cacheFileName);
 
+  /**
+   * Remember that cache file 'cacheFileName' has the content of the
+   * complete tree as it is right now, so later changes can be added to
+   * it by @ref writeCache(). 'shardLevels' is what it was written with
+   * (see @ref KCacheWriter::shardLevels()).
+   **/
+  void setCacheFile(const QString &cacheFileName, int shardLevels = 0);
+
   /**
    * Read a cache file.
    **/
@@ -281,6 +443,12 @@ signals:
    **/
   void deletingChild(KFileInfo *deletedChild);
 
+  /**
+   * Emitted when all children of 'subtree' are about to be discarded to
+   * save memory. 'subtree' itself remains as an aggregate.
+   **/
+  void collapsingSubtree(KFileInfo *subtree);
+
   /**
    * Emitted after a child is deleted. If you are interested which child
    * it was, better use the @ref deletingChild() signal.
@@ -305,6 +473,13 @@ signals:
    **/
   void aborted();
 
+  /**
+   * Emitted by @ref endChangeReport() with the changes since
+   * @ref beginChangeReport(). Added and removed subtrees are reported
+   * only once at their top.
+   **/
+  void changesReported(const QList<KSnapshotChange> &changes);
+
   /**
    * Emitted when reading a directory is finished.
    * This does _not_ mean reading all subdirectories is finished, too -
@@ -347,7 +522,106 @@ protected slots:
    **/
   void slotFinished();
 
+  /**
+   * Notification that a read job for 'dir' is finished. While a memory
+   * budget is set, the largest finished subtree around 'dir' becomes a
+   * collapse candidate, and if the budget is exceeded, @ref
+   * collapseToBudget() makes room.
+   **/
+  void slotJobFinished(KDirInfo *dir);
+
 protected:
+  /**
+   * Get rid of 'subtree' which must already be completely detached from
+   * this tree, with all views notified. Unless "ReclaimInBackground" is
+   * switched off, the actual deletion happens in the reclaimer thread.
+   **/
+  void discard(KFileInfo *subtree);
+
+  /**
+   * Update the snapshot with all subtrees that were refreshed meanwhile.
+   **/
+  void updateSnapshot();
+
+  /**
+   * Emit @ref changesReported() for what changed since
+   * @ref beginChangeReport().
+   **/
+  void reportChanges();
+
+  /**
+   * Stop writing the cache file that is written while reading (see
+   * "StreamCacheFile"). Unless 'complete' is 'true', the file is
+   * discarded.
+   **/
+  void closeCacheStream(bool complete);
+
+  /**
+   * Read the subtree of directory 'url' from the lazy cache (see @ref
+   * setLazyCache()) into a new subtree nobody else can see yet. Returns 0
+   * if it is not in there or if that part of the cache is outdated.
+   **/
+  KDirInfo *readLazyCache(const QString &url);
+
+  /**
+   * Replace 'aggregate' with 'subtree', its content as read by @ref
+   * readLazyCache().
+   **/
+  void replaceAggregate(KFileInfo *aggregate, KDirInfo *subtree);
+
+  /**
+   * Read everything that was left unread when reading a cache file (see
+   * "LazyCacheLevels" and @ref addLazyShards()): A cache file written now
+   * would only get the totals of those subtrees. With 'keepShards', the
+   * subtrees that are still in their shard files are left alone; the cache
+   * writer copies those files.
+   **/
+  void readLazySubtrees(bool keepShards);
+
+  /**
+   * Forget about the unread shards (see @ref addLazyShards()) at or below
+   * 'url', e.g. because that subtree is read from disk again.
+   **/
+  void dropLazyShards(const QString &url);
+
+  /**
+   * Remember that 'item' is about to change, so its lines in the cache
+   * file the tree was read from or written to are out of date. For
+   * anything but a directory, those are the lines of its parent.
+   **/
+  void cacheFileChanged(KFileInfo *item);
+
+  /**
+   * Drop the lazy cache (see @ref setLazyCache()).
+   **/
+  void dropLazyCache();
+
+  /**
+   * Collapse the collapse candidates with the most memory until the memory
+   * used is well below the budget again. Collapse candidates are the
+   * largest finished subtrees (see @ref slotJobFinished()); none of them
+   * is inside another. Those that are less than "AggregateThreshold"
+   * percent of the tree's total size go first.
+   **/
+  void collapseToBudget();
+
+  /**
+   * Returns the approximate amount of memory used by 'subtree' like @ref
+   * subtreeMemory(), but the memory of collapse candidates in it is taken
+   * over instead of walking them again. None of them is a candidate
+   * afterwards.
+   **/
+  quint64 takeSubtreeMemory(KFileInfo *subtree);
+
+  typedef QHash<KDirInfo *, quint64>::iterator CandidateIterator;
+
+  /**
+   * Returns the collapse candidate that 'dir' is in or the end of
+   * _collapseCandidates if there is none.
+   **/
+  CandidateIterator enclosingCandidate(KDirInfo *dir);
+
+
   KFileInfo *_root;
   std::vector<KFileInfo *> _selection;
   KDirReadJobQueue _jobQueue;
@@ -356,6 +630,31 @@ protected:
   bool _enableLocalDirReader;
   bool _isFileProtocol;
   bool _isBusy;
+  quint64 _memoryBudget;
+  int _aggregateThreshold;
+  int _recalcThreads;
+  quint64 _memoryUsed;
+  bool _reclaimInBackground;
+  QHash<KDirInfo *, quint64> _collapseCandidates; // memory of each, disjoint
+  KSubtreeReclaimer _reclaimer;
+  KTreeSnapshot _snapshot;
+  QStringList _snapshotPending; // URLs of refreshed subtrees
+  KTreeSnapshot _changeBase;    // see beginChangeReport()
+  bool _changeReportPending;
+  QString _streamCacheFile;
+  KCacheStreamWriter *_cacheStream; // 0 unless writing while reading
+  int _lazyCacheLevels;
+  int _nestedCacheMaxAge;           // in hours, see readConfig()
+  bool _nestedCacheCheckDirMtime;
+  KBinaryCache *_lazyCache;         // 0 unless a cache was read lazily
+  QStringList _lazyCacheStale;      // URLs of subtrees refreshed since
+  QHash<QString, QString> _lazyShards; // see addLazyShards()
+  int _cacheShardLevels;
+  QString _cacheFile;               // see setCacheFile()
+  QDateTime _cacheFileTime;         // its mtime back then
+  qint64 _cacheFileSize;
+  QStringList _cacheFileChanges;    // URLs of subtrees changed since
+  int _cacheFileShardLevels;
 
 }; // class KDirTree
 
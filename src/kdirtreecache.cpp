@@ -8,70 +8,450 @@
 #include "kdirtree.h"
 #include "kdirtreecache.h"
 #include "kexcluderules.h"
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QDir>
+#include <QFile>
 #include <QFileInfo>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
 #include <ctype.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define KB 1024
 #define MB (1024 * 1024)
 #define GB (1024 * 1024 * 1024)
 
+// Initial size of the buffer for decompressed data. It grows if there is a
+// longer line.
+#define CACHE_BLOCK_SIZE (256 * 1024)
+
+// Amount of data decompressed at first, enough for the header and the first
+// directory, so checking a cache file with firstDir() is cheap.
+#define CACHE_HEADER_READ_SIZE 4096
+
+// Amount of text in each gzip member of a cache file. Every member is
+// compressed and decompressed by a thread of its own.
+#define CACHE_MEMBER_SIZE (4 * MB)
+
+// Write a text cache file completely again rather than adding changed
+// subtrees to it once about this much of it (in percent) is replaced.
+#define CACHE_COMPACTION_PERCENT 50
+
+// Shard files of a text cache file go to a directory named like it plus
+// this (see KCacheWriter::writeShards()).
+#define CACHE_SHARD_DIR_SUFFIX ".shards"
+#define CACHE_SHARD_SUFFIX ".cache.gz"
+
+// First line of the text cache files written here
+#define CACHE_HEADER "[kdirstat " CACHE_VERSION " cache file]\n"
+
 using namespace KDirStat;
 
-KCacheWriter::KCacheWriter(const QString &fileName, KDirTree *tree) {
-  _ok = writeCache(fileName, tree);
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+/**
+ * Decode %XX escapes in 'str' in place and return the new length. The
+ * result is never longer than the original.
+ **/
+static int decodePercent(char *str) {
+  char *in = strchr(str, '%');
+
+  if (!in)
+    return strlen(str);
+
+  char *out = in;
+
+  while (*in) {
+    int high, low;
+
+    if (in[0] == '%' && (high = hexValue(in[1])) >= 0 &&
+        (low = hexValue(in[2])) >= 0) {
+      *out++ = (char)(high * 16 + low);
+      in += 3;
+    } else
+      *out++ = *in++;
+  }
+
+  *out = 0;
+
+  return out - str;
+}
+
+/**
+ * Split the (decoded) path 'path' of length 'len' into the directory part
+ * and the last component, like QFileInfo::dir().path() and fileName() do,
+ * but without any of the overhead.
+ **/
+static void splitPath(const char *path, int len, QString &dirPath,
+                      QString &name) {
+  int slash = len - 1;
+
+  while (slash >= 0 && path[slash] != '/')
+    slash--;
+
+  if (slash < 0) {
+    dirPath = ".";
+    name = QString::fromUtf8(path, len);
+  } else {
+    dirPath = slash == 0 ? QString("/") : QString::fromUtf8(path, slash);
+    name = QString::fromUtf8(path + slash + 1, len - slash - 1);
+  }
+}
+
+KCacheWriter::KCacheWriter(const QString &fileName, KDirTree *tree,
+                           const QStringList &changedUrls, bool changesKnown,
+                           int shardLevels)
+    : _shardLevels(0), _tree(0), _changesKnown(false) {
+  if (changesKnown && changedUrls.isEmpty()) {
+    // Nothing to do: The file has all of it already.
+
+    _shardLevels = isTextCacheName(fileName) ? shardLevels : 0;
+    _ok = true;
+    return;
+  }
+
+  if (isTextCacheName(fileName) && shardLevels > 0) {
+    _ok = writeShards(fileName, tree, changedUrls, changesKnown, shardLevels);
+    return;
+  }
+
+  if (isTextCacheName(fileName) && changesKnown &&
+      spliceCache(fileName, tree, changedUrls)) {
+    _ok = true;
+    return;
+  }
+
+  if (isTextCacheName(fileName))
+    _ok = writeCache(fileName, tree);
+  else
+    _ok = tree && KBinaryCacheWriter::write(fileName, tree->root());
 }
 
 KCacheWriter::~KCacheWriter() {
   // NOP
 }
 
+bool KCacheWriter::isTextCacheName(const QString &fileName) {
+  return fileName.endsWith(".gz");
+}
+
 bool KCacheWriter::writeCache(const QString &fileName, KDirTree *tree) {
   if (!tree || !tree->root())
     return false;
 
-  gzFile cache = gzopen(fileName.toLocal8Bit(), "w");
+  // Shards of the same name would only be in the way once this file is
+  // written in shards again.
+
+  removeShards(fileName);
 
-  if (cache == 0) {
-    qCritical() << "Can't open " << fileName << ": " << strerror(errno) << endl;
+  return writeFile(fileName, tree->root(), 0);
+}
+
+bool KCacheWriter::writeFile(const QString &fileName, KFileInfo *item,
+                             int shardLevels) {
+  KGzipMemberWriter cache;
+
+  if (!cache.open(fileName))
+    return false;
+
+  QByteArray buffer;
+  buffer += CACHE_HEADER;
+  buffer += "# Do not edit!\n"
+            "#\n"
+            "# Type\tpath\t\tsize\tmtime\t\t<optional fields>\n"
+            "\n";
+
+  writeTree(cache, buffer, item, shardLevels);
+  cache.write(buffer);
+
+  return cache.close();
+}
+
+bool KCacheWriter::writeShards(const QString &fileName, KDirTree *tree,
+                               const QStringList &changedUrls,
+                               bool changesKnown, int shardLevels) {
+  if (!tree || !tree->root())
+    return false;
+
+  QString shardDir = fileName + CACHE_SHARD_DIR_SUFFIX;
+
+  if (!QDir().mkpath(shardDir)) {
+    qCritical() << "Can't create " << shardDir << endl;
     return false;
   }
 
-  // FIXME !!! XXX
-  const char *version = "4.0";
+  _ok = true;
+  _shardLevels = shardLevels;
+  _fileName = fileName;
+  _tree = tree;
+  _changedUrls = changedUrls;
+  _changesKnown = changesKnown;
+  _shardNames.clear();
+
+  // Each shard is written when the manifest gets to its directory.
 
-  gzprintf(cache, "[kdirstat %s cache file]\n", version);
-  gzprintf(cache, "# Do not edit!\n"
-                  "#\n"
-                  "# Type\tpath\t\tsize\tmtime\t\t<optional fields>\n"
-                  "\n");
+  if (!writeFile(fileName, tree->root(), shardLevels))
+    _ok = false;
 
-  writeTree(cache, tree->root());
-  gzclose(cache);
+  if (_ok)
+    removeShards(fileName, _shardNames);
 
-  return true;
+  return _ok;
 }
 
-void KCacheWriter::writeTree(gzFile cache, KFileInfo *item) {
-  if (!item)
+QString KCacheWriter::shardPath(const QString &fileName, const QString &name) {
+  return fileName + CACHE_SHARD_DIR_SUFFIX + "/" + name;
+}
+
+void KCacheWriter::writeShard(QByteArray &buffer, KDirInfo *dir,
+                              const QString &url) {
+  // The name only depends on the URL, so the shard of a directory stays
+  // the same file from one write to the next.
+
+  QString name = QString::fromLatin1(
+      QCryptographicHash::hash(url.toUtf8(), QCryptographicHash::Sha1)
+          .toHex()) + CACHE_SHARD_SUFFIX;
+  QString fileName = shardPath(_fileName, name);
+  QString lazyShard = _tree->lazyShardFile(url);
+  bool changed = !_changesKnown;
+  _shardNames.insert(name);
+
+  for (int i = 0; i < _changedUrls.size() && !changed; i++) {
+    const QString &changedUrl = _changedUrls[i];
+
+    changed = url == changedUrl ||
+              url.startsWith(changedUrl.endsWith('/') ? changedUrl
+                                                      : changedUrl + '/') ||
+              changedUrl.startsWith(url + '/');
+  }
+
+  if (dir->isAggregate() && !lazyShard.isEmpty()) {
+    // Never read: Its shard file is all there is to it.
+
+    if (lazyShard != fileName) {
+      QFile::remove(fileName);
+
+      if (!QFile::copy(lazyShard, fileName)) {
+        qCritical() << "Can't copy " << lazyShard << " to " << fileName
+                    << endl;
+        _ok = false;
+      }
+    }
+  } else if (changed || !QFile::exists(fileName)) {
+    if (!writeFile(fileName, dir, 0))
+      _ok = false;
+  }
+
+  // The line of the directory with the name of its shard file and the
+  // totals, so readers can leave the shard unread.
+
+  writeItem(buffer, dir, url);
+  buffer.chop(1); // newline
+
+  buffer += "\tshard: ";
+  buffer += name.toLatin1();
+
+  if (!dir->isAggregate()) // writeItem() did that already
+    writeTotals(buffer, dir);
+
+  buffer += '\n';
+}
+
+void KCacheWriter::removeShards(const QString &fileName,
+                                const QSet<QString> &keep) {
+  QDir shardDir(fileName + CACHE_SHARD_DIR_SUFFIX);
+
+  if (!shardDir.exists())
     return;
 
-  // Write entry for this item
-  if (!item->isDotEntry())
-    writeItem(cache, item);
+  QStringList names = shardDir.entryList(
+      QStringList() << QString("*") + CACHE_SHARD_SUFFIX, QDir::Files);
 
-  // Write file children
-  if (item->dotEntry())
-    writeTree(cache, item->dotEntry());
+  for (int i = 0; i < names.size(); i++) {
+    if (!keep.contains(names[i]))
+      shardDir.remove(names[i]);
+  }
 
-  // Recurse through subdirectories
-  for(size_t i = 0; i < item->numChildren(); i++)
-    writeTree(cache, item->child(i));
+  if (keep.isEmpty())
+    QDir().rmdir(shardDir.path()); // only if nothing else is in there
 }
 
-void KCacheWriter::writeItem(gzFile cache, KFileInfo *item) {
+bool KCacheWriter::spliceCache(const QString &fileName, KDirTree *tree,
+                               const QStringList &changedUrls) {
+  if (!tree || !tree->root())
+    return false;
+
+  // Readers of older versions would not know about the replaced subtrees,
+  // so only add them to a file of the current version.
+
+  gzFile file = gzopen(QFile::encodeName(fileName).constData(), "rb");
+  char header[sizeof(CACHE_HEADER)] = "";
+  bool current = file && gzgets(file, header, sizeof(header)) &&
+                 strcmp(header, CACHE_HEADER) == 0;
+
+  if (file)
+    gzclose(file);
+
+  if (!current)
+    return false;
+
+  KGzipMemberReader members;
+
+  if (!members.open(fileName))
+    return false;
+
+  // The members from the first replacing one on are about as large as
+  // the lines they replaced.
+
+  qint64 fileSize = 0;
+  qint64 replacedSize = 0;
+
+  for (int i = 0; i < members.members().size(); i++) {
+    const KGzipMember &member = members.members()[i];
+    fileSize += member.size;
+
+    if (replacedSize > 0 || !member.replaces.isEmpty())
+      replacedSize += member.size;
+  }
+
+  members.close();
+
+  if (replacedSize * 100 > fileSize * CACHE_COMPACTION_PERCENT)
+    return false; // Time to get rid of the replaced lines
+
+  // Only the outermost subtrees: Everything below them goes with them.
+  // After sorting, a directory comes before everything below it.
+
+  QString rootUrl = tree->root()->url();
+  QStringList urls = changedUrls;
+  QStringList subtrees;
+  urls.sort();
+
+  for (int i = 0; i < urls.size(); i++) {
+    const QString &url = urls[i];
+    KFileInfo *item = tree->locate(url);
+
+    // These are all directories (see KDirTree::cacheFileChanged()), but
+    // one may have become a file since. Its line belongs to the parent
+    // directory.
+
+    if (url == rootUrl || (item && !item->isDirInfo()))
+      return false;
+
+    bool covered = false;
+
+    for (int j = 0; j < subtrees.size() && !covered; j++)
+      covered = url.startsWith(subtrees[j].endsWith('/') ? subtrees[j]
+                                                         : subtrees[j] + '/');
+
+    if (!covered)
+      subtrees.append(url);
+  }
+
+  KGzipMemberWriter cache;
+
+  if (!cache.open(fileName, true))
+    return false;
+
+  for (int i = 0; i < subtrees.size(); i++) {
+    const QString &url = subtrees[i];
+    cache.write("# Replaces " + QUrl::toPercentEncoding(url, "/") + "\n",
+                url.toUtf8());
+
+    KFileInfo *item = tree->locate(url);
+
+    if (item) {
+      QByteArray buffer;
+      writeTree(cache, buffer, item);
+      cache.write(buffer);
+    }
+  }
+
+  return cache.close();
+}
+
+/**
+ * Pre-order traversal that writes each item: A directory line is followed
+ * by its file children (from the dot entry), then by its subdirectories.
+ * 'urls' keeps track of the URL of the item being written so it doesn't
+ * have to be built from scratch for every directory.
+ *
+ * A new gzip member is only ever started with a directory line: Its path
+ * is absolute, so a member can be parsed without any of the ones before
+ * it.
+ **/
+struct KCacheWriter::WriteVisitor : public KTreeVisitor {
+  KCacheWriter *writer;
+  KGzipMemberWriter &cache;
+  QByteArray &buffer;
+  KUrlStack urls;
+  int shardLevels;
+  int level; // of the next directory below the current one
+
+  WriteVisitor(KCacheWriter *writer, KGzipMemberWriter &cache,
+               QByteArray &buffer, KFileInfo *top, int shardLevels)
+      : writer(writer), cache(cache), buffer(buffer), urls(top->parent()),
+        shardLevels(shardLevels), level(0) {}
+
+  bool enterDir(KDirInfo *dir) {
+    urls.push(dir);
+
+    if (!dir->isDotEntry()) {
+      if (buffer.size() >= CACHE_MEMBER_SIZE) {
+        cache.write(buffer);
+        buffer.clear();
+      }
+
+      if (shardLevels > 0 && level == shardLevels && !dir->isExcluded() &&
+          dir->totalItems() > 0) {
+        writer->writeShard(buffer, dir, urls.url());
+        urls.pop();
+        return false; // Everything below is in the shard.
+      }
+
+      writer->writeItem(buffer, dir, urls.url());
+      level++;
+    }
+
+    return true;
+  }
+
+  void leaveDir(KDirInfo *dir) {
+    urls.pop();
+
+    if (!dir->isDotEntry())
+      level--;
+  }
+
+  void visitFile(KFileInfo *file) {
+    writer->writeItem(buffer, file, QString());
+  }
+};
+
+void KCacheWriter::writeTree(KGzipMemberWriter &cache, QByteArray &buffer,
+                             KFileInfo *item, int shardLevels) {
+  WriteVisitor visitor(this, cache, buffer, item, shardLevels);
+  walkTree(item, visitor);
+}
+
+void KCacheWriter::writeItem(QByteArray &buffer, KFileInfo *item,
+                             const QString &url) {
   if (!item)
     return;
 
@@ -93,38 +473,61 @@ void KCacheWriter::writeItem(gzFile cache, KFileInfo *item) {
   else if (item->isSocket())
     file_type = "Socket";
 
-  gzprintf(cache, "%s", file_type);
+  buffer += file_type;
 
   // Write name
 
   if (item->isDirInfo() && !item->isDotEntry()) {
     // Use absolute path
 
-    gzprintf(cache, " %s",
-             QUrl::toPercentEncoding(item->url(), "/").constData());
+    buffer += ' ';
+    buffer += QUrl::toPercentEncoding(url, "/");
   } else {
     // Use relative path
 
-    gzprintf(cache, "\t%s", QUrl::toPercentEncoding(item->name()).constData());
+    buffer += '\t';
+    buffer += QUrl::toPercentEncoding(item->name());
   }
 
   // Write size
 
-  gzprintf(cache, "\t%s", formatSize(item->size()).toLocal8Bit().constData());
+  buffer += '\t';
+  buffer += formatSize(item->size()).toLatin1();
 
   // Write mtime
 
-  gzprintf(cache, "\t0x%lx", (unsigned long)item->mtime());
+  buffer += "\t0x";
+  buffer += QByteArray::number((qulonglong)item->mtime(), 16);
 
   // Optional fields
 
-  if (item->isSparseFile())
-    gzprintf(cache, "\tblocks: %lld", item->blocks());
+  if (item->isSparseFile()) {
+    buffer += "\tblocks: ";
+    buffer += QByteArray::number(item->blocks());
+  }
+
+  if (item->isFile() && item->links() > 1) {
+    buffer += "\tlinks: ";
+    buffer += QByteArray::number((uint)item->links());
+  }
 
-  if (item->isFile() && item->links() > 1)
-    gzprintf(cache, "\tlinks: %u", (unsigned)item->links());
+  // There are no lines for the content of an aggregate, so its totals
+  // are all that is left of it.
 
-  gzputc(cache, '\n');
+  if (item->isAggregate())
+    writeTotals(buffer, item);
+
+  buffer += '\n';
+}
+
+void KCacheWriter::writeTotals(QByteArray &buffer, KFileInfo *dir) {
+  buffer += "\ttotals: ";
+  buffer += QByteArray::number(dir->totalSize()) + ',' +
+            QByteArray::number(dir->totalBlocks()) + ',' +
+            QByteArray::number(dir->totalItems()) + ',' +
+            QByteArray::number(dir->totalSubDirs()) + ',' +
+            QByteArray::number(dir->totalFiles()) + ",0x" +
+            QByteArray::number((qulonglong)dir->latestMtime(), 16);
 }
 
 QString KCacheWriter::formatSize(KFileSize size) {
@@ -149,73 +552,607 @@ QString KCacheWriter::formatSize(KFileSize size) {
   return str;
 }
 
+KCacheStreamWriter::KCacheStreamWriter(const QString &toplevelUrl)
+    : _toplevelUrl(toplevelUrl), _headerSize(0), _haveToplevel(false),
+      _open(false) {}
+
+KCacheStreamWriter::~KCacheStreamWriter() {
+  if (_open) {
+    _cache.close();
+    unlink(QFile::encodeName(_fileName + ".new").constData());
+  }
+}
+
+bool KCacheStreamWriter::open(const QString &fileName) {
+  _fileName = fileName;
+  _open = _cache.open(fileName + ".new");
+
+  if (!_open)
+    return false;
+
+  _buffer = CACHE_HEADER
+            "# Do not edit!\n"
+            "#\n"
+            "# Directories may come before their parent directory.\n"
+            "#\n"
+            "# Type\tpath\t\tsize\tmtime\t\t<optional fields>\n"
+            "\n";
+  _headerSize = _buffer.size();
+
+  return true;
+}
+
+void KCacheStreamWriter::addDir(KDirInfo *dir) {
+  if (dir && !dir->isDotEntry())
+    add(dir, dir->url());
+}
+
+/**
+ * Pre-order traversal that adds every directory of a subtree.
+ **/
+struct KCacheStreamWriter::AddVisitor : public KTreeVisitor {
+  KCacheStreamWriter *writer;
+  KUrlStack urls;
+
+  AddVisitor(KCacheStreamWriter *writer, KDirInfo *subtree)
+      : writer(writer), urls(subtree->parent()) {}
+
+  bool enterDir(KDirInfo *dir) {
+    urls.push(dir);
+
+    if (!dir->isDotEntry())
+      writer->add(dir, urls.url());
+
+    return true;
+  }
+
+  void leaveDir(KDirInfo *) { urls.pop(); }
+};
+
+void KCacheStreamWriter::addSubtree(KDirInfo *subtree) {
+  if (!subtree)
+    return;
+
+  AddVisitor visitor(this, subtree);
+  walkTree(subtree, visitor);
+}
+
+void KCacheStreamWriter::add(KDirInfo *dir, const QString &url) {
+  if (!_open)
+    return;
+
+  QByteArray lines;
+  KCacheWriter::writeItem(lines, dir, url);
+
+  auto addFile = [&lines](KFileInfo *child) {
+    if (!child->isDirInfo())
+      KCacheWriter::writeItem(lines, child, QString());
+  };
+
+  if (dir->dotEntry())
+    dir->dotEntry()->forEachChild(addFile);
+
+  dir->forEachChild(addFile);
+
+  if (url == _toplevelUrl) {
+    // A reader takes the first directory as the toplevel, so it goes
+    // right after the header. Nothing is handed over to _cache before.
+
+    _buffer.insert(_headerSize, lines);
+    _haveToplevel = true;
+  } else
+    _buffer += lines;
+
+  if (_haveToplevel && _buffer.size() >= CACHE_MEMBER_SIZE) {
+    _cache.write(_buffer);
+    _buffer.clear();
+  }
+}
+
+bool KCacheStreamWriter::replaceSubtree(const QString &url) {
+  // Until the toplevel directory is there, nothing can go to _cache.
+
+  if (!_open || !_haveToplevel || url == _toplevelUrl)
+    return false;
+
+  // Lines of the old subtree may still be in the buffer, so they go to a
+  // member before the replacing one.
+
+  if (!_buffer.isEmpty()) {
+    _cache.write(_buffer);
+    _buffer.clear();
+  }
+
+  _cache.write("# Replaces " + QUrl::toPercentEncoding(url, "/") + "\n",
+               url.toUtf8());
+
+  return true;
+}
+
+bool KCacheStreamWriter::close() {
+  if (!_open)
+    return false;
+
+  _open = false;
+  QByteArray newName = QFile::encodeName(_fileName + ".new");
+
+  if (!_haveToplevel) {
+    qCritical() << "No toplevel directory for " << _fileName << endl;
+    _cache.close();
+    unlink(newName.constData());
+    return false;
+  }
+
+  _cache.write(_buffer);
+  _buffer.clear();
+
+  bool ok = _cache.close() &&
+            rename(newName.constData(),
+                   QFile::encodeName(_fileName).constData()) == 0;
+
+  if (!ok) {
+    qCritical() << "Error writing " << _fileName << ": " << strerror(errno)
+                << endl;
+    unlink(newName.constData());
+  }
+
+  return ok;
+}
+
 KCacheReader::KCacheReader(const QString &fileName, KDirTree *tree,
                            KDirInfo *parent)
     : QObject() {
+  init(fileName, tree, parent);
+  _totalBytes = QFileInfo(fileName).size();
+
+  _cache = gzopen(fileName.toLocal8Bit(), "r");
+
+  if (_cache == 0) {
+    qCritical() << "Can't open " << fileName << ": " << strerror(errno);
+    _ok = false;
+    emit error();
+    return;
+  }
+
+  // qDebug() << "Opening " << fileName << " OK" << endl;
+  checkHeader();
+  readReplacedDirs();
+}
+
+KCacheReader::KCacheReader(KBinaryCache *cache, const QString &path,
+                           KDirTree *tree)
+    : QObject() {
+  init(cache->fileName(), tree, 0);
+  _cache = 0;
+  _totalBytes = 0;
+  _binary = cache;
+  _ownsBinary = false;
+
+  int64_t node = cache->findDir(path.toUtf8());
+
+  if (node < 0) {
+    qCritical() << _fileName << ": No directory " << path << endl;
+    _ok = false;
+    return;
+  }
+
+  _startNode = node;
+  _startPath = path;
+  rewind();
+}
+
+KCacheReader::KCacheReader(KCacheReader *master) : QObject() {
+  init(master->_fileName, master->_tree, 0);
+  _master = master;
+  _detached = true;
+  _excludeRules = new KExcludeRules(*master->_excludeRules);
+  _ownsExcludeRules = true;
+  _cache = 0;
+  _totalBytes = 0;
+}
+
+void KCacheReader::init(const QString &fileName, KDirTree *tree,
+                        KDirInfo *parent) {
   _fileName = fileName;
-  _buffer[0] = 0;
-  _line = _buffer;
+  _blockSize = CACHE_BLOCK_SIZE;
+  _block = (char *)malloc(_blockSize + 1);
+  _blockPos = 0;
+  _blockEnd = 0;
+  _blockOffset = 0;
+  _blockEof = false;
+  _block[0] = 0;
+  _line = _block;
+  _lineEnd = _block;
   _lineNo = 0;
   _ok = true;
   _tree = tree;
   _toplevel = parent;
   _lastDir = 0;
   _lastExcludedDir = 0;
+  _excludeRules = KExcludeRules::excludeRules();
+  _ownsExcludeRules = false;
+  _binary = 0;
+  _ownsBinary = true;
+  _startNode = 0;
+  _lazyLevels = 0;
+  _parallel = true;
+  _haveLazyDirs = false;
+  _currentDir.dir = 0;
+  _currentDir.node = 0;
+  _currentDir.depth = 0;
+  _nextNode = 0;
+  _endNode = 0;
+  _detached = false;
+  _asRoot = false;
+  _master = 0;
+  _memberNo = 0;
+  _shardLevels = 0;
+  _canceled = false;
+  _bytesRead = 0;
+}
 
-  _cache = gzopen(fileName.toLocal8Bit(), "r");
+/**
+ * Pre-order traversal that sets the state of all directories to finished.
+ **/
+struct KFinishedStateVisitor : public KTreeVisitor {
+  bool enterDir(KDirInfo *dir) {
+    if (dir->isDotEntry())
+      return false;
 
-  if (_cache == 0) {
-    qCritical() << "Can't open " << fileName << ": " << strerror(errno);
-    _ok = false;
+    dir->setReadState(KDirFinished);
+    return true;
+  }
+};
+
+static void setStateRecursive(KDirInfo * root) {
+  // Once the whole cache file is read set the state of each KDirInfo to
+  // finished so the tree view can start fetching the tree
+  KFinishedStateVisitor visitor;
+  walkTree(root, visitor);
+}
+
+KCacheReader::~KCacheReader() {
+  free(_block);
+
+  if (_ownsExcludeRules)
+    delete _excludeRules;
+
+  if (_detached) {
+    if (_cache)
+      gzclose(_cache);
+
+    if (_ownsBinary)
+      delete _binary;
+
+    delete _toplevel; // Not taken: Nobody else has ever seen it.
+    return;
+  }
+
+  setStateRecursive(_toplevel);
+  if (_cache)
+    gzclose(_cache);
+
+  if (_ownsBinary)
+    delete _binary;
+
+  // qDebug() << "Cache reading finished" << endl;
+
+  if (_toplevel)
+    _toplevel->finalizeAll(_tree);
+
+  _tree->recalcAll();
+  emit finished();
+}
+
+void KCacheReader::rewind() {
+  if (_binary) {
+    // Start over with the toplevel directory, usually node no. 0
+
+    _pendingDirs.clear();
+    _currentDir.dir = 0;
+    _currentDir.node = 0;
+    _currentDir.path.clear();
+    _currentDir.depth = 0;
+    _nextNode = _startNode;
+    _endNode = _startNode + 1;
+  } else if (_cache) {
+    gzrewind(_cache);
+    _blockPos = 0;
+    _blockEnd = 0;
+    _blockOffset = 0;
+    _blockEof = false;
+    _lineNo = 0;
+    _memberNo = 0;
+    checkHeader(); // skip cache header
+  }
+}
+
+void KCacheReader::setDetached(bool asRoot,
+                               const KExcludeRules &excludeRules) {
+  _detached = true;
+  _asRoot = asRoot;
+  _toplevel = 0;
+
+  if (_ownsExcludeRules)
+    delete _excludeRules;
+
+  _excludeRules = new KExcludeRules(excludeRules);
+  _ownsExcludeRules = true;
+}
+
+KDirInfo *KCacheReader::takeSubtree() {
+  KDirInfo *subtree = _toplevel;
+  _toplevel = 0;
+  _dirs.clear();
+
+  if (subtree) {
+    setStateRecursive(subtree);
+    subtree->finalizeAll(0);
+    _tree->recalcSubtree(subtree);
+  }
+
+  return subtree;
+}
+
+QHash<QString, QString> KCacheReader::takeLazyShards() {
+  QHash<QString, QString> lazyShards = _lazyShards;
+  _lazyShards.clear();
+
+  return lazyShards;
+}
+
+KBinaryCache *KCacheReader::takeLazyCache() {
+  if (!_binary || !_ownsBinary || !_haveLazyDirs)
+    return 0;
+
+  _ownsBinary = false;
+  return _binary;
+}
+
+bool KCacheReader::read(int maxLines) {
+  if (_binary)
+    return readBinary(maxLines);
+
+  if (maxLines == 0 && _detached && _ok && !_toplevel && _dirs.isEmpty()) {
+    // Reading everything at once without anybody watching: If the file
+    // has the member index, all members can be read in parallel.
+
+    KGzipMemberReader members;
+
+    if (members.open(_fileName) && members.members().size() > 1) {
+      readMembers(members);
+      return false;
+    }
+  }
+
+  while (!atEnd() && _ok && !_canceled.load(std::memory_order_relaxed) &&
+         (maxLines == 0 || --maxLines > 0)) {
+    if (readLine()) {
+      splitLine();
+      addItem();
+    }
+
+    if ((_lineNo & 0x3ff) == 0)
+      _bytesRead.store(gzoffset(_cache), std::memory_order_relaxed);
+  }
+
+  _bytesRead.store(gzoffset(_cache), std::memory_order_relaxed);
+
+  if (atEnd()) {
+    if (_detached)
+      connectDirs();
+
+    readShards();
+  }
+
+  return _ok && !atEnd();
+}
+
+/**
+ * Decompressing and parsing one member of a multi-member cache file in a
+ * pool thread
+ **/
+class KCacheMemberTask : public QRunnable {
+public:
+  KCacheMemberTask(KCacheReader *reader, const KGzipMemberReader &members,
+                   int no)
+      : _reader(reader), _members(members), _no(no) {}
+
+  void run() override { _reader->readMember(_members, _no); }
+
+private:
+  KCacheReader *_reader;
+  const KGzipMemberReader &_members;
+  int _no;
+};
+
+void KCacheReader::readMembers(const KGzipMemberReader &members) {
+  // Each member after the first one goes to a reader of its own that
+  // builds a forest of unconnected directories: It can't know anything
+  // about the directories in the members before it.
+
+  // The replaced subtrees are known since the constructor.
+
+  int count = members.members().size();
+  std::vector<KCacheReader *> readers;
+  QThreadPool pool;
+  pool.setMaxThreadCount(QThread::idealThreadCount());
+
+  for (int i = 1; i < count; i++) {
+    readers.push_back(new KCacheReader(this));
+
+    if (_parallel)
+      pool.start(new KCacheMemberTask(readers.back(), members, i));
+  }
+
+  // The first member has the toplevel directory; read it right here while
+  // the others are busy.
+
+  if (_cache) {
+    gzclose(_cache);
+    _cache = 0;
+  }
+
+  readMember(members, 0);
+  pool.waitForDone();
+
+  for (size_t i = 0; i < readers.size() && !_parallel; i++)
+    readers[i]->readMember(members, i + 1);
+
+  // Only now all directories of the file are known, so the ones that
+  // start a member (or came before their parent) can be connected.
+
+  for (size_t i = 0; i < readers.size(); i++) {
+    KCacheReader *reader = readers[i];
+
+    if (!reader->_ok)
+      _ok = false;
+
+    _unconnectedDirs.insert(_unconnectedDirs.end(),
+                            reader->_unconnectedDirs.begin(),
+                            reader->_unconnectedDirs.end());
+
+    for (QHash<QString, KDirInfo *>::const_iterator it = reader->_dirs.begin();
+         it != reader->_dirs.end(); ++it)
+      _dirs.insert(it.key(), it.value());
+
+    _shards.insert(_shards.end(), reader->_shards.begin(),
+                   reader->_shards.end());
+    delete reader;
+  }
+
+  connectDirs();
+  readShards();
+
+  _bytesRead.store(_totalBytes, std::memory_order_relaxed);
+
+  // qDebug() << "Read " << count << " members of " << _fileName << endl;
+
+  if (!_ok)
     emit error();
+}
+
+void KCacheReader::readReplacedDirs() {
+  if (!_ok || !_cache)
     return;
+
+  KGzipMemberReader members;
+
+  if (!members.open(_fileName))
+    return; // Not written by KGzipMemberWriter: nothing replaced
+
+  qint64 offset = 0;
+
+  for (int i = 0; i < members.members().size(); i++) {
+    const KGzipMember &member = members.members()[i];
+
+    if (!member.replaces.isEmpty())
+      _replacedDirs.insert(QString::fromUtf8(member.replaces), i);
+
+    _memberOffsets.append(offset);
+    offset += member.uncompressedSize;
   }
 
-  // qDebug() << "Opening " << fileName << " OK" << endl;
-  checkHeader();
-}
+  if (_replacedDirs.isEmpty())
+    _memberOffsets.clear();
+}
+
+void KCacheReader::readMember(const KGzipMemberReader &members, int no) {
+  KCacheReader *master = _master ? _master : this;
+
+  if (master->_canceled.load(std::memory_order_relaxed))
+    return;
+
+  const KGzipMember &member = members.members()[no];
+  char *data = members.inflateMember(no);
+
+  if (!data) {
+    _ok = false;
+    return;
+  }
+
+  // The whole member is in one block now; nextLine() takes it from there.
+
+  _memberNo = no;
+
+  free(_block);
+  _block = data;
+  _blockSize = member.uncompressedSize;
+  _blockPos = 0;
+  _blockEnd = member.uncompressedSize;
+  _blockEof = true;
+  _lineNo = 0;
+
+  if (strncmp(_block, "[kdirstat ", 10) == 0)
+    nextLine(); // skip cache header
 
-static void setStateRecursive(KDirInfo * root) {
-  // Once the whole cache file is read set the state of each KDirInfo to
-  // finished so the tree view can start fetching the tree
-  root->setReadState(KDirFinished);
-  for(int i = 0; i < root->numChildren(); i++) {
-    KFileInfo * f = root->child(i);
-    if(f->isDirInfo()) {
-      setStateRecursive(static_cast<KDirInfo*>(f));
+  while (!atEnd() && _ok && !master->_canceled.load(std::memory_order_relaxed)) {
+    if (readLine()) {
+      splitLine();
+      addItem();
     }
   }
+
+  master->_bytesRead.fetch_add(member.size, std::memory_order_relaxed);
 }
 
-KCacheReader::~KCacheReader() {
-  setStateRecursive(_toplevel);
-  if (_cache)
-    gzclose(_cache);
+/**
+ * Traversal that collects all directories of subtrees that are about to be
+ * deleted.
+ **/
+struct KOrphanVisitor : public KTreeVisitor {
+  QSet<KDirInfo *> dirs;
 
-  // qDebug() << "Cache reading finished" << endl;
+  bool enterDir(KDirInfo *dir) {
+    dirs.insert(dir);
+    return true;
+  }
+};
 
-  if (_toplevel)
-    _toplevel->finalizeAll(_tree);
+void KCacheReader::connectDirs() {
+  std::vector<KDirInfo *> orphans;
 
-  emit finished();
-}
+  for (size_t i = 0; i < _unconnectedDirs.size(); i++) {
+    const UnconnectedDir &unconnected = _unconnectedDirs[i];
+    KDirInfo *parent = _ok ? locateParent(unconnected.parentPath) : 0;
 
-void KCacheReader::rewind() {
-  if (_cache) {
-    gzrewind(_cache);
-    checkHeader(); // skip cache header
+    if (parent && !parent->isExcluded())
+      parent->insertChild(unconnected.dir);
+    else
+      orphans.push_back(unconnected.dir);
   }
-}
 
-bool KCacheReader::read(int maxLines) {
-  while (!gzeof(_cache) && _ok && (maxLines == 0 || --maxLines > 0)) {
-    if (readLine()) {
-      splitLine();
-      addItem();
+  _unconnectedDirs.clear();
+
+  if (orphans.empty())
+    return;
+
+  // Only now: Any of the others may have been connected to an orphan.
+
+  KOrphanVisitor visitor;
+
+  for (size_t i = 0; i < orphans.size(); i++) {
+    for (size_t j = 0; j < _shards.size();) {
+      if (_shards[j].dir->isInSubtree(orphans[i]))
+        _shards.erase(_shards.begin() + j);
+      else
+        j++;
     }
+
+    walkTree(orphans[i], visitor);
+  }
+
+  // Nothing may find them by their path any more.
+
+  QMutableHashIterator<QString, KDirInfo *> it(_dirs);
+
+  while (it.hasNext()) {
+    if (visitor.dirs.contains(it.next().value()))
+      it.remove();
   }
 
-  return _ok && !gzeof(_cache);
+  for (size_t i = 0; i < orphans.size(); i++)
+    delete orphans[i];
 }
 
 void KCacheReader::addItem() {
@@ -232,6 +1169,8 @@ void KCacheReader::addItem() {
   char *mtime_str = field(n++);
   char *blocks_str = 0;
   char *links_str = 0;
+  char *shard_str = 0;
+  char *totals_str = 0;
 
   while (fieldsCount() > n + 1) {
     char *keyword = field(n++);
@@ -241,6 +1180,10 @@ void KCacheReader::addItem() {
       blocks_str = val_str;
     if (strcasecmp(keyword, "links:") == 0)
       links_str = val_str;
+    if (strcasecmp(keyword, "shard:") == 0)
+      shard_str = val_str;
+    if (strcasecmp(keyword, "totals:") == 0)
+      totals_str = val_str;
   }
 
   // Type
@@ -302,13 +1245,36 @@ void KCacheReader::addItem() {
 
   //
   // Create a new item
-  QFileInfo fileInfo(QUrl::fromPercentEncoding(raw_path));
+
+  int pathLen = decodePercent(raw_path);
+
+  if (mode != S_IFDIR && *raw_path != '/') {
+    // The vast majority of lines: A file in the directory of the last "D"
+    // line. Its name is all there is to take from the path.
+
+    if (_lastDir)
+      addFile(_lastDir, QString::fromUtf8(raw_path, pathLen), mode, size,
+              mtime, blocks, links);
+
+    // else: in an excluded directory or one that could not be located
+
+    return;
+  }
+
+  QString fullPath = QString::fromUtf8(raw_path, pathLen);
+
+  if (mode == S_IFDIR && isReplaced(fullPath)) {
+    _lastDir = 0; // So are its files
+    return;
+  }
+
   QString path, name;
-  if (_tree->root()) {
-    path = fileInfo.dir().path();
-    name = fileInfo.fileName();
+  bool isToplevel = _master ? false : _detached ? !_toplevel : !_tree->root();
+
+  if (!isToplevel || (_detached && !_asRoot)) {
+    splitPath(raw_path, pathLen, path, name);
   } else {
-    path = fileInfo.filePath();
+    path = fullPath;
     name = path;
   }
 
@@ -319,22 +1285,31 @@ void KCacheReader::addItem() {
     }
   }
 
-  // Find parent in tree
+  if (mode == S_IFDIR && !isToplevel) {
+    // A directory may be listed more than once if the cache was written
+    // while reading (see KCacheStreamWriter); the lines after the first
+    // one only add to it.
 
-  KDirInfo *parent = _lastDir;
+    KDirInfo *dir = findDir(fullPath);
+
+    if (dir) {
+      _lastDir = dir->isExcluded() ? 0 : dir;
+      return;
+    }
+  }
 
-  if (!parent && _tree->root()) {
-    // Try the easy way first - the starting point of this cache
+  // Find parent in tree
 
-    if (_toplevel)
-      parent = dynamic_cast<KDirInfo *>(_toplevel->locate(path));
+  KDirInfo *parent = _lastDir;
 
-    // Fallback: Search the entire tree
+  if (!parent && !isToplevel) {
+    parent = locateParent(path);
 
-    if (!parent)
-      parent = dynamic_cast<KDirInfo *>(_tree->locate(path));
+    // In detached mode, a directory may come before its parent: in a
+    // later member of a multi-member cache file or later in a cache file
+    // that was written while reading. connectDirs() takes care of it.
 
-    if (!parent) // Still nothing?
+    if (!parent && !(_detached && mode == S_IFDIR)) // Still nothing?
     {
 #if 0
 	    qCritical() << _fileName << ":" << _lineNo << ": "
@@ -343,17 +1318,279 @@ void KCacheReader::addItem() {
 
       return; // Ignore this cache line completely
     }
+
+    if (parent && parent->isExcluded())
+      return; // out of order below an excluded directory
   }
 
   if (strcasecmp(type, "D") == 0) {
-    // qDebug() << "Creating KDirInfo  for " << name << endl;
-    KDirInfo *dir = new KDirInfo(parent, name, mode, size, mtime);
-    dir->setReadState(KDirCached);
+    KDirInfo *dir = addDir(parent, name, fullPath, mode, size, mtime);
     _lastDir = dir;
 
+    if (!parent && !isToplevel) {
+      UnconnectedDir unconnected = {dir, path};
+      _unconnectedDirs.push_back(unconnected);
+    }
+
+    if (dir->isExcluded()) {
+      _lastExcludedDir = dir;
+      _lastExcludedDirUrl = fullPath;
+      _lastDir = 0;
+    } else if (totals_str && !shard_str) {
+      // An aggregate when the file was written: Nothing but the totals
+
+      Totals totals;
+      parseTotals(totals_str, totals);
+      setAggregate(dir, totals);
+    } else if (shard_str && dir != _toplevel) {
+      // A manifest: The content of this directory is in a shard file.
+
+      PendingShard shard;
+      shard.dir = dir;
+      shard.path = fullPath;
+      shard.fileName = KCacheWriter::shardPath(
+          _master ? _master->_fileName : _fileName, shard_str);
+      parseTotals(totals_str, shard.totals);
+
+      if (!totals_str)
+        shard.totals.latestMtime = mtime;
+
+      _shards.push_back(shard);
+    }
+  } else {
     if (parent)
-      parent->insertChild(dir);
+      addFile(parent, name, mode, size, mtime, blocks, links);
+    else {
+      qCritical() << _fileName << ":" << _lineNo << ": "
+                  << "No parent for item " << name << endl;
+    }
+  }
+}
+
+void KCacheReader::parseTotals(char *str, Totals &totals) {
+  totals.totalSize = 0;
+  totals.totalBlocks = 0;
+  totals.totalItems = 0;
+  totals.totalSubDirs = 0;
+  totals.totalFiles = 0;
+  totals.latestMtime = 0;
+
+  if (!str)
+    return;
+
+  char *pos = str;
+  totals.totalSize = strtoll(pos, &pos, 10);
+  totals.totalBlocks = strtoll(*pos ? pos + 1 : pos, &pos, 10);
+  totals.totalItems = strtoll(*pos ? pos + 1 : pos, &pos, 10);
+  totals.totalSubDirs = strtoll(*pos ? pos + 1 : pos, &pos, 10);
+  totals.totalFiles = strtoll(*pos ? pos + 1 : pos, &pos, 10);
+  totals.latestMtime = strtoll(*pos ? pos + 1 : pos, &pos, 0);
+}
+
+void KCacheReader::setAggregate(KDirInfo *dir, const Totals &totals) {
+  dir->setAggregate(totals.totalSize, totals.totalBlocks, totals.totalItems,
+                    totals.totalSubDirs, totals.totalFiles,
+                    totals.latestMtime);
+}
+
+KDirInfo *KCacheReader::findDir(const QString &path) const {
+  return _dirs.value(path, 0);
+}
+
+/**
+ * Reading one shard of a manifest in a pool thread
+ **/
+class KCacheShardTask : public QRunnable {
+public:
+  KCacheShardTask(const QString &fileName, const QString &path,
+                  KDirTree *tree, const KExcludeRules &excludeRules,
+                  const std::atomic<bool> &canceled)
+      : _fileName(fileName), _path(path), _tree(tree),
+        _excludeRules(excludeRules), _canceled(canceled), _subtree(0) {
+    setAutoDelete(false);
+  }
+
+  void run() override {
+    if (!_canceled.load(std::memory_order_relaxed))
+      _subtree =
+          KCacheReader::readShard(_fileName, _path, _tree, _excludeRules);
+  }
+
+  KDirInfo *subtree() const { return _subtree; }
+
+private:
+  QString _fileName;
+  QString _path;
+  KDirTree *_tree;
+  KExcludeRules _excludeRules; // a copy of the reader's for this thread
+  const std::atomic<bool> &_canceled;
+  KDirInfo *_subtree;
+};
+
+KDirInfo *KCacheReader::readShard(const QString &fileName, const QString &path,
+                                  KDirTree *tree,
+                                  const KExcludeRules &excludeRules) {
+  KCacheReader reader(fileName, tree);
+
+  if (!reader.ok())
+    return 0;
+
+  reader.setDetached(false, excludeRules);
+
+  // Shards are read in parallel already; see readShards().
+  reader.setParallel(false);
+
+  if (reader.firstDir() != path) {
+    qCritical() << fileName << ": Not a shard of " << path << endl;
+    return 0;
+  }
+
+  reader.rewind();
+  reader.read(0);
+
+  return reader.ok() ? reader.takeSubtree() : 0;
+}
+
+void KCacheReader::readShards() {
+  if (_shards.empty())
+    return;
+
+  std::vector<KCacheShardTask *> tasks(_shards.size(), (KCacheShardTask *)0);
+  QThreadPool pool;
+  pool.setMaxThreadCount(QThread::idealThreadCount());
+
+  for (size_t i = 0; i < _shards.size(); i++) {
+    const PendingShard &shard = _shards[i];
+
+    // Directory levels below the toplevel directory
+
+    int level = shard.path.mid(_toplevelPath.length()).count('/') +
+                (_toplevelPath.endsWith('/') ? 1 : 0);
+
+    if (_shardLevels == 0)
+      _shardLevels = level;
+
+    if (!_detached || (_lazyLevels > 0 && level >= _lazyLevels)) {
+      _lazyShards.insert(shard.path, shard.fileName);
+      continue;
+    }
+
+    tasks[i] = new KCacheShardTask(shard.fileName, shard.path, _tree,
+                                   *_excludeRules, _canceled);
+
+    if (_parallel)
+      pool.start(tasks[i]);
+    else
+      tasks[i]->run();
+  }
+
+  pool.waitForDone();
+
+  for (size_t i = 0; i < _shards.size(); i++) {
+    const PendingShard &shard = _shards[i];
+    KDirInfo *subtree = tasks[i] ? tasks[i]->subtree() : 0;
+    delete tasks[i];
+
+    if (subtree) {
+      // Replace the directory from the manifest with the one from the
+      // shard that has all of its content.
+
+      KDirInfo *parent = shard.dir->parent();
+      _dirs.remove(shard.path);
+      parent->deletingChild(shard.dir);
+      delete shard.dir;
+      parent->insertChild(subtree);
+    } else {
+      // Left unread or broken: At least the totals are right.
+
+      setAggregate(shard.dir, shard.totals);
+    }
+  }
+
+  _shards.clear();
+}
+
+bool KCacheReader::isReplaced(const QString &path) const {
+  const QHash<QString, int> &replacedDirs =
+      _master ? _master->_replacedDirs : _replacedDirs;
+
+  if (replacedDirs.isEmpty())
+    return false;
+
+  // A replaced subtree includes everything below it.
+
+  QString dir = path;
+
+  while (true) {
+    if (replacedDirs.value(dir, -1) > _memberNo)
+      return true;
+
+    int slash = dir.lastIndexOf('/');
+
+    if (slash < 0 || dir == "/")
+      return false;
 
+    dir.truncate(slash > 0 ? slash : 1);
+  }
+}
+
+KDirInfo *KCacheReader::locateParent(const QString &path) {
+  // Most likely, the parent is a directory of this very cache file.
+
+  KDirInfo *dir = findDir(path);
+
+  if (dir)
+    return dir;
+
+  if (_detached) {
+    // The toplevel directory's name might only be the last component of
+    // its path.
+
+    if (!_toplevel || !path.startsWith(_toplevelPath))
+      return 0;
+
+    QString relativePath = _toplevel->name() + path.mid(_toplevelPath.length());
+    return dynamic_cast<KDirInfo *>(_toplevel->locate(relativePath));
+  }
+
+  // Try the easy way first - the starting point of this cache
+
+  KDirInfo *parent = 0;
+
+  if (_toplevel)
+    parent = dynamic_cast<KDirInfo *>(_toplevel->locate(path));
+
+  // Fallback: Search the entire tree
+
+  if (!parent)
+    parent = dynamic_cast<KDirInfo *>(_tree->locate(path));
+
+  return parent;
+}
+
+KDirInfo *KCacheReader::addDir(KDirInfo *parent, const QString &name,
+                               const QString &fullPath, mode_t mode,
+                               KFileSize size, time_t mtime) {
+  // qDebug() << "Creating KDirInfo  for " << name << endl;
+  KDirInfo *dir = new KDirInfo(parent, name, mode, size, mtime);
+  dir->setReadState(KDirCached);
+
+  if (parent)
+    parent->insertChild(dir);
+
+  // Don't sum up anything while reading: recalcAll() does that much
+  // faster at the end.
+  dir->markAsDirty();
+
+  if (_toplevelPath.isEmpty()) // the first directory of this cache
+    _toplevelPath = fullPath;
+
+  _dirs.insert(fullPath, dir);
+
+  if (_detached) {
+    if (!_toplevel && !_master)
+      _toplevel = dir;
+  } else {
     if (!_tree->root()) {
       _tree->setRoot(dir);
       _toplevel = dir;
@@ -363,45 +1600,156 @@ void KCacheReader::addItem() {
       _toplevel = dir;
 
     _tree->childAddedNotify(dir);
+  }
+
+  if (dir != _toplevel) {
+    // The full path of a directory is right there in the cache file -
+    // no need to build dir->url() from the tree.
+
+    if (_excludeRules->match(fullPath)) {
+      // qDebug() << "Excluding " << name << endl;
+      dir->setExcluded();
+      dir->setReadState(KDirOnRequestOnly);
 
-    if (dir != _toplevel) {
-      if (KExcludeRules::excludeRules()->match(dir->url())) {
-        // qDebug() << "Excluding " << name << endl;
-        dir->setExcluded();
-        dir->setReadState(KDirOnRequestOnly);
+      if (!_detached)
         _tree->sendFinalizeLocal(dir);
-        dir->finalizeLocal();
 
-        _lastExcludedDir = dir;
-        _lastExcludedDirUrl = _lastExcludedDir->url();
-        _lastDir = 0;
-      }
+      dir->finalizeLocal();
     }
-  } else {
-    if (parent) {
-      // qDebug() << "Creating KFileInfo for " << parent->debugUrl() << "/" <<
-      // name << endl;
-
-      KFileInfo *item =
-          new KFileInfo(parent, name, mode, size, mtime, blocks, links);
-      parent->insertChild(item);
-      _tree->childAddedNotify(item);
-    } else {
-      qCritical() << _fileName << ":" << _lineNo << ": "
-                  << "No parent for item " << name << endl;
+  }
+
+  return dir;
+}
+
+void KCacheReader::addFile(KDirInfo *parent, const QString &name,
+                           mode_t mode, KFileSize size, time_t mtime,
+                           KFileSize blocks, int links) {
+  // qDebug() << "Creating KFileInfo for " << parent->debugUrl() << "/" <<
+  // name << endl;
+
+  KFileInfo *item =
+      new KFileInfo(parent, name, mode, size, mtime, blocks, links);
+  parent->insertChild(item);
+
+  if (!_detached)
+    _tree->childAddedNotify(item);
+}
+
+bool KCacheReader::readBinary(int maxItems) {
+  while (_ok && !_canceled.load(std::memory_order_relaxed) &&
+         (maxItems == 0 || --maxItems > 0)) {
+    if (_nextNode >= _endNode) {
+      // Done with this directory; continue with the next one
+
+      if (_pendingDirs.empty())
+        break;
+
+      _currentDir = _pendingDirs.front();
+      _pendingDirs.pop_front();
+
+      const KBinaryCacheNode &node = _binary->node(_currentDir.node);
+      _nextNode = node.firstChild;
+      _endNode = node.firstChild + node.childCount;
+      continue;
+    }
+
+    addBinaryItem(_nextNode++);
+
+    if ((_nextNode & 0x3ff) == 0)
+      _bytesRead.store(sizeof(KBinaryCacheHeader) +
+                           (qint64)_nextNode * sizeof(KBinaryCacheNode),
+                       std::memory_order_relaxed);
+  }
+
+  return _ok && !eof();
+}
+
+void KCacheReader::addBinaryItem(uint32_t nodeNo) {
+  const KBinaryCacheNode &node = _binary->node(nodeNo);
+
+  if (!_binary->isValid(nodeNo)) {
+    qCritical() << _fileName << ": Bad node no. " << nodeNo << endl;
+    _ok = false;
+    emit error();
+    return;
+  }
+
+  QString name = _binary->name(nodeNo);
+  QString fullPath;
+  KDirInfo *parent = _currentDir.dir;
+
+  if (nodeNo == _startNode) {
+    // The toplevel directory: The name of node no. 0 is its full path.
+
+    fullPath = nodeNo == 0 ? name : _startPath;
+
+    if (_detached) {
+      if (!_asRoot)
+        name = QFileInfo(fullPath).fileName();
+    } else if (_tree->root()) {
+      QFileInfo fileInfo(fullPath);
+      name = fileInfo.fileName();
+      parent = locateParent(fileInfo.dir().path());
+
+      if (!parent) {
+        qCritical() << _fileName << ": Could not locate parent of "
+                    << fullPath << endl;
+        _endNode = 0; // Nothing to read
+        return;
+      }
     }
+  } else if (node.isDir()) {
+    fullPath = _currentDir.path;
+
+    if (!fullPath.endsWith('/'))
+      fullPath += '/';
+
+    fullPath += name;
   }
+
+  if (node.isDir()) {
+    KDirInfo *dir = addDir(parent, name, fullPath, node.mode, node.size,
+                           node.mtime);
+
+    int depth = nodeNo == _startNode ? 0 : _currentDir.depth + 1;
+
+    if ((node.flags & KBinaryCacheNode::Aggregate) && !dir->isExcluded())
+      dir->setAggregate(node.totalSize, node.totalBlocks, node.totalItems,
+                        node.totalSubDirs, node.totalFiles, node.latestMtime);
+    else if (node.childCount > 0 && !dir->isExcluded()) {
+      if (_lazyLevels > 0 && depth >= _lazyLevels) {
+        // Deep enough: Keep only the totals until somebody wants to see
+        // the content.
+
+        dir->setAggregate(node.totalSize, node.totalBlocks, node.totalItems,
+                          node.totalSubDirs, node.totalFiles,
+                          node.latestMtime);
+        _haveLazyDirs = true;
+      } else {
+        PendingDir pending = {dir, nodeNo, fullPath, depth};
+        _pendingDirs.push_back(pending);
+      }
+    }
+  } else
+    addFile(parent, name, node.mode, node.size, node.mtime, node.blocks,
+            node.links);
 }
 
 bool KCacheReader::eof() {
+  if (_binary)
+    return !_ok || (_nextNode >= _endNode && _pendingDirs.empty());
+
   if (!_ok || !_cache)
     return true;
 
-  return gzeof(_cache);
+  return atEnd();
 }
 
 QString KCacheReader::firstDir() {
-  while (!gzeof(_cache) && _ok) {
+  if (_binary)
+    return _ok ? _binary->rootPath() : QString("");
+
+  while (!atEnd() && _ok) {
     if (!readLine())
       return "";
 
@@ -414,8 +1762,10 @@ QString KCacheReader::firstDir() {
     char *type = field(n++);
     char *path = field(n++);
 
-    if (strcasecmp(type, "D") == 0)
-      return QString(path);
+    if (strcasecmp(type, "D") == 0) {
+      int len = decodePercent(path);
+      return QString::fromUtf8(path, len);
+    }
   }
 
   return "";
@@ -446,12 +1796,29 @@ bool KCacheReader::checkHeader() {
   if (_ok) {
     QString version = field(1);
 
-    // currently not checking version number
-    // for future use
+    if (version.startsWith("5.")) {
+      // A binary cache file: Map it and forget about the text reader.
+
+      gzclose(_cache);
+      _cache = 0;
+      _binary = new KBinaryCache();
+      _ok = _binary->open(_fileName);
+      rewind();
+
+      if (!_ok)
+        qCritical() << _fileName << ":" << _lineNo
+                    << ": Incompatible cache file version" << endl;
+    } else if (version.section('.', 0, 0) == "4" &&
+               version.section('.', 1).toInt() >
+                   QString(CACHE_VERSION).section('.', 1).toInt()) {
+      // Written by a newer version: Something in there might be misread.
 
-    if (!_ok)
+      _ok = false;
       qCritical() << _fileName << ":" << _lineNo
                   << ": Incompatible cache file version" << endl;
+    }
+
+    // Any other version is read as text
   }
 
   // qDebug() << "Cache file header check OK: " << _ok << endl;
@@ -462,35 +1829,101 @@ bool KCacheReader::checkHeader() {
   return _ok;
 }
 
+char *KCacheReader::nextLine() {
+  while (true) {
+    char *start = _block + _blockPos;
+    char *newline = (char *)memchr(start, '\n', _blockEnd - _blockPos);
+
+    if (newline) {
+      *newline = 0;
+      _lineEnd = newline;
+      _blockPos = newline + 1 - _block;
+      return start;
+    }
+
+    if (_blockEof) {
+      if (_blockPos >= _blockEnd)
+        return 0;
+
+      // Last line without a newline
+
+      _block[_blockEnd] = 0;
+      _lineEnd = _block + _blockEnd;
+      _blockPos = _blockEnd;
+      return start;
+    }
+
+    // Keep the incomplete line and read more after it. If it fills the
+    // whole buffer, the buffer is too small for it.
+
+    size_t rest = _blockEnd - _blockPos;
+    memmove(_block, start, rest);
+    _blockOffset += _blockPos;
+    _blockPos = 0;
+    _blockEnd = rest;
+
+    if (_blockEnd == _blockSize) {
+      _blockSize *= 2;
+      _block = (char *)realloc(_block, _blockSize + 1);
+      Q_CHECK_PTR(_block);
+    }
+
+    size_t want = _blockSize - _blockEnd;
+
+    if (_lineNo == 0 && want > CACHE_HEADER_READ_SIZE)
+      want = CACHE_HEADER_READ_SIZE;
+
+    int len = _cache ? gzread(_cache, _block + _blockEnd, want) : 0;
+
+    if (len < 0) {
+      _ok = false;
+      qCritical() << _fileName << ":" << _lineNo << ": Read error" << endl;
+      emit error();
+      return 0;
+    }
+
+    if (len == 0)
+      _blockEof = true;
+
+    _blockEnd += len;
+  }
+}
+
 bool KCacheReader::readLine() {
-  if (!_ok || !_cache)
+  if (!_ok)
     return false;
 
   _fieldsCount = 0;
 
   do {
+    char *line = nextLine();
+
+    if (!line)
+      return false;
+
     _lineNo++;
+    _line = line;
 
-    if (!gzgets(_cache, _buffer, MAX_CACHE_LINE_LEN - 1)) {
-      _buffer[0] = 0;
-      _line = _buffer;
+    // Only reading line by line: readMember() sets the member itself.
 
-      if (!gzeof(_cache)) {
-        _ok = false;
-        qCritical() << _fileName << ":" << _lineNo << ": Read error" << endl;
-        emit error();
-      }
+    if (_cache && !_memberOffsets.isEmpty()) {
+      qint64 offset = _blockOffset + (line - _block);
 
-      return false;
+      while (_memberNo + 1 < _memberOffsets.size() &&
+             offset >= _memberOffsets[_memberNo + 1])
+        _memberNo++;
     }
 
-    _line = skipWhiteSpace(_buffer);
-    killTrailingWhiteSpace(_line);
+    while (*_line == ' ' || *_line == '\t')
+      _line++;
+
+    while (_lineEnd > _line && isspace((unsigned char)_lineEnd[-1]))
+      *--_lineEnd = 0;
 
     // qDebug() << "line[ " << _lineNo << "]: \"" << _line<< "\"" << endl;
 
-  } while (!gzeof(_cache) && (*_line == 0 ||   // empty line
-                              *_line == '#')); // comment line
+  } while (*_line == 0 ||   // empty line
+           *_line == '#');  // comment line
 
   return true;
 }
@@ -504,18 +1937,24 @@ void KCacheReader::splitLine() {
   if (*_line == '#') // skip comment lines
     *_line = 0;
 
+  // Fields are separated by blanks and tabs, and readLine() already
+  // removed any leading and trailing whitespace.
+
   char *current = _line;
-  char *end = _line + strlen(_line);
 
-  while (current && current < end && *current &&
-         _fieldsCount < MAX_FIELDS_PER_LINE - 1) {
+  while (*current && _fieldsCount < MAX_FIELDS_PER_LINE - 1) {
     _fields[_fieldsCount++] = current;
-    current = findNextWhiteSpace(current);
 
-    if (current && current < end) {
-      *current++ = 0;
-      current = skipWhiteSpace(current);
-    }
+    while (*current && *current != ' ' && *current != '\t')
+      current++;
+
+    if (!*current)
+      break;
+
+    *current++ = 0;
+
+    while (*current == ' ' || *current == '\t')
+      current++;
   }
 }
 
@@ -525,36 +1964,3 @@ char *KCacheReader::field(int no) {
   else
     return 0;
 }
-
-char *KCacheReader::skipWhiteSpace(char *cptr) {
-  if (cptr == 0)
-    return 0;
-
-  while (*cptr != 0 && isspace(*cptr))
-    cptr++;
-
-  return cptr;
-}
-
-char *KCacheReader::findNextWhiteSpace(char *cptr) {
-  if (cptr == 0)
-    return 0;
-
-  while (*cptr != 0 && !isspace(*cptr))
-    cptr++;
-
-  return *cptr == 0 ? 0 : cptr;
-}
-
-void KCacheReader::killTrailingWhiteSpace(char *cptr) {
-  char *start = cptr;
-
-  if (cptr == 0)
-    return;
-
-  cptr = start + strlen(start) - 1;
-
-  while (cptr >= start && isspace(*cptr))
-    *cptr-- = 0;
-}
-
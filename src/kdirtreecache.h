@@ -6,8 +6,17 @@
  *              Joshua Hodosh <kdirstat@grumpypenguin.org>
  */
 
+#include "kbinarycache.h"
 #include "kdirtree.h"
+#include "kexcluderules.h"
+#include "kgzipmembers.h"
+#include "ktreewalk.h"
+#include <QHash>
+#include <QSet>
+#include <atomic>
+#include <deque>
 #include <stdio.h>
+#include <vector>
 #include <zlib.h>
 
 #ifndef NOT_USED
@@ -15,18 +24,38 @@
 #endif
 
 #define DEFAULT_CACHE_NAME ".kdirstat.cache.gz"
-#define MAX_CACHE_LINE_LEN 1024
+
+// Version of the text cache files written here:
+// 4.0: the original format
+// 4.1: directories may come before their parent (see KCacheStreamWriter)
+// 4.2: aggregates have their totals ("totals:"), nothing below them
+// 4.3: manifests refer to shard files ("shard:"), and subtrees may be
+//      replaced by later gzip members ("KR" field)
+#define CACHE_VERSION "4.3"
 #define MAX_FIELDS_PER_LINE 32
 
 namespace KDirStat {
 class KCacheWriter {
 public:
   /**
-   * Write 'tree' to file 'fileName' in gzip format (using zlib).
+   * Write 'tree' to file 'fileName': in gzip format (using zlib) if
+   * 'fileName' ends with ".gz", in the binary format (see @ref
+   * KBinaryCache) otherwise. A text cache file is written in shards if
+   * 'shardLevels' is more than 0 (see @ref writeShards()).
+   *
+   * With 'changesKnown', 'fileName' already has the content of 'tree'
+   * except for the subtrees with the URLs 'changedUrls', e.g. because they
+   * were refreshed since the file was read or written. If there are none,
+   * the file stays as it is. Otherwise, only those subtrees are added to a
+   * text cache file (see @ref spliceCache()) or, if it was written in
+   * shards with the same 'shardLevels', only their shards are written
+   * again. If that is not possible, the whole tree is written.
    *
    * Check CacheWriter::ok() to see if writing the cache file went OK.
    **/
-  KCacheWriter(const QString &fileName, KDirTree *tree);
+  KCacheWriter(const QString &fileName, KDirTree *tree,
+               const QStringList &changedUrls = QStringList(),
+               bool changesKnown = false, int shardLevels = 0);
 
   /**
    * Destructor
@@ -38,37 +67,215 @@ public:
    **/
   bool ok() const { return _ok; }
 
+  /**
+   * Returns the directory levels of the shards that were written or 0 if
+   * the whole tree went to one file.
+   **/
+  int shardLevels() const { return _shardLevels; }
+
+  /**
+   * Returns the full path of shard file 'name' of text cache file
+   * 'fileName' (see @ref writeShards()).
+   **/
+  static QString shardPath(const QString &fileName, const QString &name);
+
   /**
    * Format a file size as string - with trailing "G", "M", "K" for
    * "Gigabytes", "Megabytes, "Kilobytes", respectively (provided there
    * is no fractional part - 27M is OK, 27.2M is not).
    **/
-  QString formatSize(KFileSize size);
+  static QString formatSize(KFileSize size);
+
+  /**
+   * Append the line for 'item' to 'buffer' without recursion.
+   *
+   * 'url' is the complete URL of 'item'. It is only needed for
+   * directories; other items are written with their name only.
+   **/
+  static void writeItem(QByteArray &buffer, KFileInfo *item,
+                        const QString &url);
+
+  /**
+   * Append the totals of directory 'dir' to its line in 'buffer' as the
+   * optional field "totals:": size, blocks, items, subdirectories, files
+   * and latest mtime, separated by commas.
+   **/
+  static void writeTotals(QByteArray &buffer, KFileInfo *dir);
+
+  /**
+   * Returns 'true' if 'fileName' is to be written in the text format.
+   **/
+  static bool isTextCacheName(const QString &fileName);
 
 protected:
+
   /**
-   * Write cache file in gzip format.
+   * Write cache file in gzip format: as a series of gzip members that are
+   * compressed in parallel, each starting with a directory line (see
+   * @ref KGzipMemberWriter).
    * Returns 'true' if OK, 'false' upon error.
    **/
   bool writeCache(const QString &fileName, KDirTree *tree);
 
   /**
-   * Write 'item' recursively to cache file 'cache'.
-   * Uses zlib to write gzip-compressed files.
+   * Append the subtrees 'changedUrls' of 'tree' to multi-member cache file
+   * 'fileName' rather than writing everything again. Each one starts with
+   * a member with a "KR" field (see @ref KGzipMemberWriter::write()) with
+   * its path, which tells readers to ignore that subtree in all members
+   * before it. The members with its current content follow; a subtree
+   * that no longer exists has none.
+   *
+   * The replaced lines stay in the file until it is written completely
+   * again. That happens instead of this once too much of the file is
+   * replaced.
+   *
+   * Returns 'false' if the file was not touched or writing failed; then
+   * it is as it was before. The caller then has to write the whole tree.
+   **/
+  bool spliceCache(const QString &fileName, KDirTree *tree,
+                   const QStringList &changedUrls);
+
+  /**
+   * Write 'tree' to text cache file 'fileName' as a manifest and shards:
+   * Each directory 'shardLevels' levels below the toplevel directory goes
+   * to a cache file of its own in directory 'fileName' + ".shards", so
+   * readers can read all of them in parallel or only when needed. The
+   * manifest has everything else; the line of each such directory there
+   * has the name of its shard file and its totals as extra fields.
+   *
+   * With 'changesKnown', only the shards of the subtrees in 'changedUrls'
+   * and those that don't exist yet are written; see the constructor.
+   * Shard files that don't belong to the manifest any more are removed.
+   **/
+  bool writeShards(const QString &fileName, KDirTree *tree,
+                   const QStringList &changedUrls, bool changesKnown,
+                   int shardLevels);
+
+  /**
+   * Write the subtree below and including 'item' to a new text cache file
+   * 'fileName'. Directories 'shardLevels' levels below 'item' go to shard
+   * files (see @ref writeShards()) unless 'shardLevels' is 0.
+   **/
+  bool writeFile(const QString &fileName, KFileInfo *item, int shardLevels);
+
+  /**
+   * Write directory 'dir' with URL 'url' to its shard file unless that is
+   * up to date already, and add the line for it to the manifest in
+   * 'buffer'.
+   **/
+  void writeShard(QByteArray &buffer, KDirInfo *dir, const QString &url);
+
+  /**
+   * Remove all shard files of 'fileName' that are not in 'keep'.
    **/
-  void writeTree(gzFile cache, KFileInfo *item);
+  static void removeShards(const QString &fileName,
+                           const QSet<QString> &keep = QSet<QString>());
+
+  struct WriteVisitor;
 
   /**
-   * Write 'item' to cache file 'cache' without recursion.
-   * Uses zlib to write gzip-compressed files.
+   * Write the subtree below and including 'item' to cache file 'cache'.
+   * Lines are collected in 'buffer'; whenever it is large enough, it is
+   * handed over to 'cache' as one member before the next directory line.
+   * See writeFile() for 'shardLevels'.
    **/
-  void writeItem(gzFile cache, KFileInfo *item);
+  void writeTree(KGzipMemberWriter &cache, QByteArray &buffer,
+                 KFileInfo *item, int shardLevels = 0);
 
   //
   // Data members
   //
 
   bool _ok;
+  int _shardLevels;
+
+  // While writing shards: where they go, which ones were written, and
+  // what they are written for
+
+  QString _fileName;
+  QSet<QString> _shardNames;
+  KDirTree *_tree;
+  QStringList _changedUrls;
+  bool _changesKnown;
+};
+
+/**
+ * Writes a cache file while the tree is still being read: The lines of
+ * each directory are written as soon as it is finalized, so the cache
+ * file is complete the moment reading is done, and no second pass over
+ * the tree is needed. Once written, the items are not needed for the
+ * cache any more, so they may be collapsed or discarded right away.
+ *
+ * The file is always in the text format. Directories are written in the
+ * order they are finalized, so a directory may come before its parent;
+ * only the toplevel directory is always the first one. @ref KCacheReader
+ * handles both.
+ *
+ * @short Cache file writer for a tree that is being read
+ **/
+class KCacheStreamWriter {
+public:
+  /**
+   * Constructor. 'toplevelUrl' is the URL of the toplevel directory of
+   * the tree that is being read.
+   **/
+  KCacheStreamWriter(const QString &toplevelUrl);
+
+  /**
+   * Destructor. Discards the file if @ref close() was not called.
+   **/
+  ~KCacheStreamWriter();
+
+  /**
+   * Start writing 'fileName'. Until @ref close(), everything goes to a
+   * new file next to it, so an existing cache file remains usable.
+   * Returns 'true' if OK.
+   **/
+  bool open(const QString &fileName);
+
+  /**
+   * Write directory 'dir' with all its non-directory children.
+   * Subdirectories are written when they are finalized themselves.
+   **/
+  void addDir(KDirInfo *dir);
+
+  /**
+   * Write the complete subtree below and including 'subtree' that was
+   * finished before it was added to the tree, e.g. read from a cache file.
+   **/
+  void addSubtree(KDirInfo *subtree);
+
+  /**
+   * The directory with URL 'url' is read again, e.g. because it is
+   * refreshed: Start a gzip member that replaces what was written for its
+   * subtree so far (see @ref KGzipMemberWriter::write()), so the lines
+   * added from now on are the only ones a reader uses. Returns 'false' if
+   * that is not possible, e.g. for the toplevel directory.
+   **/
+  bool replaceSubtree(const QString &url);
+
+  /**
+   * Finish the file and replace the old one with it. Returns 'true' if
+   * everything was written successfully.
+   **/
+  bool close();
+
+protected:
+  struct AddVisitor;
+
+  /**
+   * Append the lines of 'dir' with URL 'url' to the buffer and hand it
+   * over to _cache if it is large enough.
+   **/
+  void add(KDirInfo *dir, const QString &url);
+
+  KGzipMemberWriter _cache;
+  QString _fileName;
+  QString _toplevelUrl;
+  QByteArray _buffer;
+  int _headerSize;
+  bool _haveToplevel;
+  bool _open;
 };
 
 class KCacheReader : public QObject {
@@ -78,9 +285,20 @@ public:
   /**
    * Begin reading cache file 'fileName'. The cache file remains open
    * until this object is destroyed.
+   *
+   * This reads both the text format and the binary format (see @ref
+   * KBinaryCache); @ref checkHeader() tells them apart.
    **/
   KCacheReader(const QString &fileName, KDirTree *tree, KDirInfo *parent = 0);
 
+  /**
+   * Begin reading the subtree of directory 'path' from binary cache file
+   * 'cache' that is already mapped, e.g. one kept by @ref
+   * takeLazyCache(). 'cache' remains owned by the caller and has to stay
+   * open until this object is destroyed. Only for detached mode.
+   **/
+  KCacheReader(KBinaryCache *cache, const QString &path, KDirTree *tree);
+
   /**
    * Destructor
    **/
@@ -89,6 +307,7 @@ public:
   /**
    * Read at most maxLines from the cache file (check with eof() if the
    * end of file is reached yet) or the entire file (if maxLines is 0).
+   * For a binary cache file, this is the number of items.
    *
    * Returns true if OK and there is more to read, false otherwise.
    **/
@@ -100,6 +319,107 @@ public:
    **/
   bool eof();
 
+  /**
+   * Read into a new subtree that nobody else can see rather than into the
+   * tree, so this reader can run in a thread of its own: Nothing in the
+   * tree is touched, and no signals are sent. If 'asRoot' is 'true', the
+   * subtree will become the root of the tree; its name is then its full
+   * path, otherwise only the last path component.
+   *
+   * Directories are excluded according to a copy of 'excludeRules' that
+   * belongs to this reader alone (see @ref KExcludeRules), so call this in
+   * the thread that uses 'excludeRules'. That is usually the GUI thread
+   * with the global ones.
+   *
+   * Call this before reading anything. Get the result with
+   * @ref takeSubtree().
+   **/
+  void setDetached(bool asRoot, const KExcludeRules &excludeRules);
+
+  /**
+   * Binary cache files: Read only 'levels' levels of directories below the
+   * toplevel directory. Deeper directories become aggregates (see @ref
+   * KDirInfo::isAggregate()) with the totals recorded in the file, so
+   * opening even a huge cache file takes hardly any time. 0 reads
+   * everything. Text cache files are always read completely.
+   *
+   * Call this before reading anything.
+   **/
+  void setLazyLevels(int levels) { _lazyLevels = levels; }
+
+  /**
+   * Detached mode: Read the members of a multi-member cache file and the
+   * shards of a manifest in a thread pool of their own ('true', the
+   * default) or one after the other in the calling thread ('false'). The
+   * latter is for readers that already run in parallel with many others,
+   * so they don't multiply the number of threads.
+   *
+   * Call this before reading anything.
+   **/
+  void setParallel(bool parallel) { _parallel = parallel; }
+
+  /**
+   * Hand over the mapped binary cache file to the caller if any
+   * directories were left unread (see @ref setLazyLevels()), so they can
+   * be read later on. Returns 0 otherwise. Call this when reading is done.
+   **/
+  KBinaryCache *takeLazyCache();
+
+  /**
+   * Hand over the shards of a manifest (see @ref
+   * KCacheWriter::writeShards()) that were left unread: directory URL ->
+   * shard file. Call this when reading is done.
+   **/
+  QHash<QString, QString> takeLazyShards();
+
+  /**
+   * Returns the directory levels of the shards of the manifest that was
+   * read or 0 if it was no manifest. Only call this when reading is done.
+   **/
+  int shardLevels() const { return _shardLevels; }
+
+  /**
+   * Read the subtree of directory 'path' from shard file 'fileName' into
+   * a new subtree that nobody else can see yet, excluding directories
+   * according to 'excludeRules' (see @ref setDetached()). Returns 0 if the
+   * file can't be read or is about something else.
+   **/
+  static KDirInfo *readShard(const QString &fileName, const QString &path,
+                             KDirTree *tree,
+                             const KExcludeRules &excludeRules);
+
+  /**
+   * Detached mode: Finalize and sum up the subtree that was read and hand
+   * it over to the caller. Returns 0 if nothing was read. Call this from
+   * the thread that did the reading.
+   **/
+  KDirInfo *takeSubtree();
+
+  /**
+   * Returns the full path of the toplevel directory that was read so far
+   * or an empty string if there is none yet. In detached mode, only call
+   * this when reading is done.
+   **/
+  QString toplevelPath() const { return _toplevelPath; }
+
+  /**
+   * Stop reading as soon as possible. Safe to call from any thread.
+   **/
+  void cancel() { _canceled.store(true, std::memory_order_relaxed); }
+
+  /**
+   * Returns the number of bytes of the cache file read so far. Safe to call
+   * from any thread.
+   **/
+  qint64 bytesRead() const {
+    return _bytesRead.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Returns the size of the cache file.
+   **/
+  qint64 totalBytes() const { return _totalBytes; }
+
   /**
    * Returns true if writing the cache file went OK.
    **/
@@ -126,31 +446,20 @@ public:
   QString firstDir();
 
   /**
-   * Returns the tree associated with this reader.
+   * Returns the name of the cache file.
    **/
-  KDirTree *tree() const { return _tree; }
+  const QString &fileName() const { return _fileName; }
 
   /**
-   * Skip leading whitespace from a string.
-   * Returns a pointer to the first character that is non-whitespace.
-   **/
-  static char *skipWhiteSpace(char *cptr);
-
-  /**
-   * Find the next whitespace in a string.
-   *
-   * Returns a pointer to the next whitespace character
-   * or a null pointer if there is no more whitespace in the string.
+   * Returns the tree associated with this reader.
    **/
-  static char *findNextWhiteSpace(char *cptr);
+  KDirTree *tree() const { return _tree; }
 
   /**
-   * Remove all trailing whitespace from a string - overwrite it with 0
-   * bytes.
-   *
-   * Returns the new string length.
+   * Decompress and read member no. 'no' of a multi-member cache file.
+   * See @ref readMembers().
    **/
-  static void killTrailingWhiteSpace(char *cptr);
+  void readMember(const KGzipMemberReader &members, int no);
 
 signals:
 
@@ -171,7 +480,87 @@ signals:
 
 protected:
   /**
-   * Check this cache's header (see if it is a KDirStat cache at all)
+   * Reader for one member of the multi-member cache file that 'master'
+   * reads. It collects the directories whose parent is not in its member
+   * in _unconnectedDirs.
+   **/
+  KCacheReader(KCacheReader *master);
+
+  /**
+   * Initialize all data members. Used by all constructors.
+   **/
+  void init(const QString &fileName, KDirTree *tree, KDirInfo *parent);
+
+  /**
+   * Read all members of a multi-member cache file in parallel and connect
+   * the results. Only for detached mode.
+   **/
+  void readMembers(const KGzipMemberReader &members);
+
+  /**
+   * Find the subtrees that are replaced by later members of a multi-member
+   * cache file (see @ref KCacheWriter::spliceCache()), so reading the file
+   * line by line skips them just like @ref readMembers() does.
+   **/
+  void readReplacedDirs();
+
+  /**
+   * Detached mode: Insert the directories that came before their parent
+   * into it. Directories whose parent is excluded or not in the file at
+   * all are discarded.
+   **/
+  void connectDirs();
+
+  /**
+   * Read the shards of a manifest when everything else is read: in
+   * parallel, each replacing the directory it is about. Those deeper than
+   * the lazy levels (see @ref setLazyLevels()) and all of them if this is
+   * not in detached mode are left unread; the directories become
+   * aggregates with the totals from the manifest instead.
+   **/
+  void readShards();
+
+  /**
+   * The totals of a directory whose content is not read, see @ref
+   * KCacheWriter::writeTotals()
+   **/
+  struct Totals {
+    KFileSize totalSize;
+    KFileSize totalBlocks;
+    KFileCount totalItems;
+    KFileCount totalSubDirs;
+    KFileCount totalFiles;
+    time_t latestMtime;
+  };
+
+  /**
+   * Parse the value of a "totals:" field into 'totals'. A 0 'str' means
+   * all 0.
+   **/
+  static void parseTotals(char *str, Totals &totals);
+
+  /**
+   * Turn 'dir' into an aggregate with 'totals' (see @ref
+   * KDirInfo::setAggregate()).
+   **/
+  static void setAggregate(KDirInfo *dir, const Totals &totals);
+
+  /**
+   * Returns the directory read so far with full path 'path' or 0.
+   **/
+  KDirInfo *findDir(const QString &path) const;
+
+  /**
+   * Returns 'true' if directory 'path' of the member being read is
+   * replaced by a later member of the file (see @ref
+   * KCacheWriter::spliceCache()).
+   **/
+  bool isReplaced(const QString &path) const;
+
+  /**
+   * Check this cache's header (see if it is a KDirStat cache at all).
+   * If it is a binary cache file, this switches to reading it with
+   * _binary.
    **/
   bool checkHeader();
 
@@ -180,12 +569,56 @@ protected:
    **/
   void addItem();
 
+  /**
+   * Read at most 'maxItems' items from the binary cache file.
+   **/
+  bool readBinary(int maxItems);
+
+  /**
+   * Add node no. 'node' of the binary cache file to _tree.
+   **/
+  void addBinaryItem(uint32_t node);
+
+  /**
+   * Find the directory with full path 'path' in the tree, e.g. the parent
+   * of the toplevel directory of this cache. Returns 0 if there is none.
+   * In detached mode, this only searches the subtree read so far.
+   **/
+  KDirInfo *locateParent(const QString &path);
+
+  /**
+   * Create a directory below 'parent' (0 for a new root), handling the
+   * exclude rules. 'fullPath' is the directory's full path.
+   **/
+  KDirInfo *addDir(KDirInfo *parent, const QString &name,
+                   const QString &fullPath, mode_t mode, KFileSize size,
+                   time_t mtime);
+
+  /**
+   * Create a non-directory item below 'parent'.
+   **/
+  void addFile(KDirInfo *parent, const QString &name, mode_t mode,
+               KFileSize size, time_t mtime, KFileSize blocks, int links);
+
   /**
    * Read the next line that is not empty or a comment and store it in _line.
    * Returns true if OK, false if error.
    **/
   bool readLine();
 
+  /**
+   * Returns the next raw line from _block, 0-terminated in place, reading
+   * more of the file as needed, or 0 at the end of the file. There is no
+   * limit for the length of a line. _lineEnd is set to the terminating 0
+   * byte.
+   **/
+  char *nextLine();
+
+  /**
+   * Returns true if all lines of a text cache file have been read.
+   **/
+  bool atEnd() const { return _blockEof && _blockPos >= _blockEnd; }
+
   /**
    * split the current input line into fields separated by whitespace.
    **/
@@ -208,8 +641,14 @@ protected:
 
   KDirTree *_tree;
   gzFile _cache;
-  char _buffer[MAX_CACHE_LINE_LEN];
+  char *_block;         // decompressed data, 1 byte more than _blockSize
+  size_t _blockSize;
+  size_t _blockPos;     // start of the next line in _block
+  size_t _blockEnd;     // end of the valid data in _block
+  qint64 _blockOffset;  // offset of _block in the uncompressed file
+  bool _blockEof;       // the whole file is in _block or already read
   char *_line;
+  char *_lineEnd;
   int _lineNo;
   QString _fileName;
   char *_fields[MAX_FIELDS_PER_LINE];
@@ -219,6 +658,70 @@ protected:
   KDirInfo *_lastDir;
   KDirInfo *_lastExcludedDir;
   QString _lastExcludedDirUrl;
+  KExcludeRules *_excludeRules; // the global ones unless detached
+  bool _ownsExcludeRules;
+  QString _toplevelPath;
+  QHash<QString, KDirInfo *> _dirs; // full path -> directory read so far
+  bool _detached;
+  bool _asRoot;
+  KCacheReader *_master; // 0 unless this reads one member for another reader
+
+  // Directories whose parent was not read yet, e.g. because it is in an
+  // earlier member or comes later in the file
+
+  struct UnconnectedDir {
+    KDirInfo *dir;
+    QString parentPath;
+  };
+
+  std::vector<UnconnectedDir> _unconnectedDirs;
+
+  // Multi-member cache files: The member being read and, in the master,
+  // the subtrees that were replaced and the last member replacing each.
+  // Reading line by line, the member is found by its offset.
+
+  int _memberNo;
+  QHash<QString, int> _replacedDirs;
+  QVector<qint64> _memberOffsets; // in the uncompressed file
+
+  // Manifests: The directories that are in shard files
+
+  struct PendingShard {
+    KDirInfo *dir;
+    QString path;
+    QString fileName;
+    Totals totals; // from the manifest
+  };
+
+  std::vector<PendingShard> _shards;
+  QHash<QString, QString> _lazyShards;
+  int _shardLevels;
+
+  std::atomic<bool> _canceled;
+  std::atomic<qint64> _bytesRead;
+  qint64 _totalBytes;
+
+  // Binary cache files: The directories whose children are still to be
+  // read (in the order of the node table) and the one being read now
+
+  struct PendingDir {
+    KDirInfo *dir;
+    uint32_t node;
+    QString path;
+    int depth; // directory levels below _startNode
+  };
+
+  KBinaryCache *_binary; // 0 for text cache files
+  bool _ownsBinary;
+  uint32_t _startNode;   // the toplevel directory of this reader
+  QString _startPath;    // its full path unless it is node no. 0
+  int _lazyLevels;
+  bool _parallel;
+  bool _haveLazyDirs;
+  std::deque<PendingDir> _pendingDirs;
+  PendingDir _currentDir;
+  uint32_t _nextNode;
+  uint32_t _endNode;
 };
 
 } // namespace KDirStat
@@ -98,6 +98,12 @@ public:
     removeRow(tr.row(), parent(tr));
   }
 
+  void removeChildren(KFileInfo* file) {
+    QModelIndex tr = fileToIndex(file, false);
+    if(tr.isValid())
+      removeRows(0, rowCount(tr), tr);
+  }
+
   void updateData(QModelIndex r = QModelIndex()) {
     QModelIndex end = sibling(r.row(), columnCount() - 1, r);
     emit dataChanged(r, end);
@@ -324,14 +330,14 @@ public:
         QApplication::style()->drawItemText(
             painter, option.rect, Qt::AlignRight, view->palette(), true, t);
       }
-    } else if (item->treeLevel() > 0) {
+    } else if (item->parent()) {
+      int level = item->treeLevel();
       QStyleOptionProgressBar o;
       o.rect = option.rect;
       o.minimum = 0;
       o.maximum = 100;
       o.progress = 100 * item->totalSize() / item->parent()->totalSize();
-      o.palette.setColor(QPalette::Highlight,
-                         view->fillColor(item->treeLevel() - 1));
+      o.palette.setColor(QPalette::Highlight, view->fillColor(level - 1));
       if (view->selection() != item)
         o.palette.setColor(QPalette::Base, view->palette().base().color());
       style->drawControl(QStyle::CE_ProgressBar, &o, painter);
@@ -451,6 +457,8 @@ KDirTreeView::KDirTreeView(QWidget *parent):
           SLOT(resizeIndexToContents(const QModelIndex &)));
   connect(this, SIGNAL(collapsed(const QModelIndex &)), this,
           SLOT(resizeIndexToContents(const QModelIndex &)));
+  connect(this, SIGNAL(expanded(const QModelIndex &)), this,
+          SLOT(expandAggregate(const QModelIndex &)));
 
   _contextInfo = new QMenu(this);
   infoAction = new QAction(_contextInfo);
@@ -544,6 +552,9 @@ void KDirTreeView::createTree() {
   connect(_tree, SIGNAL(deletingChild(KFileInfo *)), this,
           SLOT(deleteChild(KFileInfo *)));
 
+  connect(_tree, SIGNAL(collapsingSubtree(KFileInfo *)), this,
+          SLOT(collapsingSubtree(KFileInfo *)));
+
   connect(_tree, SIGNAL(startingReading()), this, SLOT(prepareReading()));
 
   connect(_tree, SIGNAL(finished()), this, SLOT(slotFinished()));
@@ -656,6 +667,19 @@ void KDirTreeView::deleteChild(KFileInfo *clone) {
   model()->removeFile(clone);
 }
 
+void KDirTreeView::collapsingSubtree(KFileInfo *subtree) {
+  QModelIndex idx = model()->fileToIndex(subtree, false);
+  if(idx.isValid())
+    collapse(proxyModel()->mapFromSource(idx));
+  model()->removeChildren(subtree);
+}
+
+void KDirTreeView::expandAggregate(const QModelIndex &index) {
+  KFileInfo *item = model()->indexToFile(proxyModel()->mapToSource(index));
+  if(item->isAggregate())
+    _tree->expandAggregate(item);
+}
+
 void KDirTreeView::updateSummary() {
   model()->updateData();
   bool se = isSortingEnabled();
@@ -1120,7 +1144,7 @@ QString formatTime(long millisec, bool showMilliSeconds) {
   return formattedTime;
 }
 
-QString formatCount(int count, bool suppressZero) {
+QString formatCount(KFileCount count, bool suppressZero) {
   if (suppressZero && count == 0)
     return "";
 
@@ -300,6 +300,17 @@ protected slots:
    **/
   void deleteChild(KFileInfo *newChild);
 
+  /**
+   * Remove the clones of all children of 'subtree' which is about to be
+   * collapsed into an aggregate.
+   **/
+  void collapsingSubtree(KFileInfo *subtree);
+
+  /**
+   * Read the content of an aggregate again when the user expands it.
+   **/
+  void expandAggregate(const QModelIndex &index);
+
   /**
    * Recursively update the visual representation of the summary fields.
    * This update is as lazy as possible for optimum performance since it
@@ -504,7 +515,7 @@ QString formatTime(long millisec, bool showMilliSeconds = false);
  * Returns an empty string if 'suppressZero' is 'true' and the value of
  * 'count' is 0.
  **/
-QString formatCount(int count, bool suppressZero = false);
+QString formatCount(KFileCount count, bool suppressZero = false);
 
 /**
  * Format percentages.
@@ -27,6 +27,11 @@ bool KExcludeRule::match(const QString &text) {
   return _regexp.exactMatch(text);
 }
 
+KExcludeRules::KExcludeRules(const KExcludeRules &other) {
+  foreach (KExcludeRule *rule, other._rules)
+    _rules.append(new KExcludeRule(*rule));
+}
+
 KExcludeRules::~KExcludeRules() {
   foreach (KExcludeRule *rule, _rules)
     delete rule;
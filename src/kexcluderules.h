@@ -86,6 +86,14 @@ public:
    **/
   KExcludeRules() {}
 
+  /**
+   * Copy constructor: A deep copy of all rules of 'other', e.g. for
+   * matching in another thread. Matching changes the state of a rule's
+   * regular expression, so threads must not share rules. Make the copy in
+   * the thread that uses 'other'.
+   **/
+  KExcludeRules(const KExcludeRules &other);
+
   /**
    * Destructor.
    **/
@@ -128,6 +136,8 @@ public:
   const QList<KExcludeRule *> &rules() const { return _rules; }
 
 private:
+  KExcludeRules &operator=(const KExcludeRules &) = delete;
+
   QList<KExcludeRule *> _rules;
 };
 
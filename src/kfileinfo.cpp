@@ -6,9 +6,12 @@
 
 #include "kdirinfo.h"
 #include "kfileinfo.h"
+#include "knodearena.h"
+#include "ktreewalk.h"
 #include <KLocalizedString>
 #include <QDir>
 #include <QFileInfo>
+#include <QVarLengthArray>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -22,7 +25,21 @@
 
 using namespace KDirStat;
 
+void *KFileInfo::operator new(size_t size) {
+  void *ptr = KNodeArena::instance()->allocate(size);
+
+  return ptr ? ptr : ::operator new(size);
+}
+
+void KFileInfo::operator delete(void *ptr, size_t size) {
+  if (!KNodeArena::instance()->release(ptr, size))
+    ::operator delete(ptr);
+}
+
 KFileInfo::KFileInfo(KDirInfo *parent, const char *name) : _parent(parent) {
+  _treeLevel = parent ? storedTreeLevel(parent->treeLevel() + 1) : 0;
+  _slot = 0;
+  _isDirInfo = false;
   _isLocalFile = true;
   _isSparseFile = false;
   _name = name ? name : "";
@@ -38,6 +55,9 @@ KFileInfo::KFileInfo(const QString &filenameWithoutPath, struct stat *statInfo,
                      KDirInfo *parent): _parent(parent) {
   Q_CHECK_PTR(statInfo);
 
+  _treeLevel = parent ? storedTreeLevel(parent->treeLevel() + 1) : 0;
+  _slot = 0;
+  _isDirInfo = false;
   _isLocalFile = true;
   _name = filenameWithoutPath;
 
@@ -82,6 +102,9 @@ KFileInfo::KFileInfo(const KFileItem *fileItem, KDirInfo *parent)
     : _parent(parent) {
   Q_CHECK_PTR(fileItem);
 
+  _treeLevel = parent ? storedTreeLevel(parent->treeLevel() + 1) : 0;
+  _slot = 0;
+  _isDirInfo = false;
   _isLocalFile = fileItem->isLocalFile();
   _name = parent ? fileItem->name() : fileItem->url().url();
   _device = 0;
@@ -117,6 +140,9 @@ KFileInfo::KFileInfo(KDirInfo *parent,
                      KFileSize size, time_t mtime, KFileSize blocks,
                      nlink_t links)
     : _parent(parent) {
+  _treeLevel = parent ? storedTreeLevel(parent->treeLevel() + 1) : 0;
+  _slot = 0;
+  _isDirInfo = false;
   _name = filenameWithoutPath;
   _isLocalFile = true;
   _mode = mode;
@@ -150,18 +176,36 @@ KFileSize KFileInfo::size() const {
 }
 
 QString KFileInfo::url() const {
-  if (_parent) {
-    QString parentUrl = _parent->url();
-
-    if (isDotEntry()) // don't append "/." for dot entries
-      return parentUrl;
-
-    if (parentUrl == "/") // avoid duplicating slashes
-      return parentUrl + _name;
-    else
-      return parentUrl + "/" + _name;
-  } else
-    return _name;
+  QString url;
+  buildUrl(url);
+
+  return url;
+}
+
+void KFileInfo::buildUrl(QString &buffer) const {
+  // Collect the path from the top of the tree down to this item. Dot
+  // entries don't add anything to the URL.
+
+  QVarLengthArray<const KFileInfo *, 64> path;
+  int length = 0;
+
+  for (const KFileInfo *item = this; item; item = item->parent()) {
+    if (!item->isDotEntry()) {
+      path.append(item);
+      length += item->_name.length() + 1;
+    }
+  }
+
+  buffer.resize(0); // keeps the allocated storage
+  buffer.reserve(length);
+
+  for (int i = path.size() - 1; i >= 0; i--) {
+    if (i < path.size() - 1 &&
+        !(buffer.length() == 1 && buffer.at(0) == '/')) // avoid duplicating slashes
+      buffer += '/';
+
+    buffer += path[i]->_name;
+  }
 }
 
 QString KFileInfo::debugUrl() const {
@@ -169,7 +213,7 @@ QString KFileInfo::debugUrl() const {
 }
 
 QString KFileInfo::urlPart(int targetLevel) const {
-  int level = treeLevel(); // Cache this - it's expensive!
+  int level = treeLevel();
 
   if (level < targetLevel) {
     qCritical() << Q_FUNC_INFO << "URL level " << targetLevel
@@ -187,21 +231,55 @@ QString KFileInfo::urlPart(int targetLevel) const {
   return item->name();
 }
 
-int KFileInfo::treeLevel() const {
+/**
+ * Pre-order traversal that sets the tree level of each item below the top
+ * from that of its parent.
+ **/
+struct KFileInfo::LevelVisitor : public KTreeVisitor {
+  KDirInfo *top;
+
+  LevelVisitor(KDirInfo *top) : top(top) {}
+
+  bool enterDir(KDirInfo *dir) {
+    if (dir != top)
+      dir->_treeLevel = storedTreeLevel(dir->parent()->treeLevel() + 1);
+
+    return true;
+  }
+
+  void visitFile(KFileInfo *file) {
+    file->_treeLevel = storedTreeLevel(file->parent()->treeLevel() + 1);
+  }
+};
+
+int KFileInfo::countTreeLevel() const {
   int level = 0;
-  KFileInfo *parent = _parent;
 
-  while (parent) {
+  for (const KFileInfo *item = parent(); item; item = item->parent())
     level++;
-    parent = parent->parent();
-  }
 
   return level;
+}
 
-  if (_parent)
-    return _parent->treeLevel() + 1;
-  else
-    return 0;
+void KFileInfo::setParent(KDirInfo *newParent) {
+  unsigned level = newParent ? storedTreeLevel(newParent->treeLevel() + 1) : 0;
+  _parent = newParent;
+
+  // If the stored level doesn't change, neither does that of any item
+  // below: Either the level really is the same, or it was and still is
+  // beyond MaxStoredTreeLevel, and so is everything below.
+
+  if (level == _treeLevel)
+    return;
+
+  _treeLevel = level;
+
+  // A subtree is moved or grafted from somewhere else.
+
+  if (isDirInfo()) {
+    LevelVisitor visitor(static_cast<KDirInfo *>(this));
+    walkTree(this, visitor);
+  }
 }
 
 bool KFileInfo::isInSubtree(const KFileInfo *subtree) const {
@@ -217,52 +295,47 @@ bool KFileInfo::isInSubtree(const KFileInfo *subtree) const {
   return false;
 }
 
-KFileInfo *KFileInfo::locate(QString url, bool findDotEntries) {
+KFileInfo *KFileInfo::locate(const QString &url, bool findDotEntries) {
   if (!url.startsWith(_name))
     return 0;
-  else // URL starts with this node's name
+
+  int pos = _name.length(); // Skip leading name of this node
+
+  if (pos == url.length()) // Nothing left?
+    return this;           // Hey! That's us!
+
+  if (url.at(pos) == '/') // If the next thing a path delimiter,
+    pos++;                // skip that leading delimiter.
+  else                    // No path delimiter at the beginning
   {
-    url.remove(0, _name.length()); // Remove leading name of this node
-
-    if (url.length() == 0) // Nothing left?
-      return this;         // Hey! That's us!
-
-    if (url.startsWith("/")) // If the next thing a path delimiter,
-      url.remove(0, 1);      // remove that leading delimiter.
-    else                     // No path delimiter at the beginning
-    {
-      if (_name.right(1) != "/" && // and this is not the root directory
-          !isDotEntry())           // or a dot entry:
-        return 0;                  // This can't be any of our children.
-    }
+    if (!_name.endsWith('/') && // and this is not the root directory
+        !isDotEntry())          // or a dot entry:
+      return 0;                 // This can't be any of our children.
+  }
 
-    // Search all children
+  // Split the rest of the URL only once and then descend one tree level
+  // per path component.
 
-    for(size_t i = 0; i < numChildren(); i++) {
-      KFileInfo *foundChild = this->child(i)->locate(url, findDotEntries);
-      if (foundChild)
-        return foundChild;
-    }
+  QVector<QStringRef> components =
+      url.midRef(pos).split('/', QString::SkipEmptyParts);
+  KFileInfo *current = this;
+
+  for (int i = 0; i < components.size(); i++) {
+    const QStringRef &component = components.at(i);
 
     // Special case: The dot entry is requested.
 
-    if (findDotEntries && dotEntry() && url == "<Files>")
-      return dotEntry();
+    if (findDotEntries && i == components.size() - 1 &&
+        component == QLatin1String("<Files>") && current->dotEntry())
+      return current->dotEntry();
 
-    // Search the dot entry if there is one - but only if there is no more
-    // path delimiter left in the URL. The dot entry contains files only,
-    // and their names may not contain the path delimiter, nor can they
-    // have children. This check is not strictly necessary, but it may
-    // speed up things a bit if we don't search the non-directory children
-    // if the rest of the URL consists of several pathname components.
+    current = current->findChild(component);
 
-    if (dotEntry() && url.indexOf('/') < 0) // No (more) "/" in this URL
-    {
-      return dotEntry()->locate(url, findDotEntries);
-    }
+    if (!current)
+      return 0;
   }
 
-  return 0;
+  return current;
 }
 
 QUrl KDirStat::fixedUrl(const QString &dirtyUrl) {
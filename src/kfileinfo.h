@@ -29,6 +29,11 @@ typedef long long KFileSize;
 // This is how much bytes this program can handle.
 #define KFileSizeMax 9223372036854775807LL
 
+// Number of items in a subtree. Merging caches of large volumes easily
+// gets beyond the 2 billion an 'int' can count. Only directories store
+// such totals, so this doesn't make plain file items any larger.
+typedef long long KFileCount;
+
 // Forward declarations
 class KDirInfo;
 class KDirTree;
@@ -100,6 +105,13 @@ public:
 
   virtual ~KFileInfo() {};
 
+  /**
+   * Allocate items in the node file (see @ref KNodeArena) if there is
+   * one, on the heap otherwise.
+   **/
+  static void *operator new(size_t size);
+  static void operator delete(void *ptr, size_t size);
+
   /**
    * Returns whether or not this is a local file (protocol "file:").
    * It might as well be a remote file ("ftp:", "smb:" etc.).
@@ -123,11 +135,18 @@ public:
    * Returns the full URL of this object with full path and protocol
    * (unless the protocol is "file:").
    *
-   * This is a (somewhat) expensive operation since it will recurse up
-   * to the top of the tree.
+   * This walks up to the top of the tree once and builds the URL with a
+   * single allocation. Use @ref buildUrl() with a reusable buffer or a
+   * @ref KUrlStack in loops.
    **/
   QString url() const;
 
+  /**
+   * Like @ref url(), but store the URL in 'buffer', reusing its storage
+   * if it is large enough.
+   **/
+  void buildUrl(QString &buffer) const;
+
   /**
    * Very much like @ref KFileInfo::url(), but with "/<Files>" appended
    * if this is a dot entry. Useful for debugging.
@@ -232,21 +251,21 @@ public:
    * Returns the total number of children in this subtree, excluding this item.
    * Derived classes that have children should overwrite this.
    **/
-  virtual int totalItems() { return 0; }
+  virtual KFileCount totalItems() { return 0; }
 
   /**
    * Returns the total number of subdirectories in this subtree,
    * excluding this item. Dot entries and "." or ".." are not counted.
    * Derived classes that have children should overwrite this.
    **/
-  virtual int totalSubDirs() { return 0; }
+  virtual KFileCount totalSubDirs() { return 0; }
 
   /**
    * Returns the total number of plain file children in this subtree,
    * excluding this item.
    * Derived classes that have children should overwrite this.
    **/
-  virtual int totalFiles() { return 0; }
+  virtual KFileCount totalFiles() { return 0; }
 
   /**
    * Returns the latest modification time of this subtree.
@@ -260,6 +279,14 @@ public:
    **/
   virtual bool isExcluded() const { return false; }
 
+  /**
+   * Returns 'true' if this is an aggregate, i.e. a directory whose
+   * subtree was discarded to save memory and of which only the totals are
+   * still known. Its content has to be read again to show it.
+   * Derived classes may want to overwrite this.
+   **/
+  virtual bool isAggregate() const { return false; }
+
   /**
    * Set the 'excluded' status.
    *
@@ -324,9 +351,24 @@ public:
   KDirInfo *parent() const { return _parent; }
 
   /**
-   * Set the "parent" pointer.
+   * Set the "parent" pointer. This also updates the tree level of this
+   * item and, if that changes, of everything below it: Subtrees that were
+   * built on their own (e.g. by a cache reader) start at level 0.
+   **/
+  void setParent(KDirInfo *newParent);
+
+  /**
+   * Returns the index of this item in its parent's children list.
+   * This is maintained by the parent; it is meaningless for items that
+   * are not in any children list (toplevel items and dot entries).
    **/
-  void setParent(KDirInfo *newParent) { _parent = newParent; }
+  size_t slot() const { return _slot; }
+
+  /**
+   * Set the index of this item in its parent's children list.
+   * Only the parent should call this.
+   **/
+  void setSlot(size_t slot) { _slot = slot; }
 
   virtual size_t numChildren() const { return 0; }
   virtual KFileInfo * child(size_t) { return nullptr; }
@@ -346,17 +388,25 @@ public:
    * Locate a child somewhere in this subtree whose URL (i.e. complete
    * path) matches the URL passed. Returns 0 if there is no such child.
    *
-   * Notice: This is a very expensive operation since the entire subtree
-   * is searched recursively.
-   *
-   * Derived classes might or might not wish to overwrite this method;
-   * it's only advisable to do so if a derived class comes up with a
-   * different method than brute-force search all children.
+   * The URL is split into its path components only once; each component
+   * is then looked up with @ref findChild(), i.e. this takes one
+   * (hashed for large directories) lookup per tree level.
    *
    * 'findDotEntries' specifies if locating "dot entries" (".../<Files>")
    * is desired.
    **/
-  virtual KFileInfo *locate(QString url, bool findDotEntries = false);
+  virtual KFileInfo *locate(const QString &url, bool findDotEntries = false);
+
+  /**
+   * Find a direct child (or a child of the dot entry) named 'name'.
+   * Returns 0 if there is no such child.
+   *
+   * This default implementation always returns 0.
+   **/
+  virtual KFileInfo *findChild(const QStringRef &name) {
+    NOT_USED(name);
+    return nullptr;
+  }
 
   /**
    * Insert a child into the children list.
@@ -398,10 +448,15 @@ public:
    * Returns the tree level (depth) of this item.
    * The topmost level is 0.
    *
-   * This is a (somewhat) expensive operation since it will recurse up
-   * to the top of the tree.
-   **/
-  int treeLevel() const;
+   * This is a cheap operation: The level is stored in the item and kept
+   * up to date by @ref setParent(). Only levels from MaxStoredTreeLevel on
+   * don't fit into the stored field; for those, the stored level sticks
+   * at MaxStoredTreeLevel and the real one is counted up to the root.
+   **/
+  int treeLevel() const {
+    return _treeLevel < MaxStoredTreeLevel ? int(_treeLevel)
+                                           : countTreeLevel();
+  }
 
   /**
    * Notification that a child has been added somewhere in the subtree.
@@ -433,10 +488,10 @@ public:
    * is a disk directory! Both should return the same, but you'll never
    * know - better be safe than sorry!
    *
-   * This default implementation always returns 'false'. Derived classes
-   * (in particular, those derived from @ref KDirInfo) should overwrite this.
+   * This is a plain flag rather than a virtual method so tree traversals
+   * can dispatch on the node kind without a virtual call.
    **/
-  virtual bool isDirInfo() const { return false; }
+  bool isDirInfo() const { return _isDirInfo; }
 
   /**
    * Returns true if this is a sparse file, i.e. if this file has
@@ -519,6 +574,9 @@ protected:
   QString _name;          // the file name (without path!)
   bool _isLocalFile : 1;  // flag: local or remote file?
   bool _isSparseFile : 1; // (cache) flag: sparse file (file with "holes")?
+  bool _isDirInfo : 1;    // flag: is this a KDirInfo?
+  unsigned _treeLevel : 29; // (cache) depth in the tree, 0 for the root
+  unsigned _slot;           // index in the parent's children list
   dev_t _device;          // device this object resides on
   mode_t _mode;           // file permissions + object type
   nlink_t _links;         // number of links
@@ -527,6 +585,24 @@ protected:
   time_t _mtime;          // modification time
 
   KDirInfo *_parent; // pointer to the parent entry
+
+private:
+  static const unsigned MaxStoredTreeLevel = (1u << 29) - 1;
+
+  /**
+   * Returns 'level' clamped to what fits into _treeLevel.
+   **/
+  static unsigned storedTreeLevel(int level) {
+    return unsigned(level) < MaxStoredTreeLevel ? unsigned(level)
+                                                : MaxStoredTreeLevel;
+  }
+
+  /**
+   * Count the levels up to the root.
+   **/
+  int countTreeLevel() const;
+
+  struct LevelVisitor;
 }; // class KFileInfo
 
 //----------------------------------------------------------------------
@@ -0,0 +1,401 @@
+/*
+ *   Summary:	Multi-member gzip files for the KDirStat cache
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kgzipmembers.h"
+#include <QDebug>
+#include <QFile>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThread>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// A member header as written here: the fixed part (10 bytes), XLEN (2),
+// the "KD" subfield header (4) and its data (compressed size and
+// uncompressed size, 4 bytes each). An optional "KR" subfield may follow.
+#define GZIP_HEADER_SIZE 24
+
+// XLEN without a "KR" subfield
+#define GZIP_KD_XLEN 12
+
+// Longest "KR" subfield data that still fits into the extra field
+#define GZIP_MAX_REPLACES (0xffff - GZIP_KD_XLEN - 4)
+
+// CRC32 and uncompressed size
+#define GZIP_TRAILER_SIZE 8
+
+#define GZIP_FLAG_EXTRA 0x04
+
+using namespace KDirStat;
+
+static void putLE32(unsigned char *p, uint32_t value) {
+  p[0] = value & 0xff;
+  p[1] = (value >> 8) & 0xff;
+  p[2] = (value >> 16) & 0xff;
+  p[3] = (value >> 24) & 0xff;
+}
+
+static void putLE16(unsigned char *p, uint32_t value) {
+  p[0] = value & 0xff;
+  p[1] = (value >> 8) & 0xff;
+}
+
+static uint32_t getLE16(const unsigned char *p) { return p[0] | (p[1] << 8); }
+
+static uint32_t getLE32(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Compression of one member in a pool thread. The writer waits for the
+ * result in the order the members were started.
+ **/
+class KGzipMemberWriter::Task : public QRunnable {
+public:
+  Task(const QByteArray &data, const QByteArray &replaces)
+      : _data(data), _replaces(replaces) {
+    setAutoDelete(false);
+  }
+
+  void run() override {
+    _result = compressMember(_data, _replaces);
+    _data = QByteArray();
+    _done.release();
+  }
+
+  QByteArray wait() {
+    _done.acquire();
+    return _result;
+  }
+
+private:
+  QByteArray _data;
+  QByteArray _replaces;
+  QByteArray _result;
+  QSemaphore _done;
+};
+
+KGzipMemberWriter::KGzipMemberWriter()
+    : _file(0), _ok(false), _appendedTo(-1) {
+  int threads = QThread::idealThreadCount();
+  _pool.setMaxThreadCount(threads);
+
+  // Enough to keep all threads busy while the oldest member is written
+  _maxPending = 2 * threads;
+}
+
+KGzipMemberWriter::~KGzipMemberWriter() {
+  if (_file)
+    close();
+}
+
+bool KGzipMemberWriter::open(const QString &fileName, bool append) {
+  _fileName = fileName;
+  _file = fopen(QFile::encodeName(fileName).constData(), append ? "ab" : "wb");
+  _ok = _file != 0;
+  _appendedTo = -1;
+
+  if (_ok && append) {
+    if (fseeko(_file, 0, SEEK_END) == 0)
+      _appendedTo = ftello(_file);
+
+    _ok = _appendedTo >= 0;
+
+    if (!_ok) {
+      fclose(_file);
+      _file = 0;
+    }
+  }
+
+  if (!_ok)
+    qCritical() << "Can't open " << fileName << ": " << strerror(errno)
+                << endl;
+
+  return _ok;
+}
+
+void KGzipMemberWriter::write(const QByteArray &data,
+                              const QByteArray &replaces) {
+  if (!_file)
+    return;
+
+  Task *task = new Task(data, replaces);
+  _pending.append(task);
+  _pool.start(task);
+
+  while (_pending.size() > _maxPending)
+    writeOldest();
+}
+
+void KGzipMemberWriter::writeOldest() {
+  Task *task = _pending.takeFirst();
+  QByteArray member = task->wait();
+  delete task;
+
+  if (member.isEmpty())
+    _ok = false;
+
+  if (_ok && fwrite(member.constData(), member.size(), 1, _file) != 1)
+    _ok = false;
+}
+
+bool KGzipMemberWriter::close() {
+  if (!_file)
+    return false;
+
+  while (!_pending.isEmpty())
+    writeOldest();
+
+  if (fclose(_file) != 0)
+    _ok = false;
+
+  _file = 0;
+
+  if (!_ok) {
+    qCritical() << "Error writing " << _fileName << ": " << strerror(errno)
+                << endl;
+
+    // Don't leave a partial member behind what was there before.
+
+    if (_appendedTo >= 0 &&
+        truncate(QFile::encodeName(_fileName).constData(), _appendedTo) != 0)
+      qCritical() << "Can't restore " << _fileName << ": " << strerror(errno)
+                  << endl;
+  }
+
+  return _ok;
+}
+
+QByteArray KGzipMemberWriter::compressMember(const QByteArray &data,
+                                             const QByteArray &replaces) {
+  // Raw deflate: The header is written here, since the "KD" field needs
+  // the compressed size.
+
+  if (replaces.size() > GZIP_MAX_REPLACES)
+    return QByteArray();
+
+  uint32_t headerSize =
+      GZIP_HEADER_SIZE + (replaces.isEmpty() ? 0 : 4 + replaces.size());
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return QByteArray();
+
+  uLong bound = deflateBound(&stream, data.size());
+  QByteArray member(headerSize + bound + GZIP_TRAILER_SIZE, 0);
+  unsigned char *out = (unsigned char *)member.data();
+
+  stream.next_in = (Bytef *)data.constData();
+  stream.avail_in = data.size();
+  stream.next_out = out + headerSize;
+  stream.avail_out = bound;
+
+  int result = deflate(&stream, Z_FINISH);
+  uint32_t size = headerSize + stream.total_out + GZIP_TRAILER_SIZE;
+  deflateEnd(&stream);
+
+  if (result != Z_STREAM_END)
+    return QByteArray();
+
+  static const unsigned char header[] = {
+      0x1f, 0x8b, Z_DEFLATED, GZIP_FLAG_EXTRA, // magic, method, flags
+      0,    0,    0,          0,               // mtime: none
+      0,    3,                                 // extra flags, OS: Unix
+      12,   0,                                 // XLEN
+      'K',  'D',  8,          0};              // subfield ID and length
+
+  memcpy(out, header, sizeof(header));
+  putLE16(out + 10, headerSize - 12);
+  putLE32(out + 16, size);
+  putLE32(out + 20, data.size());
+
+  if (!replaces.isEmpty()) {
+    unsigned char *field = out + GZIP_HEADER_SIZE;
+    field[0] = 'K';
+    field[1] = 'R';
+    putLE16(field + 2, replaces.size());
+    memcpy(field + 4, replaces.constData(), replaces.size());
+  }
+
+  putLE32(out + size - 8,
+          crc32(0, (const Bytef *)data.constData(), data.size()));
+  putLE32(out + size - 4, data.size());
+  member.resize(size);
+
+  return member;
+}
+
+KGzipMemberReader::KGzipMemberReader() : _fd(-1) {}
+
+KGzipMemberReader::~KGzipMemberReader() { close(); }
+
+/**
+ * pread() all of 'size' bytes. Returns 'false' on error or at the end of
+ * the file.
+ **/
+static bool readFully(int fd, void *buffer, size_t size, off_t offset) {
+  char *pos = (char *)buffer;
+
+  while (size > 0) {
+    ssize_t len = pread(fd, pos, size, offset);
+
+    if (len < 0 && errno == EINTR)
+      continue;
+
+    if (len <= 0)
+      return false;
+
+    pos += len;
+    size -= len;
+    offset += len;
+  }
+
+  return true;
+}
+
+/**
+ * Read the subfields after the "KD" field ('size' bytes at 'offset') and
+ * store the data of the "KR" field, if there is one, in 'replaces'.
+ * Returns 'false' if they are broken.
+ **/
+static bool readReplaces(int fd, off_t offset, uint32_t size,
+                         QByteArray &replaces) {
+  QByteArray fields(size, 0);
+  const unsigned char *field = (const unsigned char *)fields.constData();
+
+  if (!readFully(fd, fields.data(), size, offset))
+    return false;
+
+  while (size > 0) {
+    if (size < 4 || getLE16(field + 2) > size - 4)
+      return false;
+
+    uint32_t len = getLE16(field + 2);
+
+    if (field[0] == 'K' && field[1] == 'R')
+      replaces = QByteArray((const char *)field + 4, len);
+
+    field += 4 + len;
+    size -= 4 + len;
+  }
+
+  return true;
+}
+
+bool KGzipMemberReader::open(const QString &fileName) {
+  close();
+  _fd = ::open(QFile::encodeName(fileName).constData(), O_RDONLY);
+
+  if (_fd < 0)
+    return false;
+
+  struct stat statInfo;
+
+  if (fstat(_fd, &statInfo) != 0) {
+    close();
+    return false;
+  }
+
+  // Hop from one member header to the next. This reads a few bytes per
+  // member, nothing else.
+
+  int64_t fileSize = statInfo.st_size;
+  int64_t offset = 0;
+
+  while (offset < fileSize) {
+    unsigned char header[GZIP_HEADER_SIZE];
+
+    if (fileSize - offset < GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE ||
+        !readFully(_fd, header, sizeof(header), offset) ||
+        header[0] != 0x1f || header[1] != 0x8b || header[2] != Z_DEFLATED ||
+        header[3] != GZIP_FLAG_EXTRA || getLE16(header + 10) < GZIP_KD_XLEN ||
+        header[12] != 'K' || header[13] != 'D' || header[14] != 8 ||
+        header[15] != 0) {
+      // Not written by KGzipMemberWriter
+      close();
+      return false;
+    }
+
+    KGzipMember member;
+    member.offset = offset;
+    member.size = getLE32(header + 16);
+    member.uncompressedSize = getLE32(header + 20);
+
+    uint32_t xlen = getLE16(header + 10);
+
+    if (member.size < 12 + xlen + GZIP_TRAILER_SIZE ||
+        member.size > fileSize - offset ||
+        (xlen > GZIP_KD_XLEN &&
+         !readReplaces(_fd, offset + GZIP_HEADER_SIZE, xlen - GZIP_KD_XLEN,
+                       member.replaces))) {
+      close();
+      return false;
+    }
+
+    _members.append(member);
+    offset += member.size;
+  }
+
+  if (_members.isEmpty()) {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+void KGzipMemberReader::close() {
+  if (_fd >= 0)
+    ::close(_fd);
+
+  _fd = -1;
+  _members.clear();
+}
+
+char *KGzipMemberReader::inflateMember(int i) const {
+  if (_fd < 0 || i < 0 || i >= _members.size())
+    return 0;
+
+  const KGzipMember &member = _members[i];
+  unsigned char *in = (unsigned char *)malloc(member.size);
+  char *out = (char *)malloc((size_t)member.uncompressedSize + 1);
+  bool ok = in && out && readFully(_fd, in, member.size, member.offset);
+
+  if (ok) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    ok = inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK; // gzip wrapper
+
+    if (ok) {
+      stream.next_in = in;
+      stream.avail_in = member.size;
+      stream.next_out = (Bytef *)out;
+      stream.avail_out = member.uncompressedSize;
+
+      ok = inflate(&stream, Z_FINISH) == Z_STREAM_END &&
+           stream.total_out == member.uncompressedSize;
+      inflateEnd(&stream);
+    }
+  }
+
+  free(in);
+
+  if (!ok) {
+    qCritical() << "Corrupt gzip member at offset " << member.offset << endl;
+    free(out);
+    return 0;
+  }
+
+  out[member.uncompressedSize] = 0;
+  return out;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+/*
+ *   Summary:	Multi-member gzip files for the KDirStat cache
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QThreadPool>
+#include <QVector>
+#include <stdint.h>
+#include <stdio.h>
+
+namespace KDirStat {
+/**
+ * One member of a multi-member gzip file, see @ref KGzipMemberWriter.
+ **/
+struct KGzipMember {
+  int64_t offset;            // start of the member in the file
+  uint32_t size;             // compressed size including header and trailer
+  uint32_t uncompressedSize;
+  QByteArray replaces;       // "KR" field, see KGzipMemberWriter::write()
+};
+
+/**
+ * Writer for gzip files that consist of many independently compressed
+ * members, each compressed in a thread of its own.
+ *
+ * The file is a perfectly normal gzip file: gunzip, zcat and gzread()
+ * read all members one after another as one stream. In addition, each
+ * member header has an extra field (subfield ID "KD") with the sizes of
+ * the member, so @ref KGzipMemberReader can find all members by hopping
+ * from one header to the next and decompress them in parallel. Tools
+ * that don't know the "KD" field ignore it, as RFC 1952 requires.
+ *
+ * @short Parallel multi-member gzip writer
+ **/
+class KGzipMemberWriter {
+public:
+  /**
+   * Constructor. Call @ref open() before anything else.
+   **/
+  KGzipMemberWriter();
+
+  /**
+   * Destructor. Closes the file if it is still open.
+   **/
+  ~KGzipMemberWriter();
+
+  /**
+   * Create file 'fileName' or, if 'append' is 'true', add members at the
+   * end of it. Returns 'true' if OK.
+   *
+   * When appending, a failure in @ref close() cuts the file back to its
+   * old size, so it never ends with a partial member.
+   **/
+  bool open(const QString &fileName, bool append = false);
+
+  /**
+   * Compress 'data' as one member in the background. Members end up in
+   * the file in the order of the write() calls. This blocks only if too
+   * many members are still waiting to be compressed.
+   *
+   * If 'replaces' is not empty, it goes to another extra field (subfield
+   * ID "KR") of the member header, so readers can find it by hopping from
+   * header to header without decompressing anything. What it means is up
+   * to the caller.
+   **/
+  void write(const QByteArray &data,
+             const QByteArray &replaces = QByteArray());
+
+  /**
+   * Wait for all members to be written and close the file. Returns 'true'
+   * if everything was written successfully.
+   **/
+  bool close();
+
+  /**
+   * Compress 'data' into a complete gzip member with a "KD" field and, if
+   * 'replaces' is not empty, a "KR" field.
+   **/
+  static QByteArray compressMember(const QByteArray &data,
+                                   const QByteArray &replaces = QByteArray());
+
+private:
+  KGzipMemberWriter(const KGzipMemberWriter &) = delete;
+  KGzipMemberWriter &operator=(const KGzipMemberWriter &) = delete;
+
+  class Task;
+
+  /**
+   * Wait for the oldest pending member and write it to the file.
+   **/
+  void writeOldest();
+
+  QString _fileName;
+  FILE *_file;
+  bool _ok;
+  qint64 _appendedTo; // size before appending; -1 unless appending
+  QThreadPool _pool;
+  QList<Task *> _pending;
+  int _maxPending;
+};
+
+/**
+ * Reader for gzip files written by @ref KGzipMemberWriter.
+ *
+ * @short Random access to the members of a multi-member gzip file
+ **/
+class KGzipMemberReader {
+public:
+  /**
+   * Constructor. Call @ref open() before anything else.
+   **/
+  KGzipMemberReader();
+
+  /**
+   * Destructor. Closes the file.
+   **/
+  ~KGzipMemberReader();
+
+  /**
+   * Open 'fileName' and find all its members. Returns 'false' if the
+   * file can't be opened or if any part of it is not a member with a "KD"
+   * field; such a file can still be read sequentially with gzread().
+   **/
+  bool open(const QString &fileName);
+
+  /**
+   * Close the file.
+   **/
+  void close();
+
+  /**
+   * Returns all members in file order.
+   **/
+  const QVector<KGzipMember> &members() const { return _members; }
+
+  /**
+   * Decompress member no. 'i'. Returns a malloc()ed buffer with
+   * members()[i].uncompressedSize bytes plus a 0 byte after them, or 0 on
+   * error. The caller has to free() it. Safe to call from several threads
+   * at once.
+   **/
+  char *inflateMember(int i) const;
+
+private:
+  KGzipMemberReader(const KGzipMemberReader &) = delete;
+  KGzipMemberReader &operator=(const KGzipMemberReader &) = delete;
+
+  int _fd;
+  QVector<KGzipMember> _members;
+};
+
+} // namespace KDirStat
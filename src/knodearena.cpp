@@ -0,0 +1,283 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "knodearena.h"
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+// Upper limit of the address space to reserve for the node file. The
+// actual reservation is the free space of the file system the node file is
+// on, since the file can't grow beyond that anyway.
+#define NODE_FILE_MAX_RESERVE (1ULL << 40)
+
+// The node file grows in steps of this size.
+#define NODE_FILE_GROWTH (64ULL * 1024 * 1024)
+
+// Alignment of all allocations
+#define NODE_ALIGNMENT 16
+
+// Number of released items a thread hands over to the others at once
+#define NODE_BATCH_SIZE 256
+
+using namespace KDirStat;
+
+KNodeArena *KNodeArena::instance() {
+  static KNodeArena arena;
+  return &arena;
+}
+
+/**
+ * The free lists of one thread, one per size class. Released items are
+ * linked through their first word; the batches handed over to the other
+ * threads are linked through the second word of their first item.
+ **/
+struct KNodeArena::ThreadCache {
+  void *freeList[MaxSizeClasses];
+  int count[MaxSizeClasses];
+
+  ThreadCache() {
+    for (int i = 0; i < MaxSizeClasses; i++) {
+      freeList[i] = 0;
+      count[i] = 0;
+    }
+  }
+
+  ~ThreadCache() {
+    // Don't take the released items along when the thread goes away.
+
+    for (int i = 0; i < MaxSizeClasses; i++) {
+      if (freeList[i])
+        instance()->giveBatch(i, freeList[i]);
+    }
+  }
+};
+
+KNodeArena::KNodeArena()
+    : _fd(-1), _base(0), _reserved(0), _fileSize(0), _used(0) {
+  for (int i = 0; i < MaxSizeClasses; i++) {
+    _sizes[i].store(0, std::memory_order_relaxed);
+    _batches[i] = 0;
+  }
+}
+
+KNodeArena::~KNodeArena() {
+  // Intentionally not unmapping anything: Static objects with items in
+  // the node file might still be destroyed after this. The file itself is
+  // already unlinked, so it goes away with the process.
+}
+
+bool KNodeArena::open(const QString &dir) {
+  QMutexLocker locker(&_mutex);
+
+  if (base())
+    return true;
+
+  QByteArray pattern = QFile::encodeName(
+      QDir(dir).absoluteFilePath(".k4dirstat-nodes-XXXXXX"));
+
+  _fd = mkstemp(pattern.data());
+
+  if (_fd < 0) {
+    qCritical() << "Can't create node file " << pattern << ": "
+                << strerror(errno) << endl;
+    return false;
+  }
+
+  // Nobody else needs to see this file, and it should not outlive us.
+  unlink(pattern.constData());
+
+  // The reservation is only address space, no memory and no disk space:
+  // Pages are backed by the file as it grows. Still, keep it no larger
+  // than needed, and take less if the address space is limited (ulimit -v,
+  // 32 bit systems).
+
+  unsigned long long limit = NODE_FILE_MAX_RESERVE;
+  struct statvfs fs;
+
+  if (fstatvfs(_fd, &fs) == 0 &&
+      (unsigned long long)fs.f_bavail * fs.f_frsize < limit)
+    limit = (unsigned long long)fs.f_bavail * fs.f_frsize;
+
+  size_t reserve = limit < SIZE_MAX ? (size_t)limit : SIZE_MAX;
+
+  reserve -= reserve % NODE_FILE_GROWTH;
+  void *mapping = MAP_FAILED;
+
+  while (reserve >= NODE_FILE_GROWTH) {
+    mapping = mmap(0, reserve, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_NORESERVE, _fd, 0);
+
+    if (mapping != MAP_FAILED || errno != ENOMEM)
+      break;
+
+    reserve /= 2;
+    reserve -= reserve % NODE_FILE_GROWTH;
+  }
+
+  if (mapping == MAP_FAILED) {
+    if (reserve < NODE_FILE_GROWTH)
+      qCritical() << "Not enough space for a node file in " << dir << endl;
+    else
+      qCritical() << "Can't map node file: " << strerror(errno) << endl;
+
+    ::close(_fd);
+    _fd = -1;
+    return false;
+  }
+
+  _reserved = reserve;
+  _base.store((char *)mapping, std::memory_order_release);
+  qDebug() << "Using node file in " << dir << " for up to " << _reserved
+           << " bytes" << endl;
+
+  return true;
+}
+
+KNodeArena::ThreadCache &KNodeArena::threadCache() {
+  static thread_local ThreadCache cache;
+  return cache;
+}
+
+int KNodeArena::sizeClass(size_t size) {
+  for (int i = 0; i < MaxSizeClasses; i++) {
+    size_t classSize = _sizes[i].load(std::memory_order_acquire);
+
+    // Take a free slot unless another thread is faster; classSize is what
+    // that one took then.
+
+    if (classSize == 0 &&
+        _sizes[i].compare_exchange_strong(classSize, size,
+                                          std::memory_order_acq_rel))
+      return i;
+
+    if (classSize == size)
+      return i;
+  }
+
+  return -1;
+}
+
+void *KNodeArena::takeBatch(int sizeClass) {
+  QMutexLocker locker(&_mutex);
+  void *batch = _batches[sizeClass];
+
+  if (batch)
+    _batches[sizeClass] = ((void **)batch)[1];
+
+  return batch;
+}
+
+void KNodeArena::giveBatch(int sizeClass, void *batch) {
+  QMutexLocker locker(&_mutex);
+  ((void **)batch)[1] = _batches[sizeClass];
+  _batches[sizeClass] = batch;
+}
+
+bool KNodeArena::growFile(size_t end) {
+  QMutexLocker locker(&_mutex);
+  size_t fileSize = _fileSize.load(std::memory_order_relaxed);
+
+  if (end <= fileSize) // Another thread already did it.
+    return true;
+
+  size_t newSize = end + NODE_FILE_GROWTH - 1;
+  newSize -= newSize % NODE_FILE_GROWTH;
+
+  if (ftruncate(_fd, newSize) != 0) {
+    qCritical() << "Can't grow node file to " << newSize << " bytes: "
+                << strerror(errno) << endl;
+    return false;
+  }
+
+  _fileSize.store(newSize, std::memory_order_release);
+
+  return true;
+}
+
+void *KNodeArena::allocate(size_t size) {
+  if (!base())
+    return 0;
+
+  size = (size + NODE_ALIGNMENT - 1) & ~(size_t)(NODE_ALIGNMENT - 1);
+
+  // Reuse a released item of the same size if there is one.
+
+  int index = sizeClass(size);
+
+  if (index >= 0) {
+    ThreadCache &cache = threadCache();
+
+    if (!cache.freeList[index]) {
+      // The count only decides when to hand items over again, so it doesn't
+      // matter that the rest a thread left behind may be a larger batch.
+
+      cache.freeList[index] = takeBatch(index);
+      cache.count[index] = cache.freeList[index] ? NODE_BATCH_SIZE : 0;
+    }
+
+    void *ptr = cache.freeList[index];
+
+    if (ptr) {
+      cache.freeList[index] = *(void **)ptr;
+      cache.count[index]--;
+      return ptr;
+    }
+  }
+
+  size_t offset = _used.fetch_add(size, std::memory_order_relaxed);
+
+  if (offset + size > _reserved) // full; use the heap
+    return 0;
+
+  // Accessing the mapping beyond the end of the file would crash, so make
+  // the file larger first.
+
+  if (offset + size > _fileSize.load(std::memory_order_acquire) &&
+      !growFile(offset + size))
+    return 0;
+
+  return base() + offset;
+}
+
+bool KNodeArena::release(void *ptr, size_t size) {
+  if (!contains(ptr))
+    return false;
+
+  size = (size + NODE_ALIGNMENT - 1) & ~(size_t)(NODE_ALIGNMENT - 1);
+  int index = sizeClass(size);
+
+  if (index < 0)
+    return true; // leaked, but only within the node file
+
+  ThreadCache &cache = threadCache();
+  *(void **)ptr = cache.freeList[index];
+  cache.freeList[index] = ptr;
+
+  if (++cache.count[index] >= 2 * NODE_BATCH_SIZE) {
+    // Typically the thread that deletes a subtree: Hand the items over to
+    // the threads that allocate, but keep some for this one.
+
+    void *batch = cache.freeList[index];
+    void *last = batch;
+
+    for (int i = 1; i < NODE_BATCH_SIZE; i++)
+      last = *(void **)last;
+
+    cache.freeList[index] = *(void **)last;
+    *(void **)last = 0;
+    cache.count[index] -= NODE_BATCH_SIZE;
+    giveBatch(index, batch);
+  }
+
+  return true;
+}
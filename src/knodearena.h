@@ -0,0 +1,123 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include <QMutex>
+#include <QString>
+#include <atomic>
+#include <stddef.h>
+
+namespace KDirStat {
+/**
+ * Storage for the items of a tree in a memory-mapped file rather than on
+ * the heap.
+ *
+ * For trees that are too large for the available RAM, this lets the
+ * operating system page items in and out as needed instead of making the
+ * whole machine swap. Items are allocated sequentially in the order they
+ * are read, so all children of one directory are next to each other: A
+ * view that expands a directory only touches the pages of that directory.
+ *
+ * The file is created in a user-configurable directory and removed right
+ * away, so it disappears when the program terminates, however that
+ * happens. Items' names (their QString data) and children lists still live
+ * on the heap.
+ *
+ * Allocating usually takes no lock: New items are taken from the end of
+ * the used part of the file with an atomic add, and each thread keeps the
+ * items it released in free lists of its own for its next allocations.
+ * Only growing the file and handing over batches of released items between
+ * threads, when one has too many (e.g. the one deleting a subtree) or none
+ * left, take the mutex.
+ *
+ * This is used through @ref KFileInfo::operator new(). Until @ref open()
+ * is called, and if it fails, items are simply allocated on the heap.
+ *
+ * @short Memory-mapped file backend for tree items
+ **/
+class KNodeArena {
+public:
+  /**
+   * Returns the global instance.
+   **/
+  static KNodeArena *instance();
+
+  /**
+   * Create the node file in directory 'dir' and map it. Returns 'true' if
+   * the node file is in use now. Once open, it remains open for the
+   * lifetime of the program.
+   *
+   * This reserves address space for as much as the file system of 'dir'
+   * has free, up to 1 TiB; only what is allocated is backed by the file.
+   * Once that reservation is used up, items are allocated on the heap
+   * again.
+   **/
+  bool open(const QString &dir);
+
+  /**
+   * Returns 'true' if items are allocated in the node file.
+   **/
+  bool isOpen() const { return base() != 0; }
+
+  /**
+   * Allocate 'size' bytes for an item. Returns 0 if the node file is not
+   * open or full. This is thread safe.
+   **/
+  void *allocate(size_t size);
+
+  /**
+   * Release memory that was allocated with @ref allocate(). Returns
+   * 'false' if 'ptr' is not in the node file. This is thread safe.
+   **/
+  bool release(void *ptr, size_t size);
+
+  /**
+   * Returns 'true' if 'ptr' is in the node file.
+   **/
+  bool contains(const void *ptr) const {
+    const char *start = base();
+    return start && (const char *)ptr >= start &&
+           (const char *)ptr < start + _reserved;
+  }
+
+  /**
+   * Returns the number of bytes taken from the node file so far, including
+   * released ones.
+   **/
+  size_t used() const {
+    size_t used = _used.load(std::memory_order_relaxed);
+    return used < _reserved ? used : _reserved;
+  }
+
+private:
+  KNodeArena();
+  ~KNodeArena();
+  KNodeArena(const KNodeArena &) = delete;
+  KNodeArena &operator=(const KNodeArena &) = delete;
+
+  static const int MaxSizeClasses = 8;
+
+  struct ThreadCache; // the free lists of one thread
+
+  static ThreadCache &threadCache();
+  int sizeClass(size_t size);
+  void *takeBatch(int sizeClass);
+  void giveBatch(int sizeClass, void *batch);
+  bool growFile(size_t end);
+
+  char *base() const { return _base.load(std::memory_order_acquire); }
+
+  QMutex _mutex;
+  int _fd;
+  std::atomic<char *> _base; // 0 until open()
+  size_t _reserved;          // address space reserved for the mapping
+  std::atomic<size_t> _fileSize; // currently usable part of it
+  std::atomic<size_t> _used; // bytes taken so far, including released ones
+  std::atomic<size_t> _sizes[MaxSizeClasses]; // 0: not in use yet
+  void *_batches[MaxSizeClasses]; // released items handed over by threads
+
+}; // class KNodeArena
+
+} // namespace KDirStat
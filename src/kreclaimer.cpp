@@ -0,0 +1,56 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kreclaimer.h"
+#include "kfileinfo.h"
+
+using namespace KDirStat;
+
+KSubtreeReclaimer::KSubtreeReclaimer() : QThread(), _stopping(false) {}
+
+KSubtreeReclaimer::~KSubtreeReclaimer() {
+  _mutex.lock();
+  _stopping = true;
+  _wakeUp.wakeOne();
+  _mutex.unlock();
+
+  wait();
+
+  // Anything that was queued without the thread ever running
+
+  while (!_pending.isEmpty())
+    delete _pending.takeFirst();
+}
+
+void KSubtreeReclaimer::discard(KFileInfo *subtree) {
+  if (!subtree)
+    return;
+
+  QMutexLocker locker(&_mutex);
+  _pending.append(subtree);
+
+  if (!isRunning())
+    start(QThread::LowestPriority);
+  else
+    _wakeUp.wakeOne();
+}
+
+void KSubtreeReclaimer::run() {
+  QMutexLocker locker(&_mutex);
+
+  while (true) {
+    while (!_pending.isEmpty()) {
+      KFileInfo *subtree = _pending.takeFirst();
+
+      locker.unlock();
+      delete subtree;
+      locker.relock();
+    }
+
+    if (_stopping)
+      break;
+
+    _wakeUp.wait(&_mutex);
+  }
+}
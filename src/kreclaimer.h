@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+namespace KDirStat {
+// Forward declarations
+class KFileInfo;
+
+/**
+ * Low priority thread that deletes discarded subtrees.
+ *
+ * Deleting a subtree with millions of items takes a long time. Rather than
+ * blocking the GUI with that, a @ref KDirTree hands subtrees it no longer
+ * needs over to this thread. By that time the subtree has to be completely
+ * detached: Nobody else (no view, no read job, no selection) may refer to
+ * any item in it any more.
+ *
+ * @short Background deletion of discarded subtrees
+ **/
+class KSubtreeReclaimer : public QThread {
+public:
+  /**
+   * Constructor. The thread is only started when there is something to
+   * delete.
+   **/
+  KSubtreeReclaimer();
+
+  /**
+   * Destructor. Waits until all pending subtrees are deleted.
+   **/
+  virtual ~KSubtreeReclaimer();
+
+  /**
+   * Take over ownership of 'subtree' and delete it in the background.
+   **/
+  void discard(KFileInfo *subtree);
+
+protected:
+  /**
+   * Thread main loop: Delete subtrees as they come in.
+   **/
+  void run() override;
+
+private:
+  QMutex _mutex;
+  QWaitCondition _wakeUp;
+  QList<KFileInfo *> _pending;
+  bool _stopping;
+
+}; // class KSubtreeReclaimer
+
+} // namespace KDirStat
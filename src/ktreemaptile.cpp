@@ -18,23 +18,34 @@ using namespace KDirStat;
 using std::max;
 using std::min;
 
+typedef std::pair<KFileSize, KFileInfo*> SizedChild;
+
 struct childSizeComparator {
-  bool operator() (KFileInfo* f1, KFileInfo* f2) {
-    return f1->totalSize() > f2->totalSize();
+  bool operator() (const SizedChild &c1, const SizedChild &c2) {
+    return c1.first > c2.first;
   }
 };
 
 std::vector<KFileInfo*> sortedChildBySize(KFileInfo * info, KFileSize minSize) {
   std::vector<KFileInfo*> r;
-  r.reserve(info->numChildren());
-  for(size_t i = 0; i < info->numChildren(); i++) {
-    if(info->child(i)->totalSize() >= minSize)
-      r.push_back(info->child(i));
-  }
-  if(info->dotEntry() && info->dotEntry()->totalSize() >= minSize)
-      r.push_back(info->dotEntry());
-  std::sort(r.begin(), r.end(), childSizeComparator());
-  r.shrink_to_fit();
+  if(!info->isDirInfo())
+    return r;
+
+  // Fetch each size only once rather than in every comparison
+  KDirInfo * dir = static_cast<KDirInfo*>(info);
+  std::vector<SizedChild> sized;
+  sized.reserve(dir->numChildren() + 1);
+  dir->forEachChild([&](KFileInfo * child) {
+    KFileSize size = child->totalSize();
+    if(size >= minSize)
+      sized.push_back(SizedChild(size, child));
+  });
+  if(dir->dotEntry() && dir->dotEntry()->totalSize() >= minSize)
+    sized.push_back(SizedChild(dir->dotEntry()->totalSize(), dir->dotEntry()));
+  std::sort(sized.begin(), sized.end(), childSizeComparator());
+  r.reserve(sized.size());
+  for(size_t i = 0; i < sized.size(); i++)
+    r.push_back(sized[i].second);
   return r;
 }
 
@@ -57,6 +57,9 @@ KTreemapView::KTreemapView(KDirTree *tree, QWidget *parent,
   connect(tree, SIGNAL(deletingChild(KFileInfo *)), this,
           SLOT(deleteNotify(KFileInfo *)));
 
+  connect(tree, SIGNAL(collapsingSubtree(KFileInfo *)), this,
+          SLOT(deleteNotify(KFileInfo *)));
+
   connect(tree, SIGNAL(childDeleted()), &_refreshTimer, SLOT(start()));
   connect(&_refreshTimer, SIGNAL(timeout()), this, SLOT(rebuildTreemap()));
 }
@@ -229,7 +232,16 @@ void KTreemapView::zoomIn() {
   if (newRootTile) {
     KFileInfo *newRoot = newRootTile->orig();
 
-    if (newRoot->isDir() || newRoot->isDotEntry())
+    if (newRoot->isAggregate()) {
+      // Only the totals are known: Read the content again. The treemap
+      // will be rebuilt with the new subtree as its root as soon as the
+      // old one is deleted.
+
+      QString url = newRoot->debugUrl();
+
+      if (_tree->expandAggregate(newRoot))
+        _savedRootUrl = url;
+    } else if (newRoot->isDir() || newRoot->isDotEntry())
       rebuildTreemap(newRoot);
   }
 }
@@ -0,0 +1,262 @@
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "ktreesnapshot.h"
+#include "kdirinfo.h"
+#include "ktreewalk.h"
+#include <algorithm>
+
+using namespace KDirStat;
+
+static bool nameLessThan(const KSnapshotNodePtr &a,
+                         const KSnapshotNodePtr &b) {
+  return a->name < b->name;
+}
+
+int KSnapshotNode::findChild(const QString &childName) const {
+  int low = 0;
+  int high = children.size() - 1;
+
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    const QString &midName = children[mid]->name;
+
+    if (midName < childName)
+      low = mid + 1;
+    else if (childName < midName)
+      high = mid - 1;
+    else
+      return mid;
+  }
+
+  return -1;
+}
+
+/**
+ * Post-order traversal that builds snapshot nodes. The children of dot
+ * entries go straight to the node of the dot entry's parent.
+ **/
+struct KSnapshotBuildVisitor : public KTreeVisitor {
+  QVector<KSnapshotNodePtr> stack;
+  KSnapshotNodePtr result;
+
+  static KSnapshotNode *newNode(KFileInfo *item) {
+    KSnapshotNode *node = new KSnapshotNode;
+    node->name = item->name();
+    node->isDir = item->isDir();
+    node->size = item->size();
+    node->totalSize = item->totalSize();
+    node->totalItems = item->totalItems();
+    node->mtime = item->mtime();
+
+    return node;
+  }
+
+  void add(const KSnapshotNodePtr &node) {
+    if (stack.isEmpty())
+      result = node;
+    else
+      stack.last()->children.append(node);
+  }
+
+  bool enterDir(KDirInfo *dir) {
+    if (!dir->isDotEntry())
+      stack.append(KSnapshotNodePtr(newNode(dir)));
+
+    return true;
+  }
+
+  void leaveDir(KDirInfo *dir) {
+    if (dir->isDotEntry())
+      return;
+
+    KSnapshotNodePtr node = stack.takeLast();
+
+    if (!node->children.isEmpty()) {
+      // Sum up the totals here rather than taking them from the tree:
+      // There are no dot entries that would count as items.
+
+      std::sort(node->children.begin(), node->children.end(), nameLessThan);
+      node->totalSize = node->size;
+      node->totalItems = 0;
+
+      for (int i = 0; i < node->children.size(); i++) {
+        node->totalSize += node->children[i]->totalSize;
+        node->totalItems += node->children[i]->totalItems + 1;
+      }
+    }
+
+    add(node);
+  }
+
+  void visitFile(KFileInfo *file) { add(KSnapshotNodePtr(newNode(file))); }
+};
+
+KSnapshotNodePtr KTreeSnapshot::buildNode(KFileInfo *subtree) {
+  KSnapshotBuildVisitor visitor;
+  walkTree(subtree, visitor);
+
+  return visitor.result;
+}
+
+KTreeSnapshot KTreeSnapshot::build(KFileInfo *root) {
+  if (!root)
+    return KTreeSnapshot();
+
+  return KTreeSnapshot(buildNode(root));
+}
+
+KTreeSnapshot KTreeSnapshot::withSubtree(const QStringList &path,
+                                         KFileInfo *subtree) const {
+  if (path.isEmpty())
+    return build(subtree);
+
+  if (!_root)
+    return *this;
+
+  // Find the original nodes along the path, down to the parent of the
+  // item to replace.
+
+  QVector<KSnapshotNode *> chain;
+  KSnapshotNode *node = _root.data();
+  chain.append(node);
+
+  for (int i = 0; i < path.size() - 1; i++) {
+    int index = node->findChild(path[i]);
+
+    if (index < 0)
+      return *this; // Not in this snapshot: nothing to replace
+
+    node = node->children[index].data();
+    chain.append(node);
+  }
+
+  KSnapshotNodePtr newChild;
+
+  if (subtree)
+    newChild = buildNode(subtree);
+
+  // Copy only the nodes on the path, bottom-up. Each copy shares all its
+  // other children with the original.
+
+  KFileSize sizeDelta = 0;
+  KFileCount itemsDelta = 0;
+
+  for (int level = chain.size() - 1; level >= 0; level--) {
+    KSnapshotNode *copy = new KSnapshotNode(*chain[level]);
+    const QString &name = path[level];
+    int index = copy->findChild(name);
+
+    if (level == chain.size() - 1) {
+      // This is where the actual change is.
+
+      if (index >= 0) {
+        sizeDelta -= copy->children[index]->totalSize;
+        itemsDelta -= copy->children[index]->totalItems + 1;
+      }
+
+      if (newChild) {
+        sizeDelta += newChild->totalSize;
+        itemsDelta += newChild->totalItems + 1;
+      }
+    }
+
+    if (index >= 0) {
+      if (newChild)
+        copy->children[index] = newChild;
+      else
+        copy->children.remove(index);
+    } else if (newChild) {
+      QVector<KSnapshotNodePtr>::iterator pos =
+          std::lower_bound(copy->children.begin(), copy->children.end(),
+                           newChild, nameLessThan);
+      copy->children.insert(pos, newChild);
+    }
+
+    copy->totalSize += sizeDelta;
+    copy->totalItems += itemsDelta;
+    newChild = KSnapshotNodePtr(copy);
+  }
+
+  return KTreeSnapshot(newChild);
+}
+
+void KTreeSnapshot::diff(const KTreeSnapshot &before,
+                         const KTreeSnapshot &after,
+                         QList<KSnapshotChange> &changes) {
+  struct Pair {
+    const KSnapshotNode *before;
+    const KSnapshotNode *after;
+    QString path;
+  };
+
+  QVector<Pair> stack;
+
+  if (before._root != after._root) {
+    Pair top = {before._root.data(), after._root.data(), QString()};
+    stack.append(top);
+  }
+
+  while (!stack.isEmpty()) {
+    Pair pair = stack.takeLast();
+
+    if (!pair.before || !pair.after || !pair.before->isDir ||
+        !pair.after->isDir) {
+      KSnapshotChange change;
+      change.kind = !pair.before ? KSnapshotChange::Added
+                    : !pair.after ? KSnapshotChange::Removed
+                                  : KSnapshotChange::Changed;
+      change.path = pair.path;
+      change.sizeBefore = pair.before ? pair.before->totalSize : 0;
+      change.sizeAfter = pair.after ? pair.after->totalSize : 0;
+
+      if (change.kind != KSnapshotChange::Changed ||
+          change.sizeBefore != change.sizeAfter ||
+          pair.before->mtime != pair.after->mtime ||
+          pair.before->isDir != pair.after->isDir)
+        changes.append(change);
+
+      continue;
+    }
+
+    // Both are directories: Merge their sorted children lists.
+
+    const QVector<KSnapshotNodePtr> &a = pair.before->children;
+    const QVector<KSnapshotNodePtr> &b = pair.after->children;
+    QString prefix = pair.path.isEmpty() ? QString() : pair.path + "/";
+    int i = 0;
+    int j = 0;
+
+    while (i < a.size() || j < b.size()) {
+      Pair child = {0, 0, QString()};
+
+      if (j >= b.size() || (i < a.size() && a[i]->name < b[j]->name)) {
+        child.before = a[i++].data();
+      } else if (i >= a.size() || b[j]->name < a[i]->name) {
+        child.after = b[j++].data();
+      } else {
+        child.before = a[i++].data();
+        child.after = b[j++].data();
+
+        if (child.before == child.after) // shared: unchanged
+          continue;
+      }
+
+      child.path =
+          prefix + (child.before ? child.before->name : child.after->name);
+      stack.append(child);
+    }
+  }
+}
+
+QStringList KTreeSnapshot::pathOf(KFileInfo *item, KFileInfo *root) {
+  QStringList path;
+
+  for (; item && item != root; item = item->parent()) {
+    if (!item->isDotEntry())
+      path.prepend(item->name());
+  }
+
+  return path;
+}
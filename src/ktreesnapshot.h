@@ -0,0 +1,123 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kfileinfo.h"
+#include <QExplicitlySharedDataPointer>
+#include <QList>
+#include <QSharedData>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+namespace KDirStat {
+class KSnapshotNode;
+typedef QExplicitlySharedDataPointer<KSnapshotNode> KSnapshotNodePtr;
+
+/**
+ * One item of a @ref KTreeSnapshot. Nodes are never changed once they are
+ * part of a snapshot, so any number of snapshots can share them.
+ *
+ * Unlike in a @ref KDirTree, there are no dot entries: All children of a
+ * directory are in one list, sorted by name.
+ **/
+class KSnapshotNode : public QSharedData {
+public:
+  QString name;
+  bool isDir;
+  KFileSize size;        // own size (directories: the directory entry)
+  KFileSize totalSize;   // including all children
+  KFileCount totalItems; // not including this item
+  time_t mtime;
+  QVector<KSnapshotNodePtr> children;
+
+  /**
+   * Returns the index of the child named 'name' or -1 if there is none.
+   **/
+  int findChild(const QString &name) const;
+};
+
+/**
+ * A difference between two snapshots, see @ref KTreeSnapshot::diff().
+ **/
+struct KSnapshotChange {
+  enum Kind { Added, Removed, Changed };
+
+  Kind kind;
+  QString path;          // relative to the snapshot root
+  KFileSize sizeBefore;  // total size, 0 for Added
+  KFileSize sizeAfter;   // total size, 0 for Removed
+};
+
+/**
+ * Immutable, cheap to copy state of a directory tree.
+ *
+ * Copying a snapshot only copies a pointer. Deriving a changed snapshot
+ * from an existing one with @ref withSubtree() copies only the nodes on
+ * the path from the change to the root; everything else is shared. So
+ * keeping many versions of a tree, e.g. the state before and after each
+ * cleanup action, costs little more than the changes themselves. Names
+ * are shared with the live tree as well (QString is implicitly shared).
+ *
+ * Comparing two snapshots with @ref diff() skips every subtree they
+ * share, so it only takes time proportional to what actually changed.
+ *
+ * @short Copy-on-write snapshot of a directory tree
+ **/
+class KTreeSnapshot {
+public:
+  /**
+   * Constructor. Creates an empty snapshot.
+   **/
+  KTreeSnapshot() {}
+
+  /**
+   * Build a snapshot of the subtree below and including 'root'. This
+   * takes time proportional to the subtree size; it is only needed once
+   * for each tree.
+   **/
+  static KTreeSnapshot build(KFileInfo *root);
+
+  /**
+   * Returns 'true' if this snapshot is empty.
+   **/
+  bool isNull() const { return !_root; }
+
+  /**
+   * Returns the root node.
+   **/
+  const KSnapshotNode *root() const { return _root.data(); }
+
+  /**
+   * Returns a new snapshot where the item at 'path' (names relative to
+   * the root) is replaced by a snapshot of 'subtree', or removed if
+   * 'subtree' is 0. This snapshot stays unchanged. Totals along the path
+   * are updated accordingly.
+   **/
+  KTreeSnapshot withSubtree(const QStringList &path,
+                            KFileInfo *subtree) const;
+
+  /**
+   * Compare 'before' and 'after' and add all differences to 'changes'.
+   * Added and removed subtrees are reported only once at their top.
+   **/
+  static void diff(const KTreeSnapshot &before, const KTreeSnapshot &after,
+                   QList<KSnapshotChange> &changes);
+
+  /**
+   * Returns the path of 'item' relative to 'root' in the form that
+   * @ref withSubtree() expects.
+   **/
+  static QStringList pathOf(KFileInfo *item, KFileInfo *root);
+
+private:
+  KTreeSnapshot(const KSnapshotNodePtr &root) : _root(root) {}
+
+  static KSnapshotNodePtr buildNode(KFileInfo *subtree);
+
+  KSnapshotNodePtr _root;
+};
+
+} // namespace KDirStat
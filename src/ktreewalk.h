@@ -0,0 +1,180 @@
+#pragma once
+
+/*
+ *   License:	LGPL - See file COPYING.LIB for details.
+ */
+
+#include "kdirinfo.h"
+#include <QVarLengthArray>
+
+namespace KDirStat {
+/**
+ * Running URL of a tree traversal.
+ *
+ * Calling @ref KFileInfo::url() for every item of a traversal walks up to
+ * the top of the tree over and over again. Instead, a traversal can
+ * push() each item when descending into it and pop() it again when
+ * leaving it; @ref url() is then always the URL of the item pushed last,
+ * maintained in one single buffer that only ever grows to the length of
+ * the deepest path.
+ *
+ * @short URL of the current item of a tree traversal
+ **/
+class KUrlStack {
+public:
+  /**
+   * Constructor for a traversal that starts at a toplevel item.
+   **/
+  KUrlStack() {}
+
+  /**
+   * Constructor for a traversal that starts below 'parent': The next
+   * push() will append to the URL of 'parent'.
+   **/
+  KUrlStack(const KFileInfo *parent) {
+    if (parent)
+      parent->buildUrl(_url);
+  }
+
+  /**
+   * Descend into 'item': Append its name to the URL.
+   * Dot entries don't change the URL.
+   **/
+  void push(const KFileInfo *item) {
+    _lengths.append(_url.length());
+
+    if (item->isDotEntry())
+      return;
+
+    if (!_url.isEmpty() &&
+        !(_url.length() == 1 && _url.at(0) == '/')) // avoid duplicating slashes
+      _url += '/';
+
+    _url += item->name();
+  }
+
+  /**
+   * Leave the item pushed last.
+   **/
+  void pop() {
+    if (!_lengths.isEmpty()) {
+      _url.truncate(_lengths.last());
+      _lengths.removeLast();
+    }
+  }
+
+  /**
+   * Returns the URL of the item pushed last.
+   **/
+  const QString &url() const { return _url; }
+
+  /**
+   * Returns the number of items currently pushed.
+   **/
+  int depth() const { return _lengths.size(); }
+
+private:
+  QString _url;
+  QVarLengthArray<int, 64> _lengths;
+
+}; // class KUrlStack
+
+/**
+ * Base class for visitors for @ref walkTree() with default implementations
+ * that do nothing. Derived visitors simply hide the methods they need;
+ * there is nothing virtual here.
+ **/
+struct KTreeVisitor {
+  /**
+   * Called for each directory (including dot entries) in pre-order,
+   * i.e. before any of its children. Return false to skip the children
+   * (and the leaveDir() call).
+   **/
+  bool enterDir(KDirInfo *) { return true; }
+
+  /**
+   * Called for each directory in post-order, i.e. after all of its
+   * children, if enterDir() returned true.
+   **/
+  void leaveDir(KDirInfo *) {}
+
+  /**
+   * Called for each item that is not a directory.
+   **/
+  void visitFile(KFileInfo *) {}
+};
+
+/**
+ * Depth-first traversal of the subtree below and including 'top' with an
+ * explicit stack instead of recursion, so arbitrarily deep trees can be
+ * traversed without running out of stack space.
+ *
+ * 'visitor' is typically derived from @ref KTreeVisitor. It is a template
+ * parameter, so its methods are resolved at compile time and can be
+ * inlined, and the node kind is decided by the non-virtual
+ * @ref KFileInfo::isDirInfo() flag. Only directories end up on the stack,
+ * and their children are accessed without any virtual calls.
+ *
+ * The dot entry of a directory is visited before its other children.
+ * leaveDir() may change the directory's own children (e.g. clean up its
+ * dot entry), but no method may touch the children lists of any of the
+ * directory's parents.
+ **/
+template <class Visitor> void walkTree(KFileInfo *top, Visitor &visitor) {
+  if (!top)
+    return;
+
+  if (!top->isDirInfo()) {
+    visitor.visitFile(top);
+    return;
+  }
+
+  KDirInfo *topDir = static_cast<KDirInfo *>(top);
+
+  if (!visitor.enterDir(topDir))
+    return;
+
+  struct Frame {
+    KDirInfo *dir;
+    size_t next; // index of the next child to visit; the dot entry is no. 0
+  };
+
+  QVarLengthArray<Frame, 64> stack;
+  Frame topFrame = {topDir, 0};
+  stack.append(topFrame);
+
+  while (!stack.isEmpty()) {
+    KDirInfo *dir = stack.last().dir;
+    size_t next = stack.last().next++;
+    KDirInfo *dotEntry = dir->dotEntry();
+    KFileInfo *child = 0;
+
+    if (dotEntry && next == 0)
+      child = dotEntry;
+    else {
+      if (dotEntry)
+        next--;
+
+      if (next < dir->numChildren())
+        child = dir->child(next);
+    }
+
+    if (!child) {
+      stack.removeLast();
+      visitor.leaveDir(dir);
+    } else if (child->isDirInfo()) {
+      KDirInfo *childDir = static_cast<KDirInfo *>(child);
+
+      if (visitor.enterDir(childDir)) {
+        if (childDir->numChildren() > 0 || childDir->dotEntry()) {
+          Frame frame = {childDir, 0};
+          stack.append(frame);
+        } else
+          visitor.leaveDir(childDir);
+      }
+    } else
+      visitor.visitFile(child);
+  }
+}
+
+} // namespace KDirStat